@@ -3,28 +3,111 @@
 
 #include "block.h"
 
-Block::Block() : data(0), length(0), lastaccessed(-1), dirty(false)
+
+//
+// Block storage arena
+//
+// Keys, values and block images are created and destroyed constantly,
+// always in a handful of sizes.  Storage is rounded up to a power of
+// two and freed buffers are kept on per-thread lists, one per size
+// class, so the steady state never reaches the allocator.  Every
+// buffer is still an ordinary new [], so anything may delete [] it.
+//
+
+#define ARENA_MIN_CLASS      4    // 16 bytes
+#define ARENA_NUM_CLASSES    17   // up to 1 MB
+#define ARENA_MAX_FREE       256  // buffers kept per size class
+
+struct BlockArena {
+  BYTE_T *freelist[ARENA_NUM_CLASSES][ARENA_MAX_FREE];
+  SIZE_T  numfree[ARENA_NUM_CLASSES];
+
+  BlockArena() { memset(numfree,0,sizeof(numfree)); }
+  ~BlockArena() {
+    for (SIZE_T c=0;c<ARENA_NUM_CLASSES;c++) {
+      while (numfree[c]>0) {
+	delete [] freelist[c][--numfree[c]];
+      }
+    }
+  }
+};
+
+static thread_local BlockArena arena;
+
+
+// Returns the size class for len, or -1 if it is too big to pool
+static int SizeClass(const SIZE_T len)
+{
+  int c=0;
+  while (((SIZE_T)1<<(c+ARENA_MIN_CLASS))<len) {
+    if (++c==ARENA_NUM_CLASSES) {
+      return -1;
+    }
+  }
+  return c;
+}
+
+
+static BYTE_T *ArenaAllocate(const SIZE_T len, SIZE_T &capacity)
+{
+  int c=SizeClass(len);
+
+  if (c<0) {
+    capacity=len;
+    return new BYTE_T [len];
+  }
+  capacity=(SIZE_T)1<<(c+ARENA_MIN_CLASS);
+  if (arena.numfree[c]>0) {
+    return arena.freelist[c][--arena.numfree[c]];
+  }
+  return new BYTE_T [capacity];
+}
+
+
+static void ArenaRelease(BYTE_T *d, const SIZE_T capacity)
+{
+  int c=SizeClass(capacity);
+
+  if (c<0 || ((SIZE_T)1<<(c+ARENA_MIN_CLASS))!=capacity || arena.numfree[c]==ARENA_MAX_FREE) {
+    delete [] d;
+  } else {
+    arena.freelist[c][arena.numfree[c]++]=d;
+  }
+}
+
+
+
+Block::Block() : data(0), length(0), capacity(0), lastaccessed(-1), dirty(false)
 {}
 
 
-Block::Block(const SIZE_T s) : data(0), length(0), lastaccessed(-1), dirty(false)
+Block::Block(const SIZE_T s) : data(0), length(0), capacity(0), lastaccessed(-1), dirty(false)
 {
   Resize(s);
 }
 
 
 
-Block::Block(const Block &rhs) : data(0), length(0), lastaccessed(rhs.lastaccessed), dirty(rhs.dirty)
+Block::Block(const Block &rhs) : data(0), length(0), capacity(0), lastaccessed(rhs.lastaccessed), dirty(rhs.dirty)
 {
-  if (Resize(rhs.length)!=ERROR_NOERROR) { 
+  if (Resize(rhs.length,false)!=ERROR_NOERROR) { 
     throw GenericException();
   }
-  memcpy(data,rhs.data,rhs.length);
+  if (rhs.length>0) {   // an empty block may have no storage at all
+    memcpy(data,rhs.data,rhs.length);
+  }
+}
+
+Block::Block(Block &&rhs) : data(rhs.data), length(rhs.length), capacity(rhs.capacity), lastaccessed(rhs.lastaccessed), dirty(rhs.dirty)
+{
+  rhs.data=0;
+  rhs.length=0;
+  rhs.capacity=0;
 }
 
-Block::Block(const char * str) : data(0), length(0), lastaccessed(-1), dirty(false)
+Block::Block(const char * str) : data(0), length(0), capacity(0), lastaccessed(-1), dirty(false)
 {
-  if (Resize(strlen(str))!=ERROR_NOERROR) { 
+  if (Resize(strlen(str),false)!=ERROR_NOERROR) { 
     throw GenericException();
   }
   memcpy(data,str,strlen(str));
@@ -32,15 +115,42 @@ Block::Block(const char * str) : data(0), length(0), lastaccessed(-1), dirty(fal
 
 Block::~Block() 
 { 
-  if (data) { delete [] data; data=0; }
+  if (data) { ArenaRelease(data,capacity); data=0; }
   length=0;
+  capacity=0;
   lastaccessed=-1;
   dirty=false;
 }
 
 Block & Block::operator=(const Block &rhs)
 {
-  return *(new (this) Block(rhs));
+  if (this!=&rhs) { 
+    if (Resize(rhs.length,false)!=ERROR_NOERROR) { 
+      throw GenericException();
+    }
+    if (rhs.length>0) { 
+      memcpy(data,rhs.data,rhs.length);
+    }
+    lastaccessed=rhs.lastaccessed;
+    dirty=rhs.dirty;
+  }
+  return *this;
+}
+
+Block & Block::operator=(Block &&rhs)
+{
+  if (this!=&rhs) { 
+    if (data) { ArenaRelease(data,capacity); }
+    data=rhs.data;
+    length=rhs.length;
+    capacity=rhs.capacity;
+    lastaccessed=rhs.lastaccessed;
+    dirty=rhs.dirty;
+    rhs.data=0;
+    rhs.length=0;
+    rhs.capacity=0;
+  }
+  return *this;
 }
 
 
@@ -50,22 +160,29 @@ Block & Block::operator=(const Block &rhs)
 ERROR_T Block::Resize(const SIZE_T newlen, const bool copy)
 {
   BYTE_T *d;
+  SIZE_T newcap;
+
+  if (data && newlen<=capacity) { 
+    length=newlen;
+    return ERROR_NOERROR;
+  }
   
   try {
-    d = new BYTE_T [newlen];
+    d = ArenaAllocate(newlen,newcap);
   }
   catch (...) {
     return ERROR_NOMEM;
   }
 
-  if (copy) { 
+  if (copy && data) { 
     memcpy(d,data,MIN(newlen,length));
   }
   
-  if (data) { delete [] data; }
+  if (data) { ArenaRelease(data,capacity); }
   data = d;
 
   length=newlen;
+  capacity=newcap;
 
   return ERROR_NOERROR;
 }
@@ -86,17 +203,20 @@ static char low2hex(BYTE_T x)
 
 
 
-#define MAX(x,y) ((x)>(y) ? (x) : (y))
+#define MIN(x,y) ((x)<(y) ? (x) : (y))
 
+// Bytes first, then length, so a block that is a prefix of another
+// comes first; the order keys are kept in
 bool Block::operator<(const Block &rhs) const
 {
-  return memcmp(data,rhs.data,MAX(length,rhs.length))<0;
+  int c=memcmp(data,rhs.data,MIN(length,rhs.length));
+  return c<0 || (c==0 && length<rhs.length);
 }
 
 
 bool Block::operator==(const Block &rhs) const
 {
-  return memcmp(data,rhs.data,MAX(length,rhs.length))==0;
+  return length==rhs.length && memcmp(data,rhs.data,length)==0;
 }
 
 ostream & Block::Print(ostream &os) const
@@ -10,18 +10,22 @@ using namespace std;
 struct Block {
   BYTE_T	*data;
   SIZE_T 	length;
+  SIZE_T        capacity;      // bytes actually allocated for data
   double        lastaccessed;  // for use in buffercache only
   bool          dirty;         // for use in buffercahce only
 
   Block();
   Block(const SIZE_T size);
   Block(const Block &rhs);
+  Block(Block &&rhs);
   Block(const char *data);
   virtual ~Block();
   Block & operator=(const Block &rhs);
+  Block & operator=(Block &&rhs);
 
   // returns one of ERROR_NOERROR (zero)
   // ERROR_NOMEM or other nonzero error code.
+  // Shrinking, or growing within capacity, reuses the current storage.
   ERROR_T Resize(const SIZE_T newlength, const bool copy=true);
 
   bool operator<(const Block &rhs) const;
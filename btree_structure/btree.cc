@@ -2,6 +2,16 @@
 #include <stdlib.h>
 #include <math.h>
 #include <vector>
+#include <utility>
+#include <string.h>
+#include <algorithm>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <chrono>
+#include <map>
 
 #include "btree.h"
 
@@ -17,19 +27,33 @@ KeyValuePair::KeyValuePair(const KeyValuePair &rhs) : key(rhs.key), value(rhs.va
 {
 }
 
+KeyValuePair::KeyValuePair(KeyValuePair &&rhs) : key(std::move(rhs.key)), value(std::move(rhs.value))
+{
+}
+
 KeyValuePair::~KeyValuePair()
 {
 }
 
 KeyValuePair &KeyValuePair::operator=(const KeyValuePair &rhs)
 {
-  return *(new (this) KeyValuePair(rhs));
+  key = rhs.key;
+  value = rhs.value;
+  return *this;
+}
+
+KeyValuePair &KeyValuePair::operator=(KeyValuePair &&rhs)
+{
+  key = std::move(rhs.key);
+  value = std::move(rhs.value);
+  return *this;
 }
 
 BTreeIndex::BTreeIndex(SIZE_T keysize,
                        SIZE_T valuesize,
                        BufferCache *cache,
-                       bool unique)
+                       bool unique) : opsplits(0), prefetchstop(false),
+    allocpolicy(BTREE_ALLOC_FIRST), blockspertrack(1), compresspolicy(BTREE_COMPRESS_NONE)
 {
   superblock.info.keysize = keysize;
   superblock.info.valuesize = valuesize;
@@ -37,7 +61,8 @@ BTreeIndex::BTreeIndex(SIZE_T keysize,
   // note: ignoring unique now
 }
 
-BTreeIndex::BTreeIndex()
+BTreeIndex::BTreeIndex() : opsplits(0), prefetchstop(false),
+    allocpolicy(BTREE_ALLOC_FIRST), blockspertrack(1), compresspolicy(BTREE_COMPRESS_NONE)
 {
   // shouldn't have to do anything
 }
@@ -45,1095 +70,4434 @@ BTreeIndex::BTreeIndex()
 //
 // Note, will not attach!
 //
-BTreeIndex::BTreeIndex(const BTreeIndex &rhs)
+BTreeIndex::BTreeIndex(const BTreeIndex &rhs) : opsplits(0), prefetchstop(false),
+    allocpolicy(BTREE_ALLOC_FIRST), blockspertrack(1), compresspolicy(BTREE_COMPRESS_NONE)
 {
   buffercache = rhs.buffercache;
   superblock_index = rhs.superblock_index;
   superblock = rhs.superblock;
+  allocpolicy = rhs.allocpolicy;
+  blockspertrack = rhs.blockspertrack;
+  freeprev = rhs.freeprev;
+  compresspolicy = rhs.compresspolicy;
+  compresscold = rhs.compresscold;
 }
 
 BTreeIndex::~BTreeIndex()
 {
-  // shouldn't have to do anything
+  StopPrefetch();
 }
 
+//
+// Like the copy, leaves this index detached.  What the old one had
+// running goes first: its prefetch thread, its log, its cached nodes
+// and its counts.
+//
 BTreeIndex &BTreeIndex::operator=(const BTreeIndex &rhs)
 {
-  return *(new (this) BTreeIndex(rhs));
+  if (this == &rhs)
+  {
+    return *this;
+  }
+
+  StopPrefetch();
+  log.Close();
+  nodecache.SetCapacity(0);
+  writeset.clear();
+  freed.clear();
+  allocated.clear();
+  {
+    lock_guard<mutex> guard(statslock);
+    for (SIZE_T i = 0; i < BTREE_NUM_OPS; i++)
+    {
+      opstats[i] = BTreeOpStats();
+    }
+  }
+  opsplits = 0;
+
+  buffercache = rhs.buffercache;
+  superblock_index = rhs.superblock_index;
+  superblock = rhs.superblock;
+  allocpolicy = rhs.allocpolicy;
+  blockspertrack = rhs.blockspertrack;
+  freeprev = rhs.freeprev;
+  compresspolicy = rhs.compresspolicy;
+  compresscold = rhs.compresscold;
+  return *this;
 }
 
-ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
+//
+// Operations
+//
+// A scope marks a public operation; one started inside another on the
+// same thread (a batch falling back on the single-key path) is part of
+// the outer one.
+//
+// Operations that only read share the index, so lookups and scans can
+// run on many threads at once; one that writes has it to itself.
+// Readers mostly meet in the node cache, which is sharded; the buffer
+// cache below it takes one reader at a time.  A callback handed to a
+// reader must not change the index.
+//
+// Inserts, updates and deletes start out sharing the index too, and
+// change their leaf in place under that leaf's latch.  The tree's
+// shape can't change while the index is shared, so the leaf found on
+// the way down is still the right one once latched.  A change that
+// would split or underfill the leaf escalates: it waits for the index
+// to itself and starts over on the usual path.  Every node is read
+// and written whole, as a copy, so readers never see half a change.
+//
+// Reads, writes, allocations and the rest are counted in the scope and
+// added to whichever kind of operation it is when it ends.
+//
+// Nodes an operation writes are kept in its write set, and reads see
+// them there.  Each reaches the buffer cache once, when the operation
+// commits, however many times the operation changed it.  They go out
+// in block order; the buffer cache, which writes back, decides when
+// each reaches the disk.  Blocks freed by the operation are handed back
+// to the cache after that.  Attach and BulkLoad write every node just
+// once anyway, so they write straight through rather than hold the
+// whole tree.
+//
+// With a log open, the write set goes into it as one record, and only
+// once that is synced does any of it reach the buffer cache, so the
+// cache may hold its random writes as long as it likes.  A leaf changed
+// in place is its own record, synced under the leaf's latch; other
+// writers latch other leaves and share the sync.  Writes straight
+// through are logged one by one and synced once at the end.  The
+// scope that finds the log grown too long checkpoints it, after it
+// has let go of the index.
+//
+// A scope reading a snapshot takes no latch at all.  It reads under
+// cachelock, where writers save a block's image for the snapshots just
+// before they overwrite it, so it sees either the saved image or a block
+// no writer has touched since the snapshot.  Operations started inside
+// it, such as the cursor a scan runs on, read the snapshot too.
+//
+
+enum BTreeOpMode
+{
+  BTREE_OP_READS,
+  BTREE_OP_WRITES,
+  BTREE_OP_WRITES_THROUGH,
+  BTREE_OP_WRITES_LEAF,     // shares the index until it escalates
+  BTREE_OP_SNAPSHOT_READS   // reads a snapshot, so doesn't latch the index
+};
+
+class BTreeOpScope
+{
+  friend class BTreeIndex;
+
+private:
+  static thread_local BTreeOpScope *current;  // the outer scope running on this thread
+
+  const BTreeIndex *index;
+  BTreeOp op;
+  bool outer;
+  bool committed;
+  bool buffering;   // writes go to the index's write set
+  bool sequential;  // a pass over much of the tree
+  BTreeLSN loglsn;  // end of what this operation logged but has yet to sync
+  const BTreeSnapshotState *snapshot;  // being read, if any
+  BTreeOpScope *prev;
+  shared_lock<shared_mutex> readlock;
+  unique_lock<shared_mutex> writelock;
+  BTreeOpStats stats;
+  double simstart;
+  SIZE_T comparestart;
+  chrono::steady_clock::time_point wallstart;
+
+public:
+  BTreeOpScope(const BTreeIndex *index, const BTreeOp op, const BTreeOpMode mode,
+               const BTreeSnapshotState *snapshot = 0);
+  ~BTreeOpScope();
+
+  // Writes out the write set if this is the outer operation.  Returns
+  // rc, or the first write error if rc is zero.
+  ERROR_T Commit(const ERROR_T rc);
+
+  // Trades a shared index for one to itself, with buffered writes.
+  // Anything read before may have changed by the time this returns.
+  void Escalate();
+
+  // The outer scope on this thread for index, if any
+  static BTreeOpScope *Current(const BTreeIndex *index);
+  // Lets a helper thread count toward scope
+  static void Join(BTreeOpScope *scope);
+};
+
+thread_local BTreeOpScope *BTreeOpScope::current = 0;
+
+static SIZE_T LatencyBucket(const double seconds)
 {
-  n = superblock.info.freelist;
+  double us = seconds * 1e6;
+  SIZE_T bucket = 0;
 
-  if (n == 0)
+  while (us >= 2 && bucket < BTREE_LATENCY_BUCKETS - 1)
   {
-    return ERROR_NOSPACE;
+    us /= 2;
+    bucket++;
   }
+  return bucket;
+}
 
-  BTreeNode node;
+BTreeOpScope::BTreeOpScope(const BTreeIndex *i, const BTreeOp o, const BTreeOpMode mode,
+                           const BTreeSnapshotState *s) : index(i), op(o), outer(Current(i) == 0), committed(false),
+                                                          buffering(false), sequential(false), loglsn(0), snapshot(s), prev(0)
+{
+  if (outer)
+  {
+    if (mode == BTREE_OP_READS || mode == BTREE_OP_WRITES_LEAF)
+    {
+      readlock = shared_lock<shared_mutex>(index->latch);
+    }
+    else if (mode != BTREE_OP_SNAPSHOT_READS)
+    {
+      writelock = unique_lock<shared_mutex>(index->latch);
+    }
+    prev = current;
+    current = this;
+    buffering = (mode == BTREE_OP_WRITES);
+    sequential = (op == BTREE_OP_SCAN || op == BTREE_OP_BULKLOAD || op == BTREE_OP_OTHER);
+    {
+      lock_guard<mutex> guard(index->cachelock);
+      simstart = index->buffercache->GetCurrentTime();
+    }
+    comparestart = GetKeyCompares();
+    wallstart = chrono::steady_clock::now();
+  }
+}
 
-  node.Unserialize(buffercache, n);
+BTreeOpScope::~BTreeOpScope()
+{
+  if (outer)
+  {
+    if (!committed && writelock.owns_lock())
+    {
+      index->CommitWrites();
+    }
 
-  assert(node.info.nodetype == BTREE_UNALLOCATED_BLOCK);
+    double sim;
+    double wall = chrono::duration<double>(chrono::steady_clock::now() - wallstart).count();
+    {
+      lock_guard<mutex> guard(index->cachelock);
+      sim = index->buffercache->GetCurrentTime() - simstart;
+    }
 
-  superblock.info.freelist = node.info.freelist;
+    stats.count++;
+    stats.comparisons += GetKeyCompares() - comparestart;
+    stats.simtime += sim;
+    stats.walltime += wall;
+    stats.simlatency[LatencyBucket(sim)]++;
+    stats.walllatency[LatencyBucket(wall)]++;
+    {
+      lock_guard<mutex> guard(index->statslock);
+      index->opstats[op] += stats;
+    }
+    current = prev;
 
-  superblock.Serialize(buffercache, superblock_index);
+    if (readlock.owns_lock())
+    {
+      readlock.unlock();
+    }
+    if (writelock.owns_lock())
+    {
+      writelock.unlock();
+    }
+    if (index->log.NeedsCheckpoint())
+    {
+      // A failed checkpoint leaves the log as it was
+      index->log.Checkpoint();
+    }
+  }
+}
 
-  buffercache->NotifyAllocateBlock(n);
+ERROR_T BTreeOpScope::Commit(const ERROR_T rc)
+{
+  ERROR_T wrc = ERROR_NOERROR;
 
-  return ERROR_NOERROR;
+  if (outer && !committed && writelock.owns_lock())
+  {
+    wrc = index->CommitWrites();
+    committed = true;
+  }
+  return rc != ERROR_NOERROR ? rc : wrc;
 }
 
-ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
+void BTreeOpScope::Escalate()
 {
-  BTreeNode node;
-
-  node.Unserialize(buffercache, n);
+  if (outer && readlock.owns_lock())
+  {
+    readlock.unlock();
+    writelock = unique_lock<shared_mutex>(index->latch);
+    buffering = true;
+  }
+}
 
-  assert(node.info.nodetype != BTREE_UNALLOCATED_BLOCK);
+BTreeOpScope *BTreeOpScope::Current(const BTreeIndex *index)
+{
+  return (current != 0 && current->index == index) ? current : 0;
+}
 
-  node.info.nodetype = BTREE_UNALLOCATED_BLOCK;
+void BTreeOpScope::Join(BTreeOpScope *scope)
+{
+  current = scope;
+}
 
-  node.info.freelist = superblock.info.freelist;
+BTreeOpStats::BTreeOpStats() : count(0), nodereads(0), nodecachehits(0), prefetches(0), nodewrites(0), superblockwrites(0), logrecords(0), logsyncs(0), comparisons(0),
+                               allocs(0), deallocs(0), borrows(0), merges(0), simtime(0), walltime(0)
+{
+  memset(splits, 0, sizeof(splits));
+  memset(simlatency, 0, sizeof(simlatency));
+  memset(walllatency, 0, sizeof(walllatency));
+}
 
-  node.Serialize(buffercache, n);
+static ostream &PrintJSONArray(ostream &os, const SIZE_T *values, const SIZE_T n)
+{
+  os << "[";
+  for (SIZE_T i = 0; i < n; i++)
+  {
+    os << (i ? ", " : "") << values[i];
+  }
+  return os << "]";
+}
 
-  superblock.info.freelist = n;
+ostream &BTreeOpStats::PrintJSON(ostream &os) const
+{
+  os << "{\"count\": " << count
+     << ", \"nodereads\": " << nodereads
+     << ", \"nodecachehits\": " << nodecachehits
+     << ", \"prefetches\": " << prefetches
+     << ", \"nodewrites\": " << nodewrites
+     << ", \"superblockwrites\": " << superblockwrites
+     << ", \"logrecords\": " << logrecords
+     << ", \"logsyncs\": " << logsyncs
+     << ", \"comparisons\": " << comparisons
+     << ", \"allocs\": " << allocs
+     << ", \"deallocs\": " << deallocs
+     << ", \"splits\": ";
+  PrintJSONArray(os, splits, BTREE_SPLIT_LEVELS);
+  os << ", \"borrows\": " << borrows
+     << ", \"merges\": " << merges
+     << ", \"simtime\": " << simtime
+     << ", \"walltime\": " << walltime
+     << ", \"simlatency\": ";
+  PrintJSONArray(os, simlatency, BTREE_LATENCY_BUCKETS);
+  os << ", \"walllatency\": ";
+  PrintJSONArray(os, walllatency, BTREE_LATENCY_BUCKETS);
+  return os << "}";
+}
 
-  superblock.Serialize(buffercache, superblock_index);
+BTreeOpStats &BTreeOpStats::operator+=(const BTreeOpStats &rhs)
+{
+  count += rhs.count;
+  nodereads += rhs.nodereads;
+  nodecachehits += rhs.nodecachehits;
+  prefetches += rhs.prefetches;
+  nodewrites += rhs.nodewrites;
+  superblockwrites += rhs.superblockwrites;
+  logrecords += rhs.logrecords;
+  logsyncs += rhs.logsyncs;
+  comparisons += rhs.comparisons;
+  allocs += rhs.allocs;
+  deallocs += rhs.deallocs;
+  for (SIZE_T i = 0; i < BTREE_SPLIT_LEVELS; i++)
+  {
+    splits[i] += rhs.splits[i];
+  }
+  borrows += rhs.borrows;
+  merges += rhs.merges;
+  simtime += rhs.simtime;
+  walltime += rhs.walltime;
+  for (SIZE_T i = 0; i < BTREE_LATENCY_BUCKETS; i++)
+  {
+    simlatency[i] += rhs.simlatency[i];
+    walllatency[i] += rhs.walllatency[i];
+  }
+  return *this;
+}
 
-  buffercache->NotifyDeallocateBlock(n);
+BTreeOpStats BTreeIndex::GetOpStats(const BTreeOp op) const
+{
+  lock_guard<mutex> guard(statslock);
 
-  return ERROR_NOERROR;
+  return opstats[op];
 }
 
-ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
+void BTreeIndex::ResetOpStats()
 {
-  ERROR_T rc;
-
-  superblock_index = initblock;
-  assert(superblock_index == 0);
+  lock_guard<mutex> guard(statslock);
 
-  if (create)
+  for (SIZE_T i = 0; i < BTREE_NUM_OPS; i++)
   {
-    // build a super block, root node, and a free space list
-    //
-    // Superblock at superblock_index
-    // root node at superblock_index+1
-    // free space list for rest
-    BTreeNode newsuperblock(BTREE_SUPERBLOCK,
-                            superblock.info.keysize,
-                            superblock.info.valuesize,
-                            buffercache->GetBlockSize());
-    newsuperblock.info.rootnode = superblock_index + 1;
-    newsuperblock.info.freelist = superblock_index + 2;
-    newsuperblock.info.numkeys = 0;
-
-    buffercache->NotifyAllocateBlock(superblock_index);
+    opstats[i] = BTreeOpStats();
+  }
+}
 
-    rc = newsuperblock.Serialize(buffercache, superblock_index);
+ostream &BTreeIndex::PrintOpStatsJSON(ostream &os) const
+{
+  static const char *names[BTREE_NUM_OPS] = { "insert", "delete", "update", "lookup", "scan", "bulkload", "other" };
+  BTreeOpStats stats[BTREE_NUM_OPS];
 
-    if (rc)
+  // Copied first, so operations ending meanwhile aren't kept waiting
+  {
+    lock_guard<mutex> guard(statslock);
+    for (SIZE_T i = 0; i < BTREE_NUM_OPS; i++)
     {
-      return rc;
+      stats[i] = opstats[i];
     }
+  }
+  os << "{\"ops\": {";
+  for (SIZE_T i = 0; i < BTREE_NUM_OPS; i++)
+  {
+    os << (i ? ", " : "") << "\"" << names[i] << "\": ";
+    stats[i].PrintJSON(os);
+  }
+  lock_guard<mutex> guard(cachelock);
+  os << "}, \"cache\": {\"numallocs\": " << buffercache->GetNumAllocs()
+     << ", \"numdeallocs\": " << buffercache->GetNumDeallocs()
+     << ", \"numreads\": " << buffercache->GetNumReads()
+     << ", \"numdiskreads\": " << buffercache->GetNumDiskReads()
+     << ", \"numwrites\": " << buffercache->GetNumWrites()
+     << ", \"numdiskwrites\": " << buffercache->GetNumDiskWrites()
+     << ", \"time\": " << buffercache->GetCurrentTime()
+     << "}}" << endl;
+  return os;
+}
 
-    BTreeNode newrootnode(BTREE_ROOT_NODE,
-                          superblock.info.keysize,
-                          superblock.info.valuesize,
-                          buffercache->GetBlockSize());
-    newrootnode.info.rootnode = superblock_index + 1;
-    newrootnode.info.freelist = superblock_index + 2;
-    newrootnode.info.numkeys = 0;
+BTreeOpStats &BTreeIndex::CurrentOpStats() const
+{
+  BTreeOpScope *scope = BTreeOpScope::Current(this);
 
-    buffercache->NotifyAllocateBlock(superblock_index + 1);
+  return scope != 0 ? scope->stats : opstats[BTREE_OP_OTHER];
+}
 
-    rc = newrootnode.Serialize(buffercache, superblock_index + 1);
+SIZE_T BTreeIndex::RootNode() const
+{
+  BTreeOpScope *scope = BTreeOpScope::Current(this);
 
-    if (rc)
+  return (scope != 0 && scope->snapshot != 0) ? scope->snapshot->rootnode : superblock.info.rootnode;
+}
+
+ERROR_T BTreeIndex::ReadNode(const SIZE_T block, BTreeNode &node) const
+{
+  BTreeOpScope *scope = BTreeOpScope::Current(this);
+  bool sequential = scope != 0 && scope->sequential;
+  ERROR_T rc;
+
+  if (scope != 0 && scope->snapshot != 0)
+  {
+    // The write set belongs to a writer running alongside
+    lock_guard<mutex> guard(cachelock);
+    map<SIZE_T, shared_ptr<const BTreeNode> >::const_iterator saved = scope->snapshot->before.find(block);
+
+    if (saved != scope->snapshot->before.end())
     {
-      return rc;
+      node = *saved->second;
+      return ERROR_NOERROR;
     }
-
-    for (SIZE_T i = superblock_index + 2; i < buffercache->GetNumBlocks(); i++)
+    if (nodecache.Lookup(block, node, sequential))
     {
-      BTreeNode newfreenode(BTREE_UNALLOCATED_BLOCK,
-                            superblock.info.keysize,
-                            superblock.info.valuesize,
-                            buffercache->GetBlockSize());
-      newfreenode.info.rootnode = superblock_index + 1;
-      newfreenode.info.freelist = ((i + 1) == buffercache->GetNumBlocks()) ? 0 : i + 1;
+      CurrentOpStats().nodecachehits++;
+      return ERROR_NOERROR;
+    }
+    CurrentOpStats().nodereads++;
+    rc = node.Unserialize(buffercache, block);
+    if (rc == ERROR_NOERROR)
+    {
+      nodecache.Insert(block, node, sequential);
+    }
+    return rc;
+  }
 
-      rc = newfreenode.Serialize(buffercache, i);
+  map<SIZE_T, BTreeNode>::const_iterator dirty = writeset.find(block);
 
-      if (rc)
-      {
-        return rc;
-      }
-    }
+  if (dirty != writeset.end())
+  {
+    node = dirty->second;
+    return ERROR_NOERROR;
+  }
+  if (nodecache.Lookup(block, node, sequential))
+  {
+    CurrentOpStats().nodecachehits++;
+    return ERROR_NOERROR;
   }
+  CurrentOpStats().nodereads++;
 
-  // OK, now, mounting the btree is simply a matter of reading the superblock
+  // The node cache is filled under cachelock too, so a copy read here
+  // can't land on top of one a writer has just put there
+  lock_guard<mutex> guard(cachelock);
 
-  return superblock.Unserialize(buffercache, initblock);
+  rc = node.Unserialize(buffercache, block);
+  if (rc == ERROR_NOERROR)
+  {
+    nodecache.Insert(block, node, sequential);
+  }
+  return rc;
 }
 
-ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
+ERROR_T BTreeIndex::WriteNode(const SIZE_T block, const BTreeNode &node)
 {
-  return superblock.Serialize(buffercache, superblock_index);
-}
+  BTreeOpScope *scope = BTreeOpScope::Current(this);
 
+  if (scope != 0 && scope->buffering)
+  {
+    writeset[block] = node;
+    return ERROR_NOERROR;
+  }
+  return WriteThrough(block, node);
+}
 
-ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
-                                           const BTreeOp op,
-                                           const KEY_T &key,
-                                           VALUE_T &value)
+ERROR_T BTreeIndex::WriteThrough(const SIZE_T block, const BTreeNode &node, const bool logged) const
 {
-  BTreeNode b;
+  BTreeOpScope *scope = BTreeOpScope::Current(this);
+  BTreeOpStats &stats = CurrentOpStats();
   ERROR_T rc;
-  SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
 
-  rc = b.Unserialize(buffercache, node);
+  if (!logged && log.IsOpen())
+  {
+    vector<BTreeLogImage> images(1);
+    BTreeLSN lsn;
 
-  if (rc != ERROR_NOERROR){
+    images[0].block = block;
+    images[0].node = &node;
+    lsn = AppendLog(images);
+    if (scope != 0 && scope->writelock.owns_lock())
+    {
+      // The whole operation syncs once, as it commits
+      scope->loglsn = lsn;
+    }
+    else if ((rc = FlushLog(lsn)) != ERROR_NOERROR)
+    {
+      return rc;
+    }
+  }
+
+  stats.nodewrites++;
+  if (block == superblock_index)
+  {
+    stats.superblockwrites++;
+  }
+
+  lock_guard<mutex> guard(cachelock);
+
+  // A snapshot mustn't go on to read the new node as the old
+  rc = SaveForSnapshots(block);
+  if (rc != ERROR_NOERROR)
+  {
     return rc;
   }
+  rc = node.Serialize(buffercache, block);
+  if (rc == ERROR_NOERROR)
+  {
+    nodecache.Insert(block, node, scope != 0 && scope->sequential);
+  }
+  return rc;
+}
 
-  switch (b.info.nodetype)
+ERROR_T BTreeIndex::CommitWrites() const
+{
+  ERROR_T rc = ERROR_NOERROR;
+  ERROR_T wrc;
+  vector<map<SIZE_T, BTreeNode>::const_iterator> order;
+
+  for (map<SIZE_T, BTreeNode>::const_iterator i = writeset.begin(); i != writeset.end(); ++i)
   {
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    // Scan through key/ptr pairs
-    //and recurse if possible
-    for (offset = 0; offset < b.info.numkeys; offset++)
+    order.push_back(i);
+  }
+
+  if (log.IsOpen())
+  {
+    BTreeOpScope *scope = BTreeOpScope::Current(this);
+    vector<BTreeLogImage> images(order.size());
+    BTreeLSN lsn = 0;
+
+    for (SIZE_T i = 0; i < order.size(); i++)
     {
-      rc = b.GetKey(offset, testkey);
-      if (rc) {return rc;}
-      if (key < testkey || key == testkey)
-      {
-        // OK, so we now have the first key that's larger
-        // so we ned to recurse on the ptr immediately previous to
-        // this one, if it exists
-        rc = b.GetPtr(offset, ptr);
-        if (rc)
-        {return rc;}
-        return LookupOrUpdateInternal(ptr, op, key, value);
-      }
+      images[i].block = order[i]->first;
+      images[i].node = &order[i]->second;
     }
-    // if we got here, we need to go to the next pointer, if it exists
-    if (b.info.numkeys > 0)
+    if (!images.empty())
     {
-      rc = b.GetPtr(b.info.numkeys, ptr);
-      if (rc)
-      {
-        return rc;
-      }
-      return LookupOrUpdateInternal(ptr, op, key, value);
+      lsn = AppendLog(images);
     }
-    else
+    if (scope != 0)
     {
-      // There are no keys at all on this node, so nowhere to go
-      return ERROR_NONEXISTENT;
+      lsn = max(lsn, scope->loglsn);
+      scope->loglsn = 0;
     }
-    break;
-  case BTREE_LEAF_NODE:
-    // Scan through keys looking for matching value
-    for (offset = 0; offset < b.info.numkeys; offset++)
-    {
-      rc = b.GetKey(offset, testkey);
-      if (rc)
-      {
-        return rc;
-      }
-      if (testkey == key)
-      {
-        if (op == BTREE_OP_LOOKUP)
-        {
-          return b.GetVal(offset, value);
-        }
-        else
-        {
-          ERROR_T set_val_rc = b.SetVal(offset, value);
-          if (set_val_rc != ERROR_NOERROR)
-          {
-            return set_val_rc;
-          }
+    // Should the sync fail, the writes still go to the buffer cache,
+    // which is where the rest of the index already sees them
+    rc = FlushLog(lsn);
+  }
 
-          ERROR_T serialize_rc = b.Serialize(buffercache, node);
-          if (serialize_rc != ERROR_NOERROR)
-          {
-            return serialize_rc;
-          }
-          return ERROR_NOERROR;
-        }
-      }
+  for (SIZE_T i = 0; i < order.size(); i++)
+  {
+    wrc = WriteThrough(order[i]->first, order[i]->second, true);
+    if (rc == ERROR_NOERROR)
+    {
+      rc = wrc;
     }
-    return ERROR_NONEXISTENT;
-    break;
-  default:
-    // We can't be looking at anything other than a root, internal, or leaf
-    return ERROR_INSANE;
-    break;
   }
+  writeset.clear();
 
-  return ERROR_INSANE;
+  for (SIZE_T i = 0; i < freed.size(); i++)
+  {
+    buffercache->NotifyDeallocateBlock(freed[i]);
+  }
+  freed.clear();
+  allocated.clear();
+  return rc;
 }
 
-static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt)
+// None of the write set has reached the cache, so dropping it undoes
+// the nodes.  What else the operation changed is put back: the blocks
+// it took are handed back, those it freed stay in use, and the
+// superblock and free map are read again.  Should that fail, the index
+// is no worse off than had the writes gone out.
+ERROR_T BTreeIndex::AbandonWrites(BTreeOpScope &scope, const ERROR_T rc)
 {
-  KEY_T key;
-  VALUE_T value;
-  SIZE_T ptr;
-  SIZE_T offset;
-  ERROR_T rc;
-  unsigned i;
-
-  if (dt == BTREE_DEPTH_DOT)
+  if (!scope.outer || scope.committed || !scope.buffering)
   {
-    os << nodenum << " [ label=\"" << nodenum << ": ";
+    return rc;
   }
-  else if (dt == BTREE_DEPTH)
+  scope.committed = true;
+
+  writeset.clear();
+  freed.clear();
+  for (SIZE_T i = 0; i < allocated.size(); i++)
   {
-    os << nodenum << ": ";
+    buffercache->NotifyDeallocateBlock(allocated[i]);
   }
-  else
+  allocated.clear();
+
+  if (ReadNode(superblock_index, superblock) == ERROR_NOERROR && allocpolicy == BTREE_ALLOC_NEAR)
   {
+    LoadFreeMap();
   }
+  return rc;
+}
 
-  switch (b.info.nodetype)
+ERROR_T BTreeIndex::SaveForSnapshots(const SIZE_T block) const
+{
+  ERROR_T rc;
+  shared_ptr<BTreeNode> image;
+
+  for (list<BTreeSnapshotState>::iterator s = snapshots.begin(); s != snapshots.end(); ++s)
   {
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    if (dt == BTREE_SORTED_KEYVAL)
-    {
-    }
-    else
-    {
-      if (dt == BTREE_DEPTH_DOT)
-      {
-      }
-      else
-      {
-        os << "Interior: ";
-      }
-      for (offset = 0; offset <= b.info.numkeys; offset++)
-      {
-        rc = b.GetPtr(offset, ptr);
-        if (rc)
-        {
-          return rc;
-        }
-        os << "*" << ptr << " ";
-        // Last pointer
-        if (offset == b.info.numkeys)
-          break;
-        rc = b.GetKey(offset, key);
-        if (rc)
-        {
-          return rc;
-        }
-        for (i = 0; i < b.info.keysize; i++)
-        {
-          os << key.data[i];
-        }
-        os << " ";
-      }
-    }
-    break;
-  case BTREE_LEAF_NODE:
-    if (dt == BTREE_DEPTH_DOT || dt == BTREE_SORTED_KEYVAL)
-    {
-    }
-    else
+    if (s->before.count(block) != 0 || (s->highwater != 0 && block >= s->highwater))
     {
-      os << "Leaf: ";
+      continue;
     }
-    for (offset = 0; offset < b.info.numkeys; offset++)
+    if (!image)
     {
-      if (offset == 0)
+      image = make_shared<BTreeNode>();
+      if (!nodecache.Lookup(block, *image, true))
       {
-        // special case for first pointer
-        rc = b.GetPtr(offset, ptr);
-        if (rc)
+        CurrentOpStats().nodereads++;
+        rc = image->Unserialize(buffercache, block);
+        if (rc != ERROR_NOERROR)
         {
           return rc;
         }
-        if (dt != BTREE_SORTED_KEYVAL)
-        {
-          os << "*" << ptr << " ";
-        }
-      }
-      if (dt == BTREE_SORTED_KEYVAL)
-      {
-        os << "(";
-      }
-      rc = b.GetKey(offset, key);
-      if (rc)
-      {
-        return rc;
-      }
-      for (i = 0; i < b.info.keysize; i++)
-      {
-        os << key.data[i];
-      }
-      if (dt == BTREE_SORTED_KEYVAL)
-      {
-        os << ",";
-      }
-      else
-      {
-        os << " ";
-      }
-      rc = b.GetVal(offset, value);
-      if (rc)
-      {
-        return rc;
-      }
-      for (i = 0; i < b.info.valuesize; i++)
-      {
-        os << value.data[i];
       }
-      if (dt == BTREE_SORTED_KEYVAL)
-      {
-        os << ")\n";
-      }
-      else
-      {
-        os << " ";
-      }
-    }
-    break;
-  default:
-    if (dt == BTREE_DEPTH_DOT)
-    {
-      os << "Unknown(" << b.info.nodetype << ")";
-    }
-    else
-    {
-      os << "Unsupported Node Type " << b.info.nodetype;
     }
+    s->before[block] = image;
   }
-  if (dt == BTREE_DEPTH_DOT)
+  return ERROR_NOERROR;
+}
+
+BTreeLSN BTreeIndex::AppendLog(const vector<BTreeLogImage> &images) const
+{
+  CurrentOpStats().logrecords++;
+  return log.Append(images);
+}
+
+ERROR_T BTreeIndex::FlushLog(const BTreeLSN lsn) const
+{
+  bool synced;
+  ERROR_T rc;
+
+  if (lsn == 0)
   {
-    os << "\" ]";
+    return ERROR_NOERROR;
   }
-  return ERROR_NOERROR;
+  rc = log.Flush(lsn, synced);
+  if (synced)
+  {
+    CurrentOpStats().logsyncs++;
+  }
+  return rc;
 }
 
-ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+ERROR_T BTreeIndex::ReplayImage(const SIZE_T block, const BYTE_T *image, const SIZE_T length, void *state)
 {
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+  BTreeIndex *index = (BTreeIndex *)state;
+  BTreeNode node;
+  ERROR_T rc;
+
+  rc = node.SetImage(image, length, index->buffercache->GetBlockSize());
+  if (rc != ERROR_NOERROR)
+  {
+    return rc;
+  }
+  return index->WriteThrough(block, node, true);
 }
 
-ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+ERROR_T BTreeIndex::OpenLog(const char *path)
 {
-  VALUE_T valueparam = value;
-  SIZE_T adjusted_block;
-  KEY_T adjusted_key; 
-  return InsertAfterAdjust(superblock.info.rootnode, key, valueparam, adjusted_block,adjusted_key);
+  BTreeOpScope scope(this, BTREE_OP_OTHER, BTREE_OP_WRITES_THROUGH);
+
+  return log.Open(path);
 }
 
+ERROR_T BTreeIndex::CloseLog(const bool truncate)
+{
+  BTreeOpScope scope(this, BTREE_OP_OTHER, BTREE_OP_WRITES_THROUGH);
+  ERROR_T rc = ERROR_NOERROR;
+
+  if (truncate && log.IsOpen())
+  {
+    rc = log.Truncate();
+  }
+  log.Close();
+  return rc;
+}
 
-ERROR_T BTreeIndex::InsertAfterAdjust(const SIZE_T &start_ptr, const KEY_T &key, const VALUE_T &value, SIZE_T &adjusted_block, KEY_T &adjusted_key)
+SIZE_T BTreeIndex::Prefetch(const BTreeNode &node, const SIZE_T offset, const bool backward) const
 {
-    BTreeNode b;
-    ERROR_T rc;
-    SIZE_T offset;
-    KEY_T test_key;
-    SIZE_T ptr;
-    KEY_T last_leaf_key;
+  vector<SIZE_T> blocks;
+  SIZE_T ptr;
 
-    rc= b.Unserialize(buffercache,start_ptr);
+  if (nodecache.GetCapacity() == 0 || node.info.nodetype == BTREE_UNALLOCATED_BLOCK)
+  {
+    return 0;
+  }
+  for (SIZE_T i = 1; backward ? i <= offset : offset + i <= node.info.numkeys; i++)
+  {
+    node.GetPtr(backward ? offset - i : offset + i, ptr);
+    blocks.push_back(ptr);
+  }
+  return Prefetch(blocks);
+}
 
-    if (rc!=ERROR_NOERROR) { 
-      return rc;
-    }
-    
-    switch (b.info.nodetype) { 
-      case BTREE_ROOT_NODE:
-
-    if (b.info.numkeys == 0)
-    { 
-      SIZE_T leftLeafBlock;
-      SIZE_T rightLeafBlock;
-      BTreeNode leftLeaf(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
-      BTreeNode rightLeaf(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
-      rc = AllocateNode(leftLeafBlock);
-      if (rc != ERROR_NOERROR)
-      {
-        return rc;
-      }
-      rc = AllocateNode(rightLeafBlock);
-      if (rc != ERROR_NOERROR)
-      {
-        return rc;
-      }
+SIZE_T BTreeIndex::Prefetch(const vector<SIZE_T> &blocks) const
+{
+  // Much more than the node cache's FIFO holds would push out the
+  // first ones before they are used
+  SIZE_T count = min((SIZE_T)blocks.size(), max((SIZE_T)1, nodecache.GetCapacity() / 8));
 
-      b.info.numkeys++;
-      b.SetKey(0, key);
-      b.SetPtr(0, leftLeafBlock);
-      b.SetPtr(1, rightLeafBlock);
+  if (nodecache.GetCapacity() == 0 || count == 0)
+  {
+    return 0;
+  }
 
-      leftLeaf.info.numkeys++;
-      leftLeaf.SetKey(0, key);
-      leftLeaf.SetVal(0, value);
+  lock_guard<mutex> guard(prefetchlock);
 
-      rc = b.Serialize(buffercache, start_ptr);
-      if (rc != ERROR_NOERROR)
-      {
-        return rc;
-      }
-      rc = leftLeaf.Serialize(buffercache, leftLeafBlock);
-      if (rc != ERROR_NOERROR)
-      {
-        return rc;
-      }
-      rc = rightLeaf.Serialize(buffercache, rightLeafBlock);
-      if (rc != ERROR_NOERROR)
+  if (!prefetcher.joinable())
+  {
+    prefetcher = thread([this]() { PrefetchLoop(); });
+  }
+  prefetchqueue.insert(prefetchqueue.end(), blocks.begin(), blocks.begin() + count);
+  prefetchready.notify_one();
+  CurrentOpStats().prefetches += count;
+  return count;
+}
+
+void BTreeIndex::PrefetchLoop() const
+{
+  vector<SIZE_T> blocks;
+  BTreeNode node;
+
+  while (1)
+  {
+    {
+      unique_lock<mutex> guard(prefetchlock);
+      prefetchready.wait(guard, [this]() { return prefetchstop || !prefetchqueue.empty(); });
+      if (prefetchstop)
       {
-        return rc;
+        return;
       }
-      return ERROR_NOERROR;
-    }
-    else
-    {
+      blocks.assign(prefetchqueue.begin(), prefetchqueue.end());
+      prefetchqueue.clear();
     }
-      
-case BTREE_INTERIOR_NODE:
 
-    for (offset = 0; offset < b.info.numkeys; offset++)
+    // In block order, and as a reader, so the tree can't change under
+    // us; a block the cache already has is left alone
+    sort(blocks.begin(), blocks.end());
+    shared_lock<shared_mutex> shared(latch);
+    for (SIZE_T i = 0; i < blocks.size(); i++)
     {
-      rc = b.GetKey(offset, test_key);
-      if (rc)
+      if (nodecache.Lookup(blocks[i], node, true))
       {
-        return rc;
+        continue;
       }
-      if (key < test_key || key == test_key)
+      lock_guard<mutex> guard(cachelock);
+      if (node.Unserialize(buffercache, blocks[i]) == ERROR_NOERROR)
       {
-        if (key == test_key)
-        {
-          return ERROR_UNIQUE_KEY;
-        }
-        rc = b.GetPtr(offset, ptr);
-        if (rc)
-        {
-          return rc;
-        }
-        ERROR_T insert_recur_error;
-        insert_recur_error = InsertAfterAdjust(ptr, key, value, adjusted_block, adjusted_key);
+        nodecache.Insert(blocks[i], node, true);
+      }
+    }
+  }
+}
 
-        if (insert_recur_error == ERROR_SPLIT_BLOCK)
-        { 
-          SIZE_T old_num_keys = b.info.numkeys;
-          b.info.numkeys++;
+void BTreeIndex::StopPrefetch()
+{
+  {
+    lock_guard<mutex> guard(prefetchlock);
+    prefetchstop = true;
+    prefetchready.notify_one();
+  }
+  if (prefetcher.joinable())
+  {
+    prefetcher.join();
+  }
+  lock_guard<mutex> guard(prefetchlock);
+  prefetchqueue.clear();
+  prefetchstop = false;
+}
 
-          SIZE_T last_ptr;
-          rc = b.GetPtr(old_num_keys, last_ptr);
-          if (rc != ERROR_NOERROR)
-          {
-            return rc;
-          }
-          rc = b.SetPtr(old_num_keys + 1, last_ptr);
-          if (rc != ERROR_NOERROR)
-          {
-            return rc;
-          }
+void BTreeIndex::CountSplit()
+{
+  CurrentOpStats().splits[min(opsplits, (SIZE_T)(BTREE_SPLIT_LEVELS - 1))]++;
+  opsplits++;
+}
 
-          for (SIZE_T i = old_num_keys - 1; (i >= offset); i--)
-          {
-            KEY_T shifted_key;
-            rc = b.GetKey(i, shifted_key);
-            if (rc != ERROR_NOERROR)
-            {
-              return rc;
-            }
-            rc = b.SetKey(i + 1, shifted_key);
-            if (rc != ERROR_NOERROR)
-            {
-              return rc;
-            }
+ERROR_T BTreeIndex::AllocateNode(SIZE_T &n, const SIZE_T hint)
+{
+  ERROR_T rc;
 
-            SIZE_T shifted_ptr;
-            rc = b.GetPtr(i, shifted_ptr);
-            if (rc != ERROR_NOERROR)
-            {
-              return rc;
-            }
-            rc = b.SetPtr(i + 1, shifted_ptr);
-            if (rc != ERROR_NOERROR)
-            {
-              return rc;
-            }
-            if(i==0){
-                break;
-            }
-          }
+  rc = PopFreeBlock(n, hint);
 
-          rc = b.SetKey(offset, adjusted_key);
-          if (rc != ERROR_NOERROR)
-          {
-            return rc;
-          }
-          rc = b.SetPtr(offset, adjusted_block);
-          if (rc != ERROR_NOERROR)
-          {
-            return rc;
-          }
+  if (rc != ERROR_NOERROR)
+  {
+    return rc;
+  }
 
-        }
-        else
-        {
-          return insert_recur_error;
-        }
+  return WriteNode(superblock_index, superblock);
+}
 
-      interior_node_split:
+ERROR_T BTreeIndex::PopFreeBlock(SIZE_T &n, const SIZE_T hint)
+{
+  SuperblockData *sb = superblock.ResolveSuperblock();
+  SIZE_T prev = 0;
+  ERROR_T rc;
 
-        if ((b.info.numkeys - b.info.GetNumSlotsAsInterior()) <= 1)
-        { 
-          BTreeNode new_block(BTREE_INTERIOR_NODE, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
+  if (allocpolicy == BTREE_ALLOC_NEAR)
+  {
+    n = NearestFreeBlock(hint);
+  }
+  else
+  {
+    n = superblock.info.freelist != 0 ? superblock.info.freelist : sb->highwater;
+  }
 
-          rc = AllocateNode(adjusted_block);
-          if (rc != ERROR_NOERROR)
-          {
-            return rc;
-          }
+  if (n == 0 || n >= buffercache->GetNumBlocks())
+  {
+    return ERROR_NOSPACE;
+  }
 
-          SIZE_T old_b_num = b.info.numkeys;
-          SIZE_T last_ptr;
-          rc = b.GetPtr(old_b_num, last_ptr);
-          if (rc != ERROR_NOERROR)
-          {
-            return rc;
-          }
+  if (n == sb->highwater)
+  {
+    // Never used, so it is on no list
+    sb->highwater++;
 
-          SIZE_T num_shifted = 0;
-          for (SIZE_T i = (b.info.numkeys / 2) + 1; i < old_b_num; i++)
-          {
-            new_block.info.numkeys++;
-            KEY_T shifted_key;
-            rc = b.GetKey(i, shifted_key);
-            if (rc != ERROR_NOERROR)
-            {
-              return rc;
-            }
-            rc = new_block.SetKey(num_shifted, shifted_key);
-            if (rc != ERROR_NOERROR)
-            {
-              return rc;
-            }
+    NotifyAllocate(n);
 
-            SIZE_T shifted_ptr;
-            rc = b.GetPtr(i, shifted_ptr);
-            if (rc != ERROR_NOERROR)
-            {
-              return rc;
-            }
-            rc = new_block.SetPtr(num_shifted, shifted_ptr);
-            if (rc != ERROR_NOERROR)
-            {
-              return rc;
-            }
-            num_shifted++;
-          }
+    CurrentOpStats().allocs++;
 
-          b.info.numkeys -= num_shifted;
+    return ERROR_NOERROR;
+  }
 
-          rc = new_block.SetPtr(num_shifted, last_ptr);
-          if (rc != ERROR_NOERROR)
-          {
-            return rc;
-          }
-          rc = b.GetKey(b.info.numkeys - 1, adjusted_key);
-          if (rc != ERROR_NOERROR)
-          {
-            return rc;
-          }
-          b.info.numkeys--;
+  BTreeNode node;
 
-          rc = new_block.Serialize(buffercache, start_ptr);
-          if (rc != ERROR_NOERROR)
-          {
-            return rc;
-          }
-          rc = b.Serialize(buffercache, adjusted_block);
-          if (rc != ERROR_NOERROR)
-          {
-            return rc;
-          }
+  rc = ReadNode(n, node);
+  if (rc != ERROR_NOERROR)
+  {
+    return rc;
+  }
 
-          if (b.info.nodetype == BTREE_ROOT_NODE)
-          { 
-            b.info.nodetype = BTREE_INTERIOR_NODE;
-            BTreeNode new_root(BTREE_ROOT_NODE, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
-            SIZE_T new_root_block;
-            new_root.info.numkeys++;
-            rc = new_root.SetKey(0, adjusted_key);
-            if (rc != ERROR_NOERROR)
-            {
-              return rc;
-            }
-            rc = new_root.SetPtr(0, adjusted_block);
-            if (rc != ERROR_NOERROR)
-            {
-              return rc;
-            }
-            rc = new_root.SetPtr(1, start_ptr);
-            if (rc != ERROR_NOERROR)
-            {
-              return rc;
-            }
+  // The free list points at a block in use; taking it would clobber it
+  if (node.info.nodetype != BTREE_UNALLOCATED_BLOCK)
+  {
+    return ERROR_INSANE;
+  }
 
-            rc = AllocateNode(new_root_block);
-            if (rc != ERROR_NOERROR)
-            {
-              return rc;
-            }
+  // Unlink it, from wherever it is on the list
+  if (allocpolicy == BTREE_ALLOC_NEAR)
+  {
+    map<SIZE_T, SIZE_T>::iterator f = freeprev.find(n);
+    assert(f != freeprev.end());
+    prev = f->second;
+    freeprev.erase(f);
+    if (node.info.freelist != 0)
+    {
+      freeprev[node.info.freelist] = prev;
+    }
+  }
+  if (prev == 0)
+  {
+    superblock.info.freelist = node.info.freelist;
+  }
+  else
+  {
+    BTreeNode prevnode;
 
-            rc = b.Serialize(buffercache, adjusted_block);
-            if (rc != ERROR_NOERROR)
-            {
-              return rc;
-            }
+    rc = ReadNode(prev, prevnode);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    prevnode.info.freelist = node.info.freelist;
+    rc = WriteNode(prev, prevnode);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+  }
 
-            rc = new_root.Serialize(buffercache, new_root_block);
-            if (rc != ERROR_NOERROR)
-            {
-              return rc;
-            }
+  // A block this operation freed is still allocated as far as the
+  // cache knows
+  vector<SIZE_T>::iterator f = find(freed.begin(), freed.end(), n);
+  if (f != freed.end())
+  {
+    freed.erase(f);
+  }
+  else
+  {
+    NotifyAllocate(n);
+  }
 
-            superblock.info.rootnode = new_root_block;
+  CurrentOpStats().allocs++;
 
-            rc = superblock.Serialize(buffercache, superblock_index);
-            if (rc != ERROR_NOERROR)
-            {
-              return rc;
-            }
+  return ERROR_NOERROR;
+}
 
-            return ERROR_NOERROR;
-          }
-          else
-          {
-            return ERROR_SPLIT_BLOCK;
-          }
-        }
-        else
-        {
-          return b.Serialize(buffercache, start_ptr);
-        }
-      }
+void BTreeIndex::NotifyAllocate(const SIZE_T n)
+{
+  BTreeOpScope *scope = BTreeOpScope::Current(this);
+
+  buffercache->NotifyAllocateBlock(n);
+  if (scope != 0 && scope->buffering)
+  {
+    allocated.push_back(n);
+  }
+}
+
+SIZE_T BTreeIndex::NearestFreeBlock(const SIZE_T hint) const
+{
+  SIZE_T highwater = superblock.ResolveSuperblock()->highwater;
+  SIZE_T track = hint / blockspertrack;
+  SIZE_T after = 0;
+  SIZE_T before = 0;
+
+  // The closest free blocks on either side of the hint.  Everything
+  // from the high-water mark on is free, and the mark is past any
+  // block in use.
+  map<SIZE_T, SIZE_T>::const_iterator f = freeprev.upper_bound(hint);
+  if (f != freeprev.end())
+  {
+    after = f->first;
+  }
+  if (highwater != 0 && highwater < buffercache->GetNumBlocks() && (after == 0 || highwater < after))
+  {
+    after = highwater;
+  }
+  if (f != freeprev.begin())
+  {
+    --f;
+    before = f->first;
+  }
+
+  if (before == 0)
+  {
+    return after;
+  }
+  if (after == 0)
+  {
+    return before;
+  }
+  if (after / blockspertrack == track)
+  {
+    return after;
+  }
+  return (track - before / blockspertrack < after / blockspertrack - track) ? before : after;
+}
+
+ERROR_T BTreeIndex::LoadFreeMap()
+{
+  BTreeNode node;
+  SIZE_T prev = 0;
+  ERROR_T rc;
+
+  freeprev.clear();
+  for (SIZE_T block = superblock.info.freelist; block != 0; block = node.info.freelist)
+  {
+    if (block >= buffercache->GetNumBlocks() || freeprev.count(block))
+    {
+      freeprev.clear();
+      return ERROR_INSANE;
     }
-    if (b.info.numkeys > 0)
+    rc = ReadNode(block, node);
+    if (rc != ERROR_NOERROR)
     {
+      freeprev.clear();
+      return rc;
+    }
+    freeprev[block] = prev;
+    prev = block;
+  }
+  return ERROR_NOERROR;
+}
 
-      rc = b.GetPtr(b.info.numkeys, ptr);
-      if (rc)
-      {
-        return rc;
-      }
+ERROR_T BTreeIndex::SetAllocPolicy(const BTreeAllocPolicy policy, const SIZE_T blocks)
+{
+  BTreeOpScope scope(this, BTREE_OP_OTHER, BTREE_OP_WRITES_THROUGH);
 
-      ERROR_T insert_error = InsertAfterAdjust(ptr, key, value, adjusted_block, adjusted_key);
+  if (blocks == 0)
+  {
+    return ERROR_BADCONFIG;
+  }
 
-      if (insert_error == ERROR_SPLIT_BLOCK)
-      {
-        SIZE_T last_ptr;
-        SIZE_T old_num_keys = b.info.numkeys;
-        b.info.numkeys++;
-        rc = b.GetPtr(old_num_keys, last_ptr);
-        if (rc != ERROR_NOERROR)
-        {
-          return rc;
-        }
-        rc = b.SetPtr(old_num_keys + 1, last_ptr);
-        if (rc != ERROR_NOERROR)
-        {
-          return rc;
-        }
+  allocpolicy = policy;
+  blockspertrack = blocks;
+  freeprev.clear();
 
-        rc = b.SetKey(old_num_keys, adjusted_key);
-        if (rc != ERROR_NOERROR)
-        {
-          return rc;
-        }
-        rc = b.SetPtr(old_num_keys, adjusted_block);
-        if (rc != ERROR_NOERROR)
-        {
-          return rc;
-        }
+  // Not attached yet, so Attach loads the map
+  if (policy != BTREE_ALLOC_NEAR || superblock.info.nodetype != BTREE_SUPERBLOCK)
+  {
+    return ERROR_NOERROR;
+  }
+  return LoadFreeMap();
+}
 
-        goto interior_node_split;
-      }
-      else if (insert_error == ERROR_UNIQUE_KEY)
-      {
-        return insert_error;
-      }
-      else
-      {
-        return b.Serialize(buffercache, start_ptr);
-      }
+ERROR_T BTreeIndex::SetCompressPolicy(const BTreeCompressPolicy policy, const KEY_T &cold)
+{
+  BTreeOpScope scope(this, BTREE_OP_OTHER, BTREE_OP_WRITES_THROUGH);
+
+  compresspolicy = policy;
+  compresscold = cold;
+  return ERROR_NOERROR;
+}
+
+bool BTreeIndex::CompressesLeaf(const KEY_T &first) const
+{
+  switch (compresspolicy)
+  {
+  case BTREE_COMPRESS_ALL:
+    return true;
+  case BTREE_COMPRESS_BELOW:
+    return !(compresscold < first);
+  default:
+    return false;
+  }
+}
+
+ERROR_T BTreeIndex::ApplyCompressPolicy(BTreeNode &leaf) const
+{
+  KEY_T first;
+  ERROR_T rc;
+
+  if (leaf.info.numkeys == 0)
+  {
+    return ERROR_NOERROR;
+  }
+  leaf.GetKey(0, first);
+  rc = leaf.SetCompressed(CompressesLeaf(first));
+  return rc == ERROR_NOSPACE ? ERROR_NOERROR : rc;
+}
+
+ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
+{
+  BTreeNode node;
+  ERROR_T rc;
+
+  rc = ReadNode(n, node);
+  if (rc != ERROR_NOERROR)
+  {
+    return rc;
+  }
+
+  assert(node.info.nodetype != BTREE_UNALLOCATED_BLOCK);
+
+  return PushFreeBlock(n, node);
+}
+
+ERROR_T BTreeIndex::PushFreeBlock(const SIZE_T n, BTreeNode &node)
+{
+  ERROR_T rc;
+
+  node.info.nodetype = BTREE_UNALLOCATED_BLOCK;
+  // A free block is only its header, never packed
+  node.info.compressed = 0;
+  node.info.packed = 0;
+
+  node.info.freelist = superblock.info.freelist;
+
+  rc = WriteNode(n, node);
+  if (rc != ERROR_NOERROR)
+  {
+    return rc;
+  }
+
+  if (allocpolicy == BTREE_ALLOC_NEAR)
+  {
+    if (superblock.info.freelist != 0)
+    {
+      freeprev[superblock.info.freelist] = n;
+    }
+    freeprev[n] = 0;
+  }
+
+  superblock.info.freelist = n;
+
+  rc = WriteNode(superblock_index, superblock);
+  if (rc != ERROR_NOERROR)
+  {
+    return rc;
+  }
+
+  BTreeOpScope *scope = BTreeOpScope::Current(this);
+
+  if (scope != 0 && scope->buffering)
+  {
+    freed.push_back(n);
+  }
+  else
+  {
+    buffercache->NotifyDeallocateBlock(n);
+  }
+
+  CurrentOpStats().deallocs++;
+
+  return ERROR_NOERROR;
+}
+
+void BTreeIndex::SetNodeCacheSize(const SIZE_T nodes)
+{
+  BTreeOpScope scope(this, BTREE_OP_OTHER, BTREE_OP_WRITES_THROUGH);
+
+  nodecache.SetCapacity(nodes);
+}
+
+SIZE_T BTreeIndex::GetKeySize() const
+{
+  return superblock.info.keysize;
+}
+
+SIZE_T BTreeIndex::GetValueSize() const
+{
+  return superblock.info.valuesize;
+}
+
+ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
+{
+  ERROR_T rc;
+  BTreeOpScope scope(this, BTREE_OP_OTHER, BTREE_OP_WRITES_THROUGH);
+
+  superblock_index = initblock;
+  assert(superblock_index == 0);
+
+  nodecache.Clear();
+
+  if (create)
+  {
+    // Offsets within a node are 16 bits, and a split must leave room
+    // for the longest pair on either side
+    NodeMetadata leaf;
+    NodeMetadata interior;
+    leaf.nodetype = BTREE_LEAF_NODE;
+    leaf.keysize = superblock.info.keysize;
+    leaf.valuesize = superblock.info.valuesize;
+    leaf.blocksize = buffercache->GetBlockSize();
+    leaf.keyprefix = 0;
+    leaf.compressed = 0;
+    interior = leaf;
+    interior.nodetype = BTREE_INTERIOR_NODE;
+    if (leaf.keysize < 1 || leaf.keysize > 65535 || leaf.valuesize > 65535 ||
+        leaf.GetNumDataBytes() > BTREE_MAX_DATA_BYTES ||
+        4 * leaf.GetMaxSlotBytes() > leaf.GetCapacity() ||
+        4 * interior.GetMaxSlotBytes() > interior.GetCapacity())
+    {
+      return ERROR_BADCONFIG;
+    }
+  }
+
+  // Bring back whatever the last run committed but the buffer cache
+  // never wrote out.  A new index starts a new log.
+  rc = create ? log.Truncate() : log.Replay(ReplayImage, this);
+  if (rc != ERROR_NOERROR)
+  {
+    return rc;
+  }
+
+  if (create)
+  {
+    // build a super block and root node
+    //
+    // Superblock at superblock_index
+    // root node at superblock_index+1
+    // the rest lies past the high-water mark, so is free without
+    // being written; the free list starts out empty
+    BTreeNode newsuperblock(BTREE_SUPERBLOCK,
+                            superblock.info.keysize,
+                            superblock.info.valuesize,
+                            buffercache->GetBlockSize());
+    newsuperblock.info.rootnode = superblock_index + 1;
+    newsuperblock.info.freelist = 0;
+    newsuperblock.info.numkeys = 0;
+    newsuperblock.ResolveSuperblock()->highwater = superblock_index + 2;
+
+    buffercache->NotifyAllocateBlock(superblock_index);
+
+    rc = WriteNode(superblock_index, newsuperblock);
+
+    if (rc)
+    {
+      return rc;
+    }
+
+    BTreeNode newrootnode(BTREE_ROOT_NODE,
+                          superblock.info.keysize,
+                          superblock.info.valuesize,
+                          buffercache->GetBlockSize());
+    newrootnode.info.rootnode = superblock_index + 1;
+    newrootnode.info.freelist = 0;
+    newrootnode.info.numkeys = 0;
+
+    buffercache->NotifyAllocateBlock(superblock_index + 1);
+
+    rc = WriteNode(superblock_index + 1, newrootnode);
+
+    if (rc)
+    {
+      return rc;
+    }
+  }
+
+  // OK, now, mounting the btree is simply a matter of reading the superblock
+
+  rc = ReadNode(initblock, superblock);
+
+  if (rc != ERROR_NOERROR || allocpolicy != BTREE_ALLOC_NEAR)
+  {
+    return scope.Commit(rc);
+  }
+
+  return scope.Commit(LoadFreeMap());
+}
+
+ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
+{
+  // The prefetch thread reads through the buffer cache, which is
+  // detached after us.  It reads as a reader, so it is stopped before
+  // we take the index to ourselves.
+  StopPrefetch();
+
+  BTreeOpScope scope(this, BTREE_OP_OTHER, BTREE_OP_WRITES);
+
+  freeprev.clear();
+
+  return scope.Commit(WriteNode(superblock_index, superblock));
+}
+
+
+ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
+                                           const BTreeOp op,
+                                           const KEY_T &key,
+                                           VALUE_T &value)
+{
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T offset;
+  bool found;
+  SIZE_T ptr;
+
+  rc = ReadNode(node, b);
+
+  if (rc != ERROR_NOERROR){
+    return rc;
+  }
+
+  switch (b.info.nodetype)
+  {
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    // The first key that's >= key tells us which pointer to follow;
+    // if there is none we go to the last pointer
+    offset = b.SearchKey(key, found);
+    rc = b.GetPtr(offset, ptr);
+    if (rc)
+    {
+      return rc;
+    }
+    if (ptr == 0)
+    {
+      // Only the root of an empty tree points nowhere
+      return ERROR_NONEXISTENT;
+    }
+    return LookupOrUpdateInternal(ptr, op, key, value);
+    break;
+  case BTREE_LEAF_NODE:
+    // Search the keys for a matching value
+    offset = b.SearchKey(key, found);
+    if (found)
+    {
+      if (op == BTREE_OP_LOOKUP)
+      {
+        return b.GetVal(offset, value);
+      }
+      else
+      {
+        ERROR_T set_val_rc = b.SetVal(offset, value);
+        if (set_val_rc != ERROR_NOERROR)
+        {
+          return set_val_rc;
+        }
+
+        ERROR_T serialize_rc = WriteNode(node, b);
+        if (serialize_rc != ERROR_NOERROR)
+        {
+          return serialize_rc;
+        }
+        return ERROR_NOERROR;
+      }
+    }
+    return ERROR_NONEXISTENT;
+    break;
+  default:
+    // We can't be looking at anything other than a root, internal, or leaf
+    return ERROR_INSANE;
+    break;
+  }
+
+  return ERROR_INSANE;
+}
+
+ERROR_T BTreeIndex::FindLeaf(const LeafTarget target, const KEY_T *key, SIZE_T &leafblock, BTreeNode &leaf,
+                             SIZE_T *ahead, const bool backward) const
+{
+  ERROR_T rc;
+  SIZE_T offset = 0;
+  bool found;
+  BTreeNode parent;
+
+  leafblock = RootNode();
+
+  while (1)
+  {
+    rc = ReadNode(leafblock, leaf);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+
+    switch (leaf.info.nodetype)
+    {
+    case BTREE_LEAF_NODE:
+      if (ahead != 0)
+      {
+        *ahead = Prefetch(parent, offset, backward);
+      }
+      return ERROR_NOERROR;
+      break;
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      if (target == LEAF_FOR_KEY)
+      {
+        offset = leaf.SearchKey(*key, found);
+      }
+      else
+      {
+        offset = (target == LEAF_FIRST) ? 0 : leaf.info.numkeys;
+      }
+      if (ahead != 0)
+      {
+        parent = leaf;
+      }
+      rc = leaf.GetPtr(offset, leafblock);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+      if (leafblock == 0)
+      {
+        return ERROR_NONEXISTENT;
+      }
+      break;
+    default:
+      return ERROR_INSANE;
+      break;
+    }
+  }
+
+  return ERROR_INSANE;
+}
+
+static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplayType dt)
+{
+  KEY_T key;
+  VALUE_T value;
+  SIZE_T ptr;
+  SIZE_T offset;
+  ERROR_T rc;
+  unsigned i;
+
+  if (dt == BTREE_DEPTH_DOT)
+  {
+    os << nodenum << " [ label=\"" << nodenum << ": ";
+  }
+  else if (dt == BTREE_DEPTH)
+  {
+    os << nodenum << ": ";
+  }
+  else
+  {
+  }
+
+  switch (b.info.nodetype)
+  {
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (dt == BTREE_SORTED_KEYVAL)
+    {
+    }
+    else
+    {
+      if (dt == BTREE_DEPTH_DOT)
+      {
+      }
+      else
+      {
+        os << "Interior: ";
+      }
+      for (offset = 0; offset <= b.info.numkeys; offset++)
+      {
+        rc = b.GetPtr(offset, ptr);
+        if (rc)
+        {
+          return rc;
+        }
+        os << "*" << ptr << " ";
+        // Last pointer
+        if (offset == b.info.numkeys)
+          break;
+        rc = b.GetKey(offset, key);
+        if (rc)
+        {
+          return rc;
+        }
+        for (i = 0; i < key.length; i++)
+        {
+          os << key.data[i];
+        }
+        os << " ";
+      }
+    }
+    break;
+  case BTREE_LEAF_NODE:
+    if (dt == BTREE_DEPTH_DOT || dt == BTREE_SORTED_KEYVAL)
+    {
+    }
+    else
+    {
+      os << "Leaf: ";
+    }
+    for (offset = 0; offset < b.info.numkeys; offset++)
+    {
+      if (offset == 0)
+      {
+        // special case for first pointer
+        rc = b.GetPtr(offset, ptr);
+        if (rc)
+        {
+          return rc;
+        }
+        if (dt != BTREE_SORTED_KEYVAL)
+        {
+          os << "*" << ptr << " ";
+        }
+      }
+      if (dt == BTREE_SORTED_KEYVAL)
+      {
+        os << "(";
+      }
+      rc = b.GetKey(offset, key);
+      if (rc)
+      {
+        return rc;
+      }
+      for (i = 0; i < key.length; i++)
+      {
+        os << key.data[i];
+      }
+      if (dt == BTREE_SORTED_KEYVAL)
+      {
+        os << ",";
+      }
+      else
+      {
+        os << " ";
+      }
+      rc = b.GetVal(offset, value);
+      if (rc)
+      {
+        return rc;
+      }
+      for (i = 0; i < value.length; i++)
+      {
+        os << value.data[i];
+      }
+      if (dt == BTREE_SORTED_KEYVAL)
+      {
+        os << ")\n";
+      }
+      else
+      {
+        os << " ";
+      }
+    }
+    break;
+  default:
+    if (dt == BTREE_DEPTH_DOT)
+    {
+      os << "Unknown(" << b.info.nodetype << ")";
+    }
+    else
+    {
+      os << "Unsupported Node Type " << b.info.nodetype;
+    }
+  }
+  if (dt == BTREE_DEPTH_DOT)
+  {
+    os << "\" ]";
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
+{
+  BTreeOpScope scope(this, BTREE_OP_LOOKUP, BTREE_OP_READS);
+
+  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+}
+
+// Keys run from one byte up to the index's keysize, and values up to
+// its valuesize
+static bool PairFits(const NodeMetadata &info, const KEY_T &key, const VALUE_T &value)
+{
+  return key.length > 0 && key.length <= info.keysize && value.length <= info.valuesize;
+}
+
+// Whether node is underfull once less bytes of its slots go.  A
+// compressed leaf holds far more than any plain sibling could take in,
+// so it is only underfull once it is empty.
+static bool Underfull(const BTreeNode &node, const SIZE_T less)
+{
+  if (node.info.compressed)
+  {
+    return node.GetUsedBytes() == less;
+  }
+  return node.GetUsedBytes() - less < node.info.GetMinBytes();
+}
+
+ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+  VALUE_T valueparam = value;
+  SIZE_T adjusted_block;
+  KEY_T adjusted_key; 
+  BTreeOpScope scope(this, BTREE_OP_INSERT, BTREE_OP_WRITES_LEAF);
+  ERROR_T rc;
+
+  if (!PairFits(superblock.info, key, value))
+  {
+    return scope.Commit(ERROR_SIZE);
+  }
+
+  rc = ChangeLeaf(BTREE_OP_INSERT, key, value);
+  if (rc != ERROR_SPLIT_BLOCK)
+  {
+    return scope.Commit(rc);
+  }
+  scope.Escalate();
+
+  // A split that fails partway, as when the disk fills, is not written
+  opsplits = 0;
+  rc = InsertAfterAdjust(superblock.info.rootnode, KEY_T(), KEY_T(), key, valueparam, adjusted_block, adjusted_key);
+  if (rc != ERROR_NOERROR)
+  {
+    return AbandonWrites(scope, rc);
+  }
+  return scope.Commit(rc);
+}
+
+ERROR_T BTreeIndex::ChangeLeaf(const BTreeOp op, const KEY_T &key, const VALUE_T &value)
+{
+  BTreeNode leaf;
+  SIZE_T leafblock;
+  SIZE_T offset;
+  bool found;
+  ERROR_T rc;
+
+  rc = FindLeaf(LEAF_FOR_KEY, &key, leafblock, leaf);
+  if (rc == ERROR_NONEXISTENT)
+  {
+    // An empty tree; the first insert makes a leaf
+    return op == BTREE_OP_INSERT ? ERROR_SPLIT_BLOCK : ERROR_NONEXISTENT;
+  }
+  if (rc != ERROR_NOERROR)
+  {
+    return rc;
+  }
+
+  // Other writers may have changed the leaf since we read it, but not
+  // which keys it covers
+  lock_guard<mutex> guard(leaflatches[leafblock % BTREE_LEAF_LATCHES]);
+
+  rc = ReadNode(leafblock, leaf);
+  if (rc != ERROR_NOERROR)
+  {
+    return rc;
+  }
+
+  offset = leaf.SearchKey(key, found);
+  switch (op)
+  {
+  case BTREE_OP_INSERT:
+    if (found)
+    {
+      return ERROR_UNIQUE_KEY;
+    }
+    rc = leaf.InsertKeyVal(offset, key, value);
+    if (rc == ERROR_NOSPACE)
+    {
+      return ERROR_SPLIT_BLOCK;
+    }
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    break;
+  case BTREE_OP_UPDATE:
+    if (!found)
+    {
+      return ERROR_NONEXISTENT;
+    }
+    // A longer value may no longer fit
+    rc = leaf.SetVal(offset, value);
+    if (rc == ERROR_NOSPACE)
+    {
+      return ERROR_SPLIT_BLOCK;
+    }
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    break;
+  default:
+    if (!found)
+    {
+      return ERROR_NONEXISTENT;
+    }
+    if (Underfull(leaf, leaf.GetSlotBytes(offset)))
+    {
+      return ERROR_UNDERFLOW_BLOCK;
+    }
+    rc = leaf.RemoveSlot(offset);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    break;
+  }
+
+  return WriteNode(leafblock, leaf);
+}
+
+
+//
+// Entries
+//
+// A bulk load builds each level of interior nodes from the children
+// below it.  Their separators and pointers go into a BTreeEntries,
+// which is dealt out into nodes cut where the bytes come out about
+// even, each with the prefix of its new separators.
+//
+struct BTreeEntries
+{
+  vector<KEY_T> keys;
+  vector<VALUE_T> values;  // leaf
+  vector<SIZE_T> ptrs;     // interior, one more than keys
+};
+
+// Bytes keys [first,last) of e take in a node of info's type with a
+// prefix of prefix bytes
+static SIZE_T EntriesBytes(NodeMetadata info, const BTreeEntries &e, const SIZE_T first, const SIZE_T last,
+                           const SIZE_T prefix)
+{
+  bool leaf = (info.nodetype == BTREE_LEAF_NODE);
+  SIZE_T bytes = 0;
+
+  info.keyprefix = prefix;
+  for (SIZE_T i = first; i < last; i++)
+  {
+    bytes += info.GetSlotBytes(e.keys[i].length, leaf ? e.values[i].length : 0);
+  }
+  return bytes;
+}
+
+// Whether they fit; in a compressed leaf, packed as well
+static bool EntriesFit(NodeMetadata info, const BTreeEntries &e, const SIZE_T first, const SIZE_T last,
+                       const SIZE_T prefix)
+{
+  info.keyprefix = prefix;
+  if (EntriesBytes(info, e, first, last, prefix) > info.GetCapacity())
+  {
+    return false;
+  }
+  if (info.compressed)
+  {
+    SIZE_T packed = info.GetPackedHeaderBytes();
+    for (SIZE_T i = first; i < last; i++)
+    {
+      packed += i > first ? info.GetPackedPairBytes(e.keys[i - 1], e.values[i - 1], e.keys[i], e.values[i])
+                          : info.GetPackedPairBytes(KEY_T(), VALUE_T(), e.keys[i], e.values[i]);
+    }
+    return packed <= info.blocksize;
+  }
+  return true;
+}
+
+// The cuts to try when parting entries of the given sizes between two
+// nodes, the most even first and then outward from it.  A leaf cut c
+// parts them into [0,c) and [c,n); an interior cut sends key c up and
+// leaves [0,c) and (c,n).
+static void CutOrder(const vector<SIZE_T> &sizes, const bool leaf, vector<SIZE_T> &cuts)
+{
+  SIZE_T n = sizes.size();
+  SIZE_T first = leaf ? 1 : 0;
+  vector<SIZE_T> bytes(n + 1, 0);
+  SIZE_T best = first;
+
+  cuts.clear();
+  if (n == 0 || first > n - 1)
+  {
+    return;
+  }
+  for (SIZE_T i = 0; i < n; i++)
+  {
+    bytes[i + 1] = bytes[i] + sizes[i];
+  }
+  for (SIZE_T c = first; c < n; c++)
+  {
+    SIZE_T lower = bytes[c];
+    SIZE_T upper = bytes[n] - bytes[leaf ? c : c + 1];
+    SIZE_T bestlower = bytes[best];
+    SIZE_T bestupper = bytes[n] - bytes[leaf ? best : best + 1];
+    if (max(lower, upper) - min(lower, upper) < max(bestlower, bestupper) - min(bestlower, bestupper))
+    {
+      best = c;
+    }
+  }
+
+  // The most even cut nearly always fits; if prefixes get in the way,
+  // those either side of it come next
+  for (SIZE_T step = 0; step < n; step++)
+  {
+    for (int side = 0; side < 2; side++)
+    {
+      if ((side == 0 && step == 0) || (side == 0 ? best < first + step : best + step >= n))
+      {
+        continue;
+      }
+      cuts.push_back(side == 0 ? best - step : best + step);
+    }
+  }
+}
+
+// Where to part e between two nodes of info's type, between the
+// separators lo and hi, so both fit and come out as even as can be.
+// The lower node takes keys [0,cut).  A leaf's separator is then its
+// last key; an interior node's is the key at cut, which goes up,
+// leaving pointers [0,cut] below it.
+// return ERROR_NOSPACE if there is no such place
+static ERROR_T ChooseCut(const NodeMetadata &info, const BTreeEntries &e, const KEY_T &lo, const KEY_T &hi,
+                         SIZE_T &cut)
+{
+  bool leaf = (info.nodetype == BTREE_LEAF_NODE);
+  SIZE_T n = e.keys.size();
+  vector<SIZE_T> sizes;
+  vector<SIZE_T> cuts;
+
+  for (SIZE_T i = 0; i < n; i++)
+  {
+    sizes.push_back(EntriesBytes(info, e, i, i + 1, 0));
+  }
+  CutOrder(sizes, leaf, cuts);
+  for (SIZE_T i = 0; i < cuts.size(); i++)
+  {
+    SIZE_T c = cuts[i];
+    const KEY_T &separator = e.keys[leaf ? c - 1 : c];
+    if (EntriesFit(info, e, 0, c, GetSharedPrefix(lo, separator)) &&
+        EntriesFit(info, e, leaf ? c : c + 1, n, GetSharedPrefix(separator, hi)))
+    {
+      cut = c;
+      return ERROR_NOERROR;
+    }
+  }
+  return ERROR_NOSPACE;
+}
+
+// Empties node, keeping its type, links and form, and deals it keys
+// [first,last) of e with a prefix of prefix bytes; an interior node
+// takes pointers [first,last]
+static ERROR_T FillNode(BTreeNode &node, const BTreeEntries &e, const SIZE_T first, const SIZE_T last,
+                        const SIZE_T prefix)
+{
+  BTreeNode fresh(node.info.nodetype, node.info.keysize, node.info.valuesize, node.info.blocksize);
+  bool leaf = (node.info.nodetype == BTREE_LEAF_NODE);
+  SIZE_T ptr;
+  ERROR_T rc;
+
+  fresh.info.rootnode = node.info.rootnode;
+  fresh.info.freelist = node.info.freelist;
+  if (leaf)
+  {
+    node.GetPtr(0, ptr);
+    fresh.SetPtr(0, ptr);
+    rc = fresh.SetCompressed(node.info.compressed != 0);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+  }
+  if (first < last)
+  {
+    rc = fresh.SetKeyPrefix(e.keys[first], prefix);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+  }
+  for (SIZE_T i = first; i < last; i++)
+  {
+    rc = leaf ? fresh.InsertKeyVal(i - first, e.keys[i], e.values[i])
+              : fresh.InsertKeyPtr(i - first, e.keys[i], e.ptrs[i]);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+  }
+  if (!leaf)
+  {
+    fresh.SetPtr(last - first, e.ptrs[last]);
+  }
+  node = fresh;
+  return ERROR_NOERROR;
+}
+
+//
+// Splits, merges and evening out
+//
+// These move ranges of slots between the nodes involved with
+// MoveSlots and SplitAt, so each record is copied once.  A node whose
+// separators draw closer takes the longer prefix after its slots have
+// moved out, and one whose separators move apart the shorter prefix
+// before slots move in.  Each cut is tried on copies, from the most
+// even out, until both nodes fit.
+//
+// Between leaves the separator that goes up is the shortest key from
+// the lower part's last key to below the upper part's first, which
+// needn't be a key of either, so interior nodes hold shorter keys.
+// The lower leaf's prefix may come out shorter for it.  Bulk loading
+// keeps the last keys, as each leaf's prefix is set before the next
+// leaf's first key is known.
+//
+
+// Sizes of node's slots, added to sizes, for CutOrder
+static void SlotSizes(const BTreeNode &node, vector<SIZE_T> &sizes)
+{
+  for (SIZE_T i = 0; i < node.info.numkeys; i++)
+  {
+    sizes.push_back(node.GetSlotBytes(i));
+  }
+}
+
+// The shortest key from last up to but not including first, the keys
+// either side of a cut between leaves: first cut off just past where
+// the two part, if that leaves it shorter, else the same length of
+// last with its final byte raised, if that stays below first, else
+// last itself.
+static void ShortSeparator(const KEY_T &last, const KEY_T &first, KEY_T &separator)
+{
+  SIZE_T n = GetSharedPrefix(last, first);
+
+  if (n < last.length && n + 1 < first.length)
+  {
+    separator = first;
+    separator.Resize(n + 1);
+  }
+  else if (n < last.length && last.data[n] + 1 < first.data[n])
+  {
+    separator = last;
+    separator.Resize(n + 1);
+    separator.data[n]++;
+  }
+  else
+  {
+    separator = last;
+  }
+}
+
+// Splits the full leaf b, with key and value going in at offset, about
+// evenly by bytes.  b keeps the lower part and upper, made like b,
+// takes the rest.  separator is the short key between them, and each
+// part takes the prefix it shares with its other separator, lo or hi.
+// return ERROR_NOSPACE if no cut leaves both parts fitting
+static ERROR_T SplitLeaf(BTreeNode &b, const SIZE_T offset, const KEY_T &key, const VALUE_T &value,
+                         const KEY_T &lo, const KEY_T &hi, BTreeNode &upper, KEY_T &separator)
+{
+  vector<SIZE_T> sizes;
+  vector<SIZE_T> cuts;
+  ERROR_T rc;
+
+  SlotSizes(b, sizes);
+  sizes.insert(sizes.begin() + offset, b.GetSlotBytes(key, value.length));
+  CutOrder(sizes, true, cuts);
+  for (SIZE_T i = 0; i < cuts.size(); i++)
+  {
+    // The lower part takes cut pairs, the new one among them if it
+    // comes before the cut, so at of b's own
+    SIZE_T cut = cuts[i];
+    SIZE_T at = offset < cut ? cut - 1 : cut;
+    BTreeNode lower(b);
+    KEY_T last;
+    KEY_T first;
+
+    if (offset + 1 == cut)
+    {
+      last = key;
+    }
+    else
+    {
+      b.GetKey(at - 1, last);
+    }
+    if (offset == cut)
+    {
+      first = key;
+    }
+    else
+    {
+      b.GetKey(at, first);
+    }
+    ShortSeparator(last, first, separator);
+    rc = lower.SplitAt(at, upper, separator, GetSharedPrefix(separator, hi));
+    if (rc == ERROR_NOERROR)
+    {
+      rc = lower.SetKeyPrefix(separator, GetSharedPrefix(lo, separator));
+    }
+    if (rc == ERROR_NOERROR)
+    {
+      rc = offset < cut ? lower.InsertKeyVal(offset, key, value) : upper.InsertKeyVal(offset - cut, key, value);
+    }
+    if (rc == ERROR_NOERROR)
+    {
+      b = lower;
+      return ERROR_NOERROR;
+    }
+    if (rc != ERROR_NOSPACE)
+    {
+      return rc;
+    }
+  }
+  return ERROR_NOSPACE;
+}
+
+// Splits the full interior node b, with key and the pointer to its
+// left going in at offset, about evenly by bytes.  b keeps the lower
+// part and upper, made like b, takes the rest.  separator is the key
+// between them, which goes up; key may not be it.  Each part takes
+// the prefix it shares with its other separator, lo or hi.
+// return ERROR_NOSPACE if no cut leaves both parts fitting
+static ERROR_T SplitInterior(BTreeNode &b, const SIZE_T offset, const KEY_T &key, const SIZE_T ptr,
+                             const KEY_T &lo, const KEY_T &hi, BTreeNode &upper, KEY_T &separator)
+{
+  vector<SIZE_T> sizes;
+  vector<SIZE_T> cuts;
+  ERROR_T rc;
+
+  SlotSizes(b, sizes);
+  sizes.insert(sizes.begin() + offset, b.GetSlotBytes(key, 0));
+  CutOrder(sizes, false, cuts);
+  for (SIZE_T i = 0; i < cuts.size(); i++)
+  {
+    // The key at cut goes up.  Unless it is the new one, it is b's key
+    // at up, whose pointer becomes the lower part's last.
+    SIZE_T cut = cuts[i];
+    SIZE_T up = offset < cut ? cut - 1 : cut;
+    SIZE_T last = ptr;
+    BTreeNode lower(b);
+
+    if (offset == cut)
+    {
+      separator = key;
+      rc = lower.SplitAt(cut, upper, separator, GetSharedPrefix(separator, hi));
+    }
+    else
+    {
+      b.GetKey(up, separator);
+      rc = lower.SplitAt(up + 1, upper, separator, GetSharedPrefix(separator, hi));
+      if (rc == ERROR_NOERROR)
+      {
+        lower.GetPtr(up, last);
+        rc = lower.RemoveSlot(up);
+      }
+    }
+    if (rc == ERROR_NOERROR)
+    {
+      lower.SetPtr(lower.info.numkeys, last);
+      rc = lower.SetKeyPrefix(separator, GetSharedPrefix(lo, separator));
+    }
+    if (rc == ERROR_NOERROR && offset != cut)
+    {
+      rc = offset < cut ? lower.InsertKeyPtr(offset, key, ptr) : upper.InsertKeyPtr(offset - cut - 1, key, ptr);
+    }
+    if (rc == ERROR_NOERROR)
+    {
+      b = lower;
+      return ERROR_NOERROR;
+    }
+    if (rc != ERROR_NOSPACE)
+    {
+      return rc;
+    }
+  }
+  return ERROR_NOSPACE;
+}
+
+// Moves all of x into y, the node after it, which takes a prefix of
+// prefix bytes of sep, the key between them in their parent.  An
+// interior pair takes sep down between x's last pointer and y's first.
+// return ERROR_NOSPACE, with x as it was, if y can't hold them
+static ERROR_T MergeInto(BTreeNode &x, BTreeNode &y, const KEY_T &sep, const SIZE_T prefix)
+{
+  SIZE_T ptr;
+  ERROR_T rc;
+
+  rc = y.SetKeyPrefix(sep, prefix);
+  if (rc == ERROR_NOERROR && x.info.nodetype != BTREE_LEAF_NODE)
+  {
+    x.GetPtr(x.info.numkeys, ptr);
+    rc = y.InsertKeyPtr(0, sep, ptr);
+  }
+  if (rc == ERROR_NOERROR)
+  {
+    rc = x.MoveSlots(0, x.info.numkeys, y, 0);
+  }
+  return rc;
+}
+
+// Evens out x and y, a pair of nodes between the separators lo and
+// hi, about by bytes.  sep is the key between them in their parent,
+// which an interior pair takes down as it sends another up.
+// separator is the key to take its place, which is sep itself where
+// nothing moves.  Each node takes the prefix it shares with its other
+// separator.
+// return ERROR_NOSPACE, with both as they were, if no cut fits
+static ERROR_T EvenOut(BTreeNode &x, BTreeNode &y, const KEY_T &sep, const KEY_T &lo, const KEY_T &hi,
+                       KEY_T &separator)
+{
+  bool leaf = (x.info.nodetype == BTREE_LEAF_NODE);
+  SIZE_T nx = x.info.numkeys;
+  vector<SIZE_T> sizes;
+  vector<SIZE_T> cuts;
+  SIZE_T ptr;
+  ERROR_T rc;
+
+  SlotSizes(x, sizes);
+  if (!leaf)
+  {
+    sizes.push_back(x.GetSlotBytes(sep, 0));
+  }
+  SlotSizes(y, sizes);
+  CutOrder(sizes, leaf, cuts);
+  for (SIZE_T i = 0; i < cuts.size(); i++)
+  {
+    SIZE_T cut = cuts[i];
+    BTreeNode lower(x);
+    BTreeNode upper(y);
+    KEY_T last;
+    KEY_T first;
+
+    if (cut == nx)
+    {
+      separator = sep;
+      rc = lower.SetKeyPrefix(separator, GetSharedPrefix(lo, separator));
+      if (rc == ERROR_NOERROR)
+      {
+        rc = upper.SetKeyPrefix(separator, GetSharedPrefix(separator, hi));
+      }
+    }
+    else if (leaf && cut < nx)
+    {
+      // x's top moves to the front of y
+      lower.GetKey(cut - 1, last);
+      lower.GetKey(cut, first);
+      ShortSeparator(last, first, separator);
+      rc = upper.SetKeyPrefix(separator, GetSharedPrefix(separator, hi));
+      if (rc == ERROR_NOERROR)
+      {
+        rc = lower.MoveSlots(cut, nx - cut, upper, 0);
+      }
+      if (rc == ERROR_NOERROR)
+      {
+        rc = lower.SetKeyPrefix(separator, GetSharedPrefix(lo, separator));
+      }
+    }
+    else if (leaf)
+    {
+      // y's bottom moves to the end of x
+      upper.GetKey(cut - nx - 1, last);
+      upper.GetKey(cut - nx, first);
+      ShortSeparator(last, first, separator);
+      rc = lower.SetKeyPrefix(separator, GetSharedPrefix(lo, separator));
+      if (rc == ERROR_NOERROR)
+      {
+        rc = upper.MoveSlots(0, cut - nx, lower, nx);
+      }
+      if (rc == ERROR_NOERROR)
+      {
+        rc = upper.SetKeyPrefix(separator, GetSharedPrefix(separator, hi));
+      }
+    }
+    else if (cut < nx)
+    {
+      // sep comes down to the front of y after x's top, and x's key at
+      // cut goes up, its pointer becoming x's last
+      lower.GetKey(cut, separator);
+      rc = upper.SetKeyPrefix(separator, GetSharedPrefix(separator, hi));
+      if (rc == ERROR_NOERROR)
+      {
+        lower.GetPtr(nx, ptr);
+        rc = upper.InsertKeyPtr(0, sep, ptr);
+      }
+      if (rc == ERROR_NOERROR)
+      {
+        rc = lower.MoveSlots(cut + 1, nx - cut - 1, upper, 0);
+      }
+      if (rc == ERROR_NOERROR)
+      {
+        lower.GetPtr(cut, ptr);
+        rc = lower.RemoveSlot(cut);
+      }
+      if (rc == ERROR_NOERROR)
+      {
+        lower.SetPtr(cut, ptr);
+        rc = lower.SetKeyPrefix(separator, GetSharedPrefix(lo, separator));
+      }
+    }
+    else
+    {
+      // sep comes down to the end of x before y's bottom, and the key
+      // of y's after that goes up, its pointer becoming x's last
+      SIZE_T m = cut - nx - 1;
+      upper.GetKey(m, separator);
+      rc = lower.SetKeyPrefix(separator, GetSharedPrefix(lo, separator));
+      if (rc == ERROR_NOERROR)
+      {
+        lower.GetPtr(nx, ptr);
+        rc = lower.InsertKeyPtr(nx, sep, ptr);
+      }
+      if (rc == ERROR_NOERROR)
+      {
+        rc = upper.MoveSlots(0, m, lower, nx + 1);
+      }
+      if (rc == ERROR_NOERROR)
+      {
+        upper.GetPtr(0, ptr);
+        rc = upper.RemoveSlot(0);
+      }
+      if (rc == ERROR_NOERROR)
+      {
+        lower.SetPtr(lower.info.numkeys, ptr);
+        rc = upper.SetKeyPrefix(separator, GetSharedPrefix(separator, hi));
+      }
+    }
+    if (rc == ERROR_NOERROR)
+    {
+      x = lower;
+      y = upper;
+      return ERROR_NOERROR;
+    }
+    if (rc != ERROR_NOSPACE)
+    {
+      return rc;
+    }
+  }
+  return ERROR_NOSPACE;
+}
+
+// The separators around the child at offset of b, given b's own
+// (empty where open)
+static void ChildFences(const BTreeNode &b, const SIZE_T offset, const KEY_T &lo, const KEY_T &hi,
+                        KEY_T &childlo, KEY_T &childhi)
+{
+  if (offset > 0)
+  {
+    b.GetKey(offset - 1, childlo);
+  }
+  else
+  {
+    childlo = lo;
+  }
+  if (offset < b.info.numkeys)
+  {
+    b.GetKey(offset, childhi);
+  }
+  else
+  {
+    childhi = hi;
+  }
+}
+
+ERROR_T BTreeIndex::InsertAfterAdjust(const SIZE_T &start_ptr, const KEY_T &lo, const KEY_T &hi,
+                                      const KEY_T &key, const VALUE_T &value, SIZE_T &adjusted_block, KEY_T &adjusted_key)
+{
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T offset;
+  bool found;
+  SIZE_T ptr;
+  KEY_T childlo;
+  KEY_T childhi;
+
+  rc = ReadNode(start_ptr, b);
+
+  if (rc != ERROR_NOERROR)
+  {
+    return rc;
+  }
+
+  switch (b.info.nodetype)
+  {
+  case BTREE_ROOT_NODE:
+    rc = b.GetPtr(0, ptr);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    if (ptr == 0)
+    {
+      // Empty tree, so the key goes in a first leaf under the root
+      SIZE_T leafBlock;
+      BTreeNode leaf(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
+      rc = AllocateNode(leafBlock, start_ptr);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+
+      leaf.SetPtr(0, 0);
+      rc = leaf.InsertKeyVal(0, key, value);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+
+      rc = WriteNode(leafBlock, leaf);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+      b.SetPtr(0, leafBlock);
+      return WriteNode(start_ptr, b);
+    }
+    // fall through
+  case BTREE_INTERIOR_NODE:
+    // Even an equal key is only a separator, which a delete may have
+    // left behind, so only the leaf can say whether the key exists
+    offset = b.SearchKey(key, found);
+    rc = b.GetPtr(offset, ptr);
+    if (rc)
+    {
+      return rc;
+    }
+    ChildFences(b, offset, lo, hi, childlo, childhi);
+    rc = InsertAfterAdjust(ptr, childlo, childhi, key, value, adjusted_block, adjusted_key);
+    if (rc != ERROR_SPLIT_BLOCK)
+    {
+      return rc;
+    }
+
+    // The child split.  Its lower half now lives in adjusted_block and
+    // goes in a new slot just before the child's own pointer.
+    rc = b.InsertKeyPtr(offset, adjusted_key, adjusted_block);
+    if (rc == ERROR_NOERROR)
+    {
+      return WriteNode(start_ptr, b);
+    }
+    else if (rc != ERROR_NOSPACE)
+    {
+      return rc;
+    }
+    else
+    {
+      // Full, so split this node too, about evenly by bytes.  The lower
+      // half moves to a new block, the upper half stays here, and the
+      // key between them goes up.
+      BTreeNode new_block;
+      KEY_T childkey(adjusted_key);
+
+      rc = SplitInterior(b, offset, childkey, adjusted_block, lo, hi, new_block, adjusted_key);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+
+      CountSplit();
+
+      rc = AllocateNode(adjusted_block, start_ptr);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+      new_block.info.nodetype = BTREE_INTERIOR_NODE;
+
+      if (b.info.nodetype == BTREE_ROOT_NODE)
+      {
+        // The root split, so both halves hang off a new root
+        BTreeNode new_root(BTREE_ROOT_NODE, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
+        SIZE_T new_root_block;
+
+        b.info.nodetype = BTREE_INTERIOR_NODE;
+
+        rc = AllocateNode(new_root_block, start_ptr);
+        if (rc != ERROR_NOERROR)
+        {
+          return rc;
+        }
+        rc = new_root.InsertKeyPtr(0, adjusted_key, adjusted_block);
+        if (rc != ERROR_NOERROR)
+        {
+          return rc;
+        }
+        new_root.SetPtr(1, start_ptr);
+
+        rc = WriteNode(start_ptr, new_block);
+        if (rc != ERROR_NOERROR)
+        {
+          return rc;
+        }
+        rc = WriteNode(adjusted_block, b);
+        if (rc != ERROR_NOERROR)
+        {
+          return rc;
+        }
+        rc = WriteNode(new_root_block, new_root);
+        if (rc != ERROR_NOERROR)
+        {
+          return rc;
+        }
+
+        superblock.info.rootnode = new_root_block;
+
+        return WriteNode(superblock_index, superblock);
+      }
+
+      rc = WriteNode(start_ptr, new_block);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+      rc = WriteNode(adjusted_block, b);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+      return ERROR_SPLIT_BLOCK;
+    }
+    break;
+
+  case BTREE_LEAF_NODE:
+    offset = b.SearchKey(key, found);
+    if (found)
+    {
+      return ERROR_UNIQUE_KEY;
+    }
+
+    rc = b.InsertKeyVal(offset, key, value);
+    if (rc == ERROR_NOERROR)
+    {
+      return WriteNode(start_ptr, b);
+    }
+    else if (rc != ERROR_NOSPACE)
+    {
+      return rc;
+    }
+    else
+    {
+      // Full, so split, about evenly by bytes.  The lower half moves to
+      // a new block and a short key above its last becomes the separator
+      // in our parent.
+      BTreeNode new_node;
+
+      rc = SplitLeaf(b, offset, key, value, lo, hi, new_node, adjusted_key);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+
+      CountSplit();
+      rc = AllocateNode(adjusted_block, start_ptr);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+      rc = ApplyCompressPolicy(b);
+      if (rc == ERROR_NOERROR)
+      {
+        rc = ApplyCompressPolicy(new_node);
+      }
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+
+      // Relink the chain as prev <-> lower half <-> upper half <-> next
+      rc = b.GetPtr(0, ptr);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+      new_node.SetPtr(0, ptr);
+      new_node.info.freelist = adjusted_block;
+      b.SetPtr(0, start_ptr);
+      if (b.info.freelist != 0)
+      {
+        BTreeNode prev;
+        rc = ReadNode(b.info.freelist, prev);
+        if (rc != ERROR_NOERROR)
+        {
+          return rc;
+        }
+        prev.SetPtr(0, adjusted_block);
+        rc = WriteNode(b.info.freelist, prev);
+        if (rc != ERROR_NOERROR)
+        {
+          return rc;
+        }
+      }
+
+      rc = WriteNode(start_ptr, new_node);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+      rc = WriteNode(adjusted_block, b);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+
+      return ERROR_SPLIT_BLOCK;
+    }
+    break;
+
+  default:
+    return ERROR_INSANE;
+    break;
+  }
+  return ERROR_INSANE;
+}
+
+
+
+
+// Bytes a leaf or interior node will hold when packed to fillfactor
+static SIZE_T BulkLoadTarget(const NodeMetadata &info, const double fillfactor)
+{
+  return (SIZE_T)(fillfactor * info.GetCapacity());
+}
+
+// Whether leaf, with its prefix cut to prefix bytes, still holds no
+// more than its target once pair is added.  The first pair sets whether
+// the leaf is compressed.
+static bool BulkLoadFits(const BTreeNode &leaf, const KeyValuePair &pair, const SIZE_T prefix, const double fillfactor)
+{
+  if (prefix != leaf.info.keyprefix)
+  {
+    BTreeNode wider(leaf);
+    return wider.SetKeyPrefix(pair.key, prefix) == ERROR_NOERROR && BulkLoadFits(wider, pair, prefix, fillfactor);
+  }
+  if (leaf.info.compressed)
+  {
+    // Packed to fillfactor of the block, so long as it fits unpacked
+    KEY_T lastkey;
+    VALUE_T lastvalue;
+    leaf.GetKey(leaf.info.numkeys - 1, lastkey);
+    leaf.GetVal(leaf.info.numkeys - 1, lastvalue);
+    return leaf.GetUsedBytes() + leaf.GetSlotBytes(pair.key, pair.value.length) <= leaf.info.GetCapacity() &&
+           leaf.info.packed + leaf.info.GetPackedPairBytes(lastkey, lastvalue, pair.key, pair.value) <=
+           (SIZE_T)(fillfactor * leaf.info.blocksize);
+  }
+  return leaf.GetUsedBytes() + leaf.GetSlotBytes(pair.key, pair.value.length) <= BulkLoadTarget(leaf.info, fillfactor);
+}
+
+// Writes a finished leaf after the ones already in blocks, linking it
+// to the last of them and to nextblock, and records its block and last
+// key for the level above
+ERROR_T BTreeIndex::BulkLoadLeaf(BTreeNode &leaf, const SIZE_T leafblock, const SIZE_T nextblock,
+                                 vector<SIZE_T> &blocks, vector<KEY_T> &maxkeys)
+{
+  ERROR_T rc;
+
+  leaf.SetPtr(0, nextblock);
+  leaf.info.freelist = blocks.empty() ? 0 : blocks.back();
+  rc = WriteNode(leafblock, leaf);
+  if (rc != ERROR_NOERROR)
+  {
+    return rc;
+  }
+  blocks.push_back(leafblock);
+  maxkeys.push_back(KEY_T());
+  if (leaf.info.numkeys > 0)
+  {
+    return leaf.GetKey(leaf.info.numkeys - 1, maxkeys.back());
+  }
+  return ERROR_NOERROR;
+}
+
+// Writes prev, the leaf before cur, taking blocks for both if they
+// have none yet
+ERROR_T BTreeIndex::BulkLoadPrev(BTreeNode &prev, SIZE_T &prevblock, SIZE_T &curblock,
+                                 vector<SIZE_T> &blocks, vector<KEY_T> &maxkeys, vector<SIZE_T> &taken)
+{
+  ERROR_T rc;
+
+  if (prevblock == 0)
+  {
+    if ((rc = PopFreeBlock(prevblock, blocks.empty() ? 0 : blocks.back())) != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    taken.push_back(prevblock);
+  }
+  if ((rc = PopFreeBlock(curblock, prevblock)) != ERROR_NOERROR)
+  {
+    return rc;
+  }
+  taken.push_back(curblock);
+  return BulkLoadLeaf(prev, prevblock, curblock, blocks, maxkeys);
+}
+
+// Replaces one level of children with the level of interior nodes
+// above it.  Nodes are filled left to right, each to fillfactor of the
+// bytes its key prefix leaves it.  The last has no separator above it,
+// so no prefix; if it doesn't fit without one, or is left underfull, it
+// is merged into its neighbour where they fit together, and evened out
+// with it, or split, otherwise.  A level of one node is the root.
+ERROR_T BTreeIndex::BulkLoadLevel(vector<SIZE_T> &blocks, vector<KEY_T> &maxkeys, const double fillfactor,
+                                  vector<SIZE_T> &taken)
+{
+  ERROR_T rc;
+  NodeMetadata plain = superblock.info;
+  SIZE_T n = blocks.size();
+  BTreeEntries e;
+  vector<SIZE_T> firsts;  // each node's first child
+  vector<SIZE_T> upblocks;
+  vector<KEY_T> upkeys;
+  KEY_T open;
+
+  plain.nodetype = BTREE_INTERIOR_NODE;
+  plain.keyprefix = 0;
+  e.keys.assign(maxkeys.begin(), maxkeys.end() - 1);
+  e.ptrs = blocks;
+
+  // A node's prefix is what its first and last children's separators
+  // share, which only shrinks as children are added
+  for (SIZE_T child = 0; child < n;)
+  {
+    const KEY_T &lo = child > 0 ? maxkeys[child - 1] : open;
+    NodeMetadata info = plain;
+    SIZE_T bytes = 0;
+
+    firsts.push_back(child);
+    for (child++; child < n; child++)
+    {
+      SIZE_T prefix = GetSharedPrefix(lo, maxkeys[child]);
+      if (prefix != info.keyprefix)
+      {
+        info.keyprefix = prefix;
+        bytes = EntriesBytes(info, e, firsts.back(), child - 1, prefix);
+      }
+      SIZE_T more = info.GetSlotBytes(e.keys[child - 1].length, 0);
+      if (bytes + more > BulkLoadTarget(info, fillfactor))
+      {
+        break;
+      }
+      bytes += more;
+    }
+  }
+
+  SIZE_T last = firsts.back();
+  SIZE_T bytes = EntriesBytes(plain, e, last, n - 1, 0);
+  bool over = bytes > plain.GetCapacity();
+  if (firsts.size() > 1 && (over || bytes < plain.GetMinBytes()))
+  {
+    SIZE_T before = firsts[firsts.size() - 2];
+    const KEY_T &lo = before > 0 ? maxkeys[before - 1] : open;
+    BTreeEntries pair;
+    SIZE_T cut;
+
+    firsts.pop_back();
+    pair.keys.assign(e.keys.begin() + before, e.keys.end());
+    pair.ptrs.assign(e.ptrs.begin() + before, e.ptrs.end());
+    if (EntriesFit(plain, pair, 0, pair.keys.size(), 0))
+    {
+      over = false;
+    }
+    else if (ChooseCut(plain, pair, lo, open, cut) == ERROR_NOERROR)
+    {
+      firsts.push_back(before + cut + 1);
+      over = false;
+    }
+    else
+    {
+      firsts.push_back(last);
+    }
+  }
+  if (over)
+  {
+    BTreeEntries alone;
+    SIZE_T cut;
+
+    alone.keys.assign(e.keys.begin() + last, e.keys.end());
+    alone.ptrs.assign(e.ptrs.begin() + last, e.ptrs.end());
+    rc = ChooseCut(plain, alone, last > 0 ? maxkeys[last - 1] : open, open, cut);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    firsts.push_back(last + cut + 1);
+  }
+
+  SIZE_T numnodes = firsts.size();
+  for (SIZE_T i = 0; i < numnodes; i++)
+  {
+    SIZE_T child = firsts[i];
+    SIZE_T end = i + 1 < numnodes ? firsts[i + 1] : n;
+    SIZE_T block;
+    BTreeNode node(numnodes == 1 ? BTREE_ROOT_NODE : BTREE_INTERIOR_NODE,
+                   superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
+    const KEY_T &lo = child > 0 ? maxkeys[child - 1] : open;
+    const KEY_T &hi = i + 1 < numnodes ? maxkeys[end - 1] : open;
+
+    rc = FillNode(node, e, child, end - 1, GetSharedPrefix(lo, hi));
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    if (numnodes == 1)
+    {
+      block = superblock.info.rootnode;
+    }
+    else
+    {
+      rc = PopFreeBlock(block, blocks[child]);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+      taken.push_back(block);
+    }
+    rc = WriteNode(block, node);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    upblocks.push_back(block);
+    upkeys.push_back(maxkeys[end - 1]);
+  }
+
+  blocks.swap(upblocks);
+  maxkeys.swap(upkeys);
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::BulkLoadTree(BTreeBulkLoadSource source, void *state, const double fillfactor,
+                                 vector<SIZE_T> &taken)
+{
+  ERROR_T rc;
+  BTreeNode root;
+  SIZE_T rootptr;
+  KeyValuePair pair;
+  KEY_T lastkey;
+  KEY_T curlo;
+  vector<SIZE_T> blocks;
+  vector<KEY_T> maxkeys;
+
+  if (fillfactor < 0.5 || fillfactor > 1.0)
+  {
+    return ERROR_BADCONFIG;
+  }
+
+  rc = ReadNode(superblock.info.rootnode, root);
+  if (rc != ERROR_NOERROR)
+  {
+    return rc;
+  }
+  rc = root.GetPtr(0, rootptr);
+  if (rc != ERROR_NOERROR)
+  {
+    return rc;
+  }
+  if (rootptr != 0)
+  {
+    return ERROR_CONFLICT;
+  }
+
+  // Leaves are filled left to right.  The last two are held back so
+  // the final one can be evened out with its neighbour.  Blocks are
+  // taken only when a leaf is written, so they come out in key order.
+  // A leaf's prefix is what its keys share with the last key of the
+  // leaf before it (curlo), so it shrinks as keys are added, and the
+  // leaf takes keys up to fillfactor of the bytes that leaves it.
+  BTreeNode empty(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
+  BTreeNode prev(empty);
+  BTreeNode cur(empty);
+  SIZE_T prevblock = 0;
+  SIZE_T curblock = 0;
+  bool haveprev = false;
+
+  while ((rc = source(pair, state)) == ERROR_NOERROR)
+  {
+    if (!PairFits(superblock.info, pair.key, pair.value))
+    {
+      return ERROR_SIZE;
+    }
+    if (lastkey.length > 0 && !(lastkey < pair.key))
+    {
+      return ERROR_CONFLICT;
+    }
+    lastkey = pair.key;
+
+    SIZE_T prefix = GetSharedPrefix(curlo, pair.key);
+    if (cur.info.numkeys > 0 && !BulkLoadFits(cur, pair, prefix, fillfactor))
+    {
+      if (haveprev)
+      {
+        // prev is complete; cur, its right neighbour, needs a block first
+        rc = BulkLoadPrev(prev, prevblock, curblock, blocks, maxkeys, taken);
+        if (rc != ERROR_NOERROR)
+        {
+          return rc;
+        }
+      }
+      prev = cur;
+      prevblock = curblock;
+      haveprev = true;
+      cur = empty;
+      curblock = 0;
+      prev.GetKey(prev.info.numkeys - 1, curlo);
+      prefix = GetSharedPrefix(curlo, pair.key);
+    }
+
+    if (cur.info.numkeys == 0)
+    {
+      rc = cur.SetCompressed(CompressesLeaf(pair.key));
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+    }
+    rc = cur.SetKeyPrefix(pair.key, prefix);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    rc = cur.InsertKeyVal(cur.info.numkeys, pair.key, pair.value);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+  }
+  if (rc != ERROR_NONEXISTENT)
+  {
+    return rc;
+  }
+  rc = ERROR_NOERROR;
+
+  if (cur.info.numkeys == 0)
+  {
+    // Nothing to load
+    return ERROR_NOERROR;
+  }
+
+  // The last leaf has nothing above it, so no prefix.  If it doesn't
+  // fit without one, or is left underfull, it and prev are merged where
+  // they fit together, and evened out with it otherwise, if the two
+  // are in the same form.  Failing that it hands its top half to a
+  // leaf of its own.
+  BTreeNode plain(cur);
+  KEY_T open;
+  KEY_T separator;
+
+  rc = plain.SetKeyPrefix(open, 0);
+  if (rc != ERROR_NOERROR && rc != ERROR_NOSPACE)
+  {
+    return rc;
+  }
+  bool over = (rc == ERROR_NOSPACE);
+  bool under = !over && !plain.info.compressed && plain.GetUsedBytes() < plain.info.GetMinBytes();
+  rc = ERROR_NOERROR;
+  if (haveprev && prev.info.compressed == cur.info.compressed && (over || under))
+  {
+    const KEY_T &prevlo = maxkeys.empty() ? open : maxkeys.back();
+    BTreeNode both(cur);
+
+    rc = MergeInto(prev, both, open, 0);
+    if (rc == ERROR_NOERROR)
+    {
+      cur = both;
+      curblock = prevblock;
+      haveprev = false;
+      over = false;
+    }
+    else if (rc == ERROR_NOSPACE)
+    {
+      rc = EvenOut(prev, cur, curlo, prevlo, open, separator);
+      if (rc == ERROR_NOERROR)
+      {
+        over = false;
+      }
+      else if (rc == ERROR_NOSPACE)
+      {
+        rc = ERROR_NOERROR;
+      }
+    }
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+  }
+  if (over)
+  {
+    BTreeNode upper;
+
+    if (haveprev)
+    {
+      rc = BulkLoadPrev(prev, prevblock, curblock, blocks, maxkeys, taken);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+    }
+    // Its top half goes to an empty leaf like it
+    rc = cur.SplitAt(cur.info.numkeys, upper, open, 0);
+    if (rc == ERROR_NOERROR)
+    {
+      rc = EvenOut(cur, upper, open, curlo, open, separator);
+    }
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    prev = cur;
+    prevblock = curblock;
+    haveprev = true;
+    curblock = 0;
+    cur = upper;
+  }
+  else
+  {
+    rc = cur.SetKeyPrefix(open, 0);
+  }
+  if (rc != ERROR_NOERROR)
+  {
+    return rc;
+  }
+
+  if (haveprev)
+  {
+    rc = BulkLoadPrev(prev, prevblock, curblock, blocks, maxkeys, taken);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    rc = BulkLoadLeaf(cur, curblock, 0, blocks, maxkeys);
+  }
+  else
+  {
+    if (curblock == 0)
+    {
+      if ((rc = PopFreeBlock(curblock, blocks.empty() ? 0 : blocks.back())) != ERROR_NOERROR)
+      {
+        return rc;
+      }
+      taken.push_back(curblock);
+    }
+    rc = BulkLoadLeaf(cur, curblock, 0, blocks, maxkeys);
+  }
+  if (rc != ERROR_NOERROR)
+  {
+    return rc;
+  }
+
+  // Always at least one level, so a single leaf ends up as the only
+  // pointer of a root with no keys
+  do
+  {
+    rc = BulkLoadLevel(blocks, maxkeys, fillfactor, taken);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+  } while (blocks.size() > 1);
+
+  return ERROR_NOERROR;
+}
+
+// Hands back the blocks a failed load took, in taken: those from past
+// highwater, the mark before the load, by lowering it again, and the
+// rest to the free list.  Only the root links the tree in, and it is
+// written last, so the index is left empty.
+ERROR_T BTreeIndex::BulkLoadRelease(const vector<SIZE_T> &taken, const SIZE_T highwater)
+{
+  BTreeNode node(BTREE_UNALLOCATED_BLOCK, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
+  ERROR_T rc;
+
+  if (taken.empty())
+  {
+    return ERROR_NOERROR;
+  }
+  for (SIZE_T i = taken.size(); i > 0; i--)
+  {
+    if (taken[i - 1] < highwater)
+    {
+      rc = PushFreeBlock(taken[i - 1], node);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+    }
+    else
+    {
+      buffercache->NotifyDeallocateBlock(taken[i - 1]);
+      CurrentOpStats().deallocs++;
+    }
+  }
+  superblock.ResolveSuperblock()->highwater = highwater;
+  return WriteNode(superblock_index, superblock);
+}
+
+ERROR_T BTreeIndex::BulkLoad(BTreeBulkLoadSource source, void *state, const double fillfactor)
+{
+  BTreeOpScope scope(this, BTREE_OP_BULKLOAD, BTREE_OP_WRITES_THROUGH);
+  SIZE_T highwater = superblock.ResolveSuperblock()->highwater;
+  vector<SIZE_T> taken;
+  ERROR_T rc;
+
+  rc = BulkLoadTree(source, state, fillfactor, taken);
+  if (rc != ERROR_NOERROR)
+  {
+    // A failed release leaves the blocks lost, but the tree empty
+    BulkLoadRelease(taken, highwater);
+    return scope.Commit(rc);
+  }
+  return scope.Commit(WriteNode(superblock_index, superblock));
+}
+
+
+ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+  VALUE_T valueparam = value;
+  SIZE_T adjusted_block;
+  KEY_T adjusted_key;
+  BTreeOpScope scope(this, BTREE_OP_UPDATE, BTREE_OP_WRITES_LEAF);
+  ERROR_T rc;
+
+  if (!PairFits(superblock.info, key, value))
+  {
+    return scope.Commit(ERROR_SIZE);
+  }
+
+  rc = ChangeLeaf(BTREE_OP_UPDATE, key, value);
+  if (rc != ERROR_SPLIT_BLOCK)
+  {
+    return scope.Commit(rc);
+  }
+  scope.Escalate();
+
+  // A longer value that doesn't fit in its leaf is a delete and an
+  // insert, which may split.  Should either fail, neither is written,
+  // so the key keeps its old value.
+  rc = DeleteRecursion(superblock.info.rootnode, KEY_T(), KEY_T(), key);
+  if (rc != ERROR_NOERROR && rc != ERROR_UNDERFLOW_BLOCK)
+  {
+    return AbandonWrites(scope, rc);
+  }
+  opsplits = 0;
+  rc = InsertAfterAdjust(superblock.info.rootnode, KEY_T(), KEY_T(), key, valueparam, adjusted_block, adjusted_key);
+  if (rc != ERROR_NOERROR)
+  {
+    return AbandonWrites(scope, rc);
+  }
+  return scope.Commit(rc);
+}
+
+ERROR_T BTreeIndex::Delete(const KEY_T &key)
+{
+  BTreeOpScope scope(this, BTREE_OP_DELETE, BTREE_OP_WRITES_LEAF);
+  ERROR_T rc;
+
+  if (key.length == 0 || key.length > superblock.info.keysize)
+  {
+    return scope.Commit(ERROR_SIZE);
+  }
+
+  rc = ChangeLeaf(BTREE_OP_DELETE, key, VALUE_T());
+  if (rc != ERROR_UNDERFLOW_BLOCK)
+  {
+    return scope.Commit(rc);
+  }
+  scope.Escalate();
+
+  return scope.Commit(DeleteRecursion(superblock.info.rootnode, KEY_T(), KEY_T(), key));
+}
+
+// Removes key from the subtree at start_ptr, which lies between the
+// separators lo and hi.  Returns ERROR_UNDERFLOW_BLOCK if that leaves
+// the node at start_ptr holding less than its minimum bytes, for the
+// parent to fix.
+ERROR_T BTreeIndex::DeleteRecursion(const SIZE_T &start_ptr, const KEY_T &lo, const KEY_T &hi, const KEY_T &key)
+{
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T offset;
+  bool found;
+  SIZE_T ptr;
+  KEY_T childlo;
+  KEY_T childhi;
+
+  rc = ReadNode(start_ptr, b);
+  if (rc != ERROR_NOERROR)
+  {
+    return rc;
+  }
+
+  switch (b.info.nodetype)
+  {
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    offset = b.SearchKey(key, found);
+    rc = b.GetPtr(offset, ptr);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    if (ptr == 0)
+    {
+      // Only the root of an empty tree points nowhere
+      return ERROR_NONEXISTENT;
+    }
+    ChildFences(b, offset, lo, hi, childlo, childhi);
+    rc = DeleteRecursion(ptr, childlo, childhi, key);
+    if (rc != ERROR_UNDERFLOW_BLOCK)
+    {
+      return rc;
+    }
+    rc = RebalanceChild(b, start_ptr, offset, lo, hi);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    if (b.info.nodetype != BTREE_ROOT_NODE && b.GetUsedBytes() < b.info.GetMinBytes())
+    {
+      return ERROR_UNDERFLOW_BLOCK;
+    }
+    return ERROR_NOERROR;
+    break;
+  case BTREE_LEAF_NODE:
+    offset = b.SearchKey(key, found);
+    if (!found)
+    {
+      return ERROR_NONEXISTENT;
+    }
+    rc = b.RemoveSlot(offset);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    rc = WriteNode(start_ptr, b);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    if (Underfull(b, 0))
+    {
+      return ERROR_UNDERFLOW_BLOCK;
+    }
+    return ERROR_NOERROR;
+    break;
+  default:
+    return ERROR_INSANE;
+    break;
+  }
+
+  return ERROR_INSANE;
+}
+
+// Fixes the child at offset of b (at node), which a delete left
+// underfull.  It merges with a sibling where the two fit in one node,
+// keeping the right node and freeing the left one; failing that it
+// evens its keys out with a sibling, if the parent has room for the
+// new separator.  Failing both it is left as it is.  b is written
+// back.  The only leaf of the tree has no minimum and goes only when
+// empty, and a root left with a single interior child is replaced by
+// that child.  node is taken by value as it may be
+// superblock.info.rootnode, which that replacement changes.  lo and
+// hi are b's separators.
+ERROR_T BTreeIndex::RebalanceChild(BTreeNode &b, const SIZE_T node, const SIZE_T offset, const KEY_T &lo, const KEY_T &hi)
+{
+  ERROR_T rc;
+  BTreeNode child;
+  BTreeNode sibling;
+  SIZE_T childblock;
+  SIZE_T siblingblock;
+  KEY_T key;
+  bool leaf;
+
+  rc = b.GetPtr(offset, childblock);
+  if (rc != ERROR_NOERROR)
+  {
+    return rc;
+  }
+  rc = ReadNode(childblock, child);
+  if (rc != ERROR_NOERROR)
+  {
+    return rc;
+  }
+  leaf = (child.info.nodetype == BTREE_LEAF_NODE);
+
+  if (b.info.numkeys == 0)
+  {
+    if (child.info.numkeys > 0)
+    {
+      return ERROR_NOERROR;
+    }
+    rc = DeallocateNode(childblock);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    b.SetPtr(0, 0);
+    return WriteNode(node, b);
+  }
+
+  // Try the left sibling then the right, merging first and evening
+  // out after.  x and y are the pair in key order and sep the
+  // separator between them.
+  for (int pass = 0; pass < 2; pass++)
+  {
+    for (int side = 0; side < 2; side++)
+    {
+      if (side == 0 ? offset == 0 : offset >= b.info.numkeys)
+      {
+        continue;
+      }
+      SIZE_T sep = (side == 0) ? offset - 1 : offset;
+      rc = b.GetPtr(side == 0 ? sep : sep + 1, siblingblock);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+      rc = ReadNode(siblingblock, sibling);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+      BTreeNode &x = (side == 0) ? sibling : child;
+      BTreeNode &y = (side == 0) ? child : sibling;
+      SIZE_T xblock = (side == 0) ? siblingblock : childblock;
+      SIZE_T yblock = (side == 0) ? childblock : siblingblock;
+      KEY_T xlo;
+      KEY_T yhi;
+
+      ChildFences(b, sep, lo, hi, xlo, key);
+      ChildFences(b, sep + 1, lo, hi, key, yhi);
+
+      if (pass == 0)
+      {
+        // y takes in x's keys, and an interior pair the separator too
+        BTreeNode merged(y);
+        rc = MergeInto(x, merged, key, GetSharedPrefix(xlo, yhi));
+        if (rc == ERROR_NOSPACE)
+        {
+          continue;
+        }
+        if (rc != ERROR_NOERROR)
+        {
+          return rc;
+        }
+        CurrentOpStats().merges++;
+
+        y = merged;
+        if (leaf)
+        {
+          // x's previous leaf now comes right before y
+          y.info.freelist = x.info.freelist;
+          if (x.info.freelist != 0)
+          {
+            BTreeNode prev;
+            rc = ReadNode(x.info.freelist, prev);
+            if (rc != ERROR_NOERROR)
+            {
+              return rc;
+            }
+            prev.SetPtr(0, yblock);
+            rc = WriteNode(x.info.freelist, prev);
+            if (rc != ERROR_NOERROR)
+            {
+              return rc;
+            }
+          }
+        }
+        rc = DeallocateNode(xblock);
+        if (rc != ERROR_NOERROR)
+        {
+          return rc;
+        }
+        rc = b.RemoveSlot(sep);
+        if (rc != ERROR_NOERROR)
+        {
+          return rc;
+        }
+
+        if (b.info.nodetype == BTREE_ROOT_NODE && b.info.numkeys == 0 && !leaf)
+        {
+          // The root's last two children merged, so the tree gets one level shorter
+          y.info.nodetype = BTREE_ROOT_NODE;
+          rc = WriteNode(yblock, y);
+          if (rc != ERROR_NOERROR)
+          {
+            return rc;
+          }
+          superblock.info.rootnode = yblock;
+          return DeallocateNode(node);
+        }
+
+        rc = WriteNode(yblock, y);
+        if (rc != ERROR_NOERROR)
+        {
+          return rc;
+        }
+        return WriteNode(node, b);
+      }
+
+      // Even the pair out, if that moves anything and the parent can
+      // take the new separator.  Leaves in different forms aren't.
+      if (x.info.compressed != y.info.compressed)
+      {
+        continue;
+      }
+      BTreeNode evenx(x);
+      BTreeNode eveny(y);
+      KEY_T separator;
+      rc = EvenOut(evenx, eveny, key, xlo, yhi, separator);
+      if (rc == ERROR_NOSPACE || (rc == ERROR_NOERROR && evenx.info.numkeys == x.info.numkeys))
+      {
+        continue;
+      }
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+      BTreeNode parent(b);
+      if (parent.SetKey(sep, separator) != ERROR_NOERROR)
+      {
+        continue;
+      }
+      CurrentOpStats().borrows++;
+
+      x = evenx;
+      y = eveny;
+      b = parent;
+
+      rc = WriteNode(xblock, x);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+      rc = WriteNode(yblock, y);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+      return WriteNode(node, b);
+    }
+  }
+
+  return ERROR_NOERROR;
+}
+
+//
+// Batches
+//
+// A batch holds one operation's requests sorted by key.  The walk
+// hands each child the run of keys that falls under it, so every node
+// is read at most once, and changes a leaf can absorb without
+// splitting or going underfull are applied together and written
+// once.  The rest are left in deferred, in key order, for the
+// single-key path.
+//
+struct BTreeBatch
+{
+  BTreeOp op;
+  vector<const KEY_T *> keys;      // by request
+  vector<const VALUE_T *> values;  // by request, for inserts
+  vector<VALUE_T> *found;          // by request, for lookups
+  vector<ERROR_T> *results;        // by request
+  vector<SIZE_T> order;            // requests sorted by key
+  vector<SIZE_T> deferred;         // requests left for the single-key path
+  vector<SIZE_T> splits;           // for inserts, deferred requests to go in singly
+};
+
+struct BTreeBatchOrder
+{
+  const BTreeBatch *batch;
+
+  bool operator()(const SIZE_T a, const SIZE_T b) const
+  {
+    return *batch->keys[a] < *batch->keys[b];
+  }
+};
+
+ERROR_T BTreeIndex::BatchInternal(const SIZE_T &node, BTreeBatch &batch, const SIZE_T first, const SIZE_T last)
+{
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T offset;
+  SIZE_T next;
+  SIZE_T ptr;
+  bool found;
+  vector<SIZE_T> children;
+  vector<SIZE_T> ends;
+
+  rc = ReadNode(node, b);
+  if (rc != ERROR_NOERROR)
+  {
+    return rc;
+  }
+
+  switch (b.info.nodetype)
+  {
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    rc = b.GetPtr(0, ptr);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    if (ptr == 0)
+    {
+      // Empty tree, which the first insert, going in singly, gives a leaf
+      if (batch.op == BTREE_OP_INSERT && first < last)
+      {
+        batch.splits.push_back(batch.order[first]);
+      }
+      for (SIZE_T i = first; i < last; i++)
+      {
+        if (batch.op == BTREE_OP_INSERT)
+        {
+          batch.deferred.push_back(batch.order[i]);
+        }
+        else
+        {
+          (*batch.results)[batch.order[i]] = ERROR_NONEXISTENT;
+        }
+      }
+      return ERROR_NOERROR;
+    }
+    // Keys up to and including the key at offset go to the pointer
+    // at offset, the rest to the last pointer
+    for (SIZE_T i = first; i < last; i = next)
+    {
+      offset = b.SearchKey(*batch.keys[batch.order[i]], found);
+      for (next = i + 1; next < last; next++)
+      {
+        if (offset < b.info.numkeys && b.CompareKey(offset, *batch.keys[batch.order[next]]) < 0)
+        {
+          break;
+        }
+      }
+      rc = b.GetPtr(offset, ptr);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+      children.push_back(ptr);
+      ends.push_back(next);
+    }
+    // A lookup reads the children after the first while it works on
+    // that one; a batch that writes has the index to itself, so the
+    // prefetch thread couldn't read them until it was done
+    if (batch.op == BTREE_OP_LOOKUP && children.size() > 1)
+    {
+      Prefetch(vector<SIZE_T>(children.begin() + 1, children.end()));
+    }
+    for (SIZE_T j = 0, i = first; j < children.size(); i = ends[j], j++)
+    {
+      rc = BatchInternal(children[j], batch, i, ends[j]);
+      if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+    }
+    return ERROR_NOERROR;
+    break;
+  case BTREE_LEAF_NODE:
+    return BatchLeaf(b, node, batch, first, last);
+    break;
+  default:
+    return ERROR_INSANE;
+    break;
+  }
+  return ERROR_INSANE;
+}
+
+ERROR_T BTreeIndex::BatchLeaf(BTreeNode &b, const SIZE_T &node, BTreeBatch &batch, const SIZE_T first, const SIZE_T last)
+{
+  ERROR_T rc;
+  SIZE_T offset;
+  bool found;
+  bool dirty = false;
+  SIZE_T room = 0;     // keys the leaf held when it filled
+  SIZE_T waiting = 0;  // inserts deferred since
+
+  for (SIZE_T i = first; i < last; i++)
+  {
+    SIZE_T request = batch.order[i];
+    ERROR_T &result = (*batch.results)[request];
+
+    offset = b.SearchKey(*batch.keys[request], found);
+
+    if (batch.op != BTREE_OP_LOOKUP && !batch.deferred.empty() &&
+        *batch.keys[batch.deferred.back()] == *batch.keys[request])
+    {
+      // Requests for one key keep their order, which a shorter value
+      // fitting where a longer one didn't would upset
+      batch.deferred.push_back(request);
+      continue;
+    }
+
+    switch (batch.op)
+    {
+    case BTREE_OP_LOOKUP:
+      result = found ? b.GetVal(offset, (*batch.found)[request]) : ERROR_NONEXISTENT;
+      break;
+    case BTREE_OP_INSERT:
+      if (found)
+      {
+        result = ERROR_CONFLICT;
+      }
+      else if ((rc = b.InsertKeyVal(offset, *batch.keys[request], *batch.values[request])) == ERROR_NOSPACE)
+      {
+        // The first goes in singly, splitting the leaf, as does every
+        // leaf's worth after it, so a leaf given many more keys than it
+        // holds splits across all of them rather than at its top
+        if (room == 0)
+        {
+          room = max((SIZE_T)1, b.info.numkeys);
+        }
+        if (waiting++ % room == 0)
+        {
+          batch.splits.push_back(request);
+        }
+        batch.deferred.push_back(request);
+      }
+      else if (rc != ERROR_NOERROR)
+      {
+        return rc;
+      }
+      else
+      {
+        result = ERROR_NOERROR;
+        dirty = true;
+      }
+      break;
+    case BTREE_OP_DELETE:
+      if (!found)
+      {
+        result = ERROR_NONEXISTENT;
+      }
+      else if (Underfull(b, b.GetSlotBytes(offset)))
+      {
+        // Would underflow, which takes a rebalance
+        batch.deferred.push_back(request);
+      }
+      else
+      {
+        rc = b.RemoveSlot(offset);
+        if (rc != ERROR_NOERROR)
+        {
+          return rc;
+        }
+        result = ERROR_NOERROR;
+        dirty = true;
+      }
+      break;
+    default:
+      return ERROR_IMPLBUG;
+      break;
+    }
+  }
+
+  if (dirty)
+  {
+    return WriteNode(node, b);
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::InsertBatch(const vector<KeyValuePair> &pairs, vector<ERROR_T> &results)
+{
+  BTreeBatch batch;
+  ERROR_T rc;
+  BTreeOpScope scope(this, BTREE_OP_INSERT, BTREE_OP_WRITES);
+
+  batch.op = BTREE_OP_INSERT;
+  batch.found = 0;
+  batch.results = &results;
+  results.assign(pairs.size(), ERROR_NOERROR);
+  for (SIZE_T i = 0; i < pairs.size(); i++)
+  {
+    batch.keys.push_back(&pairs[i].key);
+    batch.values.push_back(&pairs[i].value);
+    if (!PairFits(superblock.info, pairs[i].key, pairs[i].value))
+    {
+      results[i] = ERROR_SIZE;
+      continue;
+    }
+    batch.order.push_back(i);
+  }
+  BTreeBatchOrder byKey = { &batch };
+  stable_sort(batch.order.begin(), batch.order.end(), byKey);
+
+  // A pass puts into each leaf what fits and defers the rest.  Of the
+  // inserts each full leaf deferred, the first and every leaf's worth
+  // after it go in singly, which splits it, and the next pass takes the
+  // others.
+  while (!batch.order.empty())
+  {
+    rc = BatchInternal(superblock.info.rootnode, batch, 0, batch.order.size());
+    if (rc != ERROR_NOERROR)
+    {
+      return scope.Commit(rc);
+    }
+    if (batch.deferred.empty())
+    {
+      break;
+    }
+    for (SIZE_T i = 0; i < batch.splits.size(); i++)
+    {
+      SIZE_T request = batch.splits[i];
+      results[request] = Insert(pairs[request].key, pairs[request].value);
+    }
+    // splits is in the order of deferred, which it is drawn from
+    batch.order.clear();
+    for (SIZE_T i = 0, j = 0; i < batch.deferred.size(); i++)
+    {
+      if (j < batch.splits.size() && batch.deferred[i] == batch.splits[j])
+      {
+        j++;
+      }
+      else
+      {
+        batch.order.push_back(batch.deferred[i]);
+      }
+    }
+    batch.deferred.clear();
+    batch.splits.clear();
+  }
+  return scope.Commit(ERROR_NOERROR);
+}
+
+ERROR_T BTreeIndex::LookupBatch(const vector<KEY_T> &keys, vector<VALUE_T> &values, vector<ERROR_T> &results)
+{
+  BTreeBatch batch;
+  BTreeOpScope scope(this, BTREE_OP_LOOKUP, BTREE_OP_READS);
+
+  batch.op = BTREE_OP_LOOKUP;
+  batch.found = &values;
+  batch.results = &results;
+  values.resize(keys.size());
+  results.assign(keys.size(), ERROR_NOERROR);
+  for (SIZE_T i = 0; i < keys.size(); i++)
+  {
+    batch.keys.push_back(&keys[i]);
+    batch.order.push_back(i);
+  }
+  BTreeBatchOrder byKey = { &batch };
+  stable_sort(batch.order.begin(), batch.order.end(), byKey);
+
+  return BatchInternal(superblock.info.rootnode, batch, 0, batch.order.size());
+}
+
+ERROR_T BTreeIndex::DeleteBatch(const vector<KEY_T> &keys, vector<ERROR_T> &results)
+{
+  BTreeBatch batch;
+  ERROR_T rc;
+  BTreeOpScope scope(this, BTREE_OP_DELETE, BTREE_OP_WRITES);
+
+  batch.op = BTREE_OP_DELETE;
+  batch.found = 0;
+  batch.results = &results;
+  results.assign(keys.size(), ERROR_NOERROR);
+  for (SIZE_T i = 0; i < keys.size(); i++)
+  {
+    batch.keys.push_back(&keys[i]);
+    if (keys[i].length == 0 || keys[i].length > superblock.info.keysize)
+    {
+      results[i] = ERROR_SIZE;
+      continue;
+    }
+    batch.order.push_back(i);
+  }
+  BTreeBatchOrder byKey = { &batch };
+  stable_sort(batch.order.begin(), batch.order.end(), byKey);
+
+  rc = BatchInternal(superblock.info.rootnode, batch, 0, batch.order.size());
+  if (rc != ERROR_NOERROR)
+  {
+    return scope.Commit(rc);
+  }
+  for (SIZE_T i = 0; i < batch.deferred.size(); i++)
+  {
+    results[batch.deferred[i]] = Delete(keys[batch.deferred[i]]);
+  }
+  return scope.Commit(ERROR_NOERROR);
+}
+
+ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
+                                    ostream &o,
+                                    BTreeDisplayType display_type) const
+{
+  KEY_T testkey;
+  SIZE_T ptr;
+  BTreeNode b;
+  ERROR_T rc;
+  SIZE_T offset;
+
+  rc = ReadNode(node, b);
+
+  if (rc != ERROR_NOERROR)
+  {
+    return rc;
+  }
+
+  rc = PrintNode(o, node, b, display_type);
+
+  if (rc)
+  {
+    return rc;
+  }
+
+  if (display_type == BTREE_DEPTH_DOT)
+  {
+    o << ";";
+  }
+
+  if (display_type != BTREE_SORTED_KEYVAL)
+  {
+    o << endl;
+  }
+
+  switch (b.info.nodetype)
+  {
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    Prefetch(b, 0);
+    for (offset = 0; offset <= b.info.numkeys; offset++)
+    {
+      rc = b.GetPtr(offset, ptr);
+      if (rc)
+      {
+        return rc;
+      }
+      if (ptr == 0)
+      {
+        // Empty tree
+        break;
+      }
+      if (display_type == BTREE_DEPTH_DOT)
+      {
+        o << node << " -> " << ptr << ";\n";
+      }
+      rc = DisplayInternal(ptr, o, display_type);
+      if (rc)
+      {
+        return rc;
+      }
+    }
+    return ERROR_NOERROR;
+    break;
+  case BTREE_LEAF_NODE:
+    return ERROR_NOERROR;
+    break;
+  default:
+    if (display_type == BTREE_DEPTH_DOT)
+    {
+    }
+    else
+    {
+      o << "Unsupported Node Type " << b.info.nodetype;
+    }
+    return ERROR_INSANE;
+  }
+
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
+{
+  ERROR_T rc;
+  BTreeOpScope scope(this, BTREE_OP_OTHER, BTREE_OP_READS);
+
+  if (display_type == BTREE_DEPTH_DOT)
+  {
+    o << "digraph tree { \n";
+  }
+  rc = DisplayInternal(RootNode(), o, display_type);
+  if (display_type == BTREE_DEPTH_DOT)
+  {
+    o << "}\n";
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::Scan(const KEY_T &lo, const KEY_T &hi, BTreeScanCallback callback, void *state) const
+{
+  BTreeCursor cursor(this);
+  KEY_T key;
+  VALUE_T value;
+  ERROR_T rc;
+  BTreeOpScope scope(this, BTREE_OP_SCAN, BTREE_OP_READS);
+
+  for (rc = cursor.Seek(lo); rc == ERROR_NOERROR; rc = cursor.Next())
+  {
+    if (cursor.CompareKey(hi) > 0)
+    {
+      break;
+    }
+    rc = cursor.GetKey(key);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    rc = cursor.GetVal(value);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    if (!callback(key, value, state))
+    {
+      break;
+    }
+  }
+
+  return (rc == ERROR_NONEXISTENT) ? ERROR_NOERROR : rc;
+}
+
+BTreeSnapshot::BTreeSnapshot(BTreeIndex *i) : index(i)
+{
+  // No split or merge is halfway written while the index is shared
+  shared_lock<shared_mutex> shared(index->latch);
+  lock_guard<mutex> guard(index->cachelock);
+
+  state = index->snapshots.insert(index->snapshots.end(), BTreeSnapshotState());
+  state->rootnode = index->superblock.info.rootnode;
+  state->highwater = index->superblock.ResolveSuperblock()->highwater;
+}
+
+BTreeSnapshot::~BTreeSnapshot()
+{
+  lock_guard<mutex> guard(index->cachelock);
+
+  index->snapshots.erase(state);
+}
+
+ERROR_T BTreeSnapshot::Lookup(const KEY_T &key, VALUE_T &value) const
+{
+  BTreeOpScope scope(index, BTREE_OP_LOOKUP, BTREE_OP_SNAPSHOT_READS, &*state);
+
+  return index->LookupOrUpdateInternal(state->rootnode, BTREE_OP_LOOKUP, key, value);
+}
+
+ERROR_T BTreeSnapshot::Scan(const KEY_T &lo, const KEY_T &hi, BTreeScanCallback callback, void *st) const
+{
+  BTreeOpScope scope(index, BTREE_OP_SCAN, BTREE_OP_SNAPSHOT_READS, &*state);
+
+  return index->Scan(lo, hi, callback, st);
+}
+
+ERROR_T BTreeSnapshot::Display(ostream &o, BTreeDisplayType display_type) const
+{
+  BTreeOpScope scope(index, BTREE_OP_OTHER, BTREE_OP_SNAPSHOT_READS, &*state);
+
+  return index->Display(o, display_type);
+}
+
+BTreeCursor::BTreeCursor(const BTreeIndex *i) : index(i), leafblock(0), offset(0), ahead(0)
+{
+}
+
+// Counts off the leaves queued for prefetch so far; past them, descends
+// again to queue the ones beyond this leaf
+void BTreeCursor::PrefetchAhead(const bool backward)
+{
+  KEY_T key;
+  SIZE_T block;
+  BTreeNode found;
+
+  if (ahead > 0)
+  {
+    ahead--;
+    return;
+  }
+  if (index->nodecache.GetCapacity() == 0 || leaf.info.numkeys == 0)
+  {
+    return;
+  }
+  leaf.GetKey(0, key);
+  index->FindLeaf(BTreeIndex::LEAF_FOR_KEY, &key, block, found, &ahead, backward);
+}
+
+// Moves forward from offset to the next key, crossing to later leaves
+// (past any empty ones) if this leaf has run out
+ERROR_T BTreeCursor::SkipForward()
+{
+  SIZE_T next;
+  ERROR_T rc;
+
+  while (offset >= leaf.info.numkeys)
+  {
+    rc = leaf.GetPtr(0, next);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    if (next == 0)
+    {
+      offset = leaf.info.numkeys;
+      return ERROR_NONEXISTENT;
+    }
+    rc = index->ReadNode(next, leaf);
+    if (rc != ERROR_NOERROR)
+    {
+      leafblock = 0;
+      return rc;
+    }
+    leafblock = next;
+    offset = 0;
+    PrefetchAhead(false);
+  }
+  return ERROR_NOERROR;
+}
+
+// Moves back to the key before offset, crossing to earlier leaves
+// (past any empty ones) if this is the first key in the leaf
+ERROR_T BTreeCursor::SkipBackward()
+{
+  SIZE_T prev;
+  ERROR_T rc;
+
+  while (offset == 0)
+  {
+    prev = leaf.info.freelist;
+    if (prev == 0)
+    {
+      leafblock = 0;
+      return ERROR_NONEXISTENT;
+    }
+    rc = index->ReadNode(prev, leaf);
+    if (rc != ERROR_NOERROR)
+    {
+      leafblock = 0;
+      return rc;
+    }
+    leafblock = prev;
+    offset = leaf.info.numkeys;
+    PrefetchAhead(true);
+  }
+  offset--;
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeCursor::Seek(const KEY_T &key)
+{
+  bool found;
+  ERROR_T rc;
+  BTreeOpScope scope(index, BTREE_OP_SCAN, BTREE_OP_READS);
+
+  rc = index->FindLeaf(BTreeIndex::LEAF_FOR_KEY, &key, leafblock, leaf, &ahead);
+  if (rc != ERROR_NOERROR)
+  {
+    leafblock = 0;
+    return rc;
+  }
+  offset = leaf.SearchKey(key, found);
+  return SkipForward();
+}
+
+ERROR_T BTreeCursor::SeekFirst()
+{
+  ERROR_T rc;
+  BTreeOpScope scope(index, BTREE_OP_SCAN, BTREE_OP_READS);
+
+  rc = index->FindLeaf(BTreeIndex::LEAF_FIRST, 0, leafblock, leaf, &ahead);
+  if (rc != ERROR_NOERROR)
+  {
+    leafblock = 0;
+    return rc;
+  }
+  offset = 0;
+  return SkipForward();
+}
+
+ERROR_T BTreeCursor::SeekLast()
+{
+  ERROR_T rc;
+  BTreeOpScope scope(index, BTREE_OP_SCAN, BTREE_OP_READS);
+
+  rc = index->FindLeaf(BTreeIndex::LEAF_LAST, 0, leafblock, leaf, &ahead, true);
+  if (rc != ERROR_NOERROR)
+  {
+    leafblock = 0;
+    return rc;
+  }
+  offset = leaf.info.numkeys;
+  return SkipBackward();
+}
+
+ERROR_T BTreeCursor::Next()
+{
+  BTreeOpScope scope(index, BTREE_OP_SCAN, BTREE_OP_READS);
+
+  if (!IsValid())
+  {
+    return ERROR_NONEXISTENT;
+  }
+  offset++;
+  return SkipForward();
+}
+
+ERROR_T BTreeCursor::Prev()
+{
+  BTreeOpScope scope(index, BTREE_OP_SCAN, BTREE_OP_READS);
+
+  if (leafblock == 0)
+  {
+    return ERROR_NONEXISTENT;
+  }
+  return SkipBackward();
+}
+
+bool BTreeCursor::IsValid() const
+{
+  return leafblock != 0 && offset < leaf.info.numkeys;
+}
+
+ERROR_T BTreeCursor::GetKey(KEY_T &key) const
+{
+  if (!IsValid())
+  {
+    return ERROR_NONEXISTENT;
+  }
+  return leaf.GetKey(offset, key);
+}
+
+ERROR_T BTreeCursor::GetVal(VALUE_T &value) const
+{
+  if (!IsValid())
+  {
+    return ERROR_NONEXISTENT;
+  }
+  return leaf.GetVal(offset, value);
+}
+
+int BTreeCursor::CompareKey(const KEY_T &key) const
+{
+  return leaf.CompareKey(offset, key);
+}
+
+//
+// Sanity check
+//
+// The free list is walked first.  Then the root's children are dealt
+// out in runs to worker threads, and each worker goes through its
+// subtrees a level at a time, in key order.  A level is taken a chunk
+// at a time and each chunk is read in block order, so the reads sweep
+// the disk instead of seeking back and forth.  The buffer cache is not
+// thread safe, so reads, and the map of blocks seen, are under one
+// lock; the checking itself runs in parallel.
+//
+
+#define SANITY_CHUNK 256
+
+struct BTreeSanityItem
+{
+  SIZE_T block;
+  KEY_T lo;  // keys must be > lo, if it is not empty
+  KEY_T hi;  // keys must be <= hi, if it is not empty
+};
+
+struct BTreeSanityState
+{
+  mutex lock;
+  vector<char> seen;
+  bool onlyleaf;  // the root has no keys, just the one leaf
+};
+
+struct BTreeSanityWorker
+{
+  vector<BTreeSanityItem> level;
+  string problem;
+  SIZE_T firstleaf, firstprev;
+  SIZE_T lastleaf, lastnext;
+  BTreeStats stats;  // levels from 1
+};
+
+BTreeStats::BTreeStats() : depth(0), numinterior(0), numleaves(0), numcompressed(0), numkeys(0), numfree(0),
+    numblocks(0)
+{
+  memset(interiorfill, 0, sizeof(interiorfill));
+  memset(leaffill, 0, sizeof(leaffill));
+}
+
+ostream &BTreeStats::Print(ostream &os) const
+{
+  os << "depth           = " << depth << endl;
+  os << "nodes per level =";
+  for (SIZE_T i = 0; i < levels.size(); i++)
+  {
+    os << " " << levels[i];
+  }
+  os << endl;
+  os << "interior nodes  = " << numinterior << endl;
+  os << "leaves          = " << numleaves << endl;
+  os << "compressed      = " << numcompressed << endl;
+  os << "keys            = " << numkeys << endl;
+  os << "free blocks     = " << numfree << endl;
+  os << "blocks          = " << numblocks << endl;
+  os << "interior fill   =";
+  for (SIZE_T i = 0; i < BTREE_FILL_BUCKETS; i++)
+  {
+    os << " " << interiorfill[i];
+  }
+  os << endl;
+  os << "leaf fill       =";
+  for (SIZE_T i = 0; i < BTREE_FILL_BUCKETS; i++)
+  {
+    os << " " << leaffill[i];
+  }
+  os << endl;
+  if (!problem.empty())
+  {
+    os << "problem         = " << problem << endl;
+  }
+  return os;
+}
+
+static SIZE_T FillBucket(const SIZE_T used, const SIZE_T capacity)
+{
+  SIZE_T bucket = capacity ? used * BTREE_FILL_BUCKETS / capacity : 0;
+  return bucket < BTREE_FILL_BUCKETS ? bucket : BTREE_FILL_BUCKETS - 1;
+}
+
+static ERROR_T Insane(string &problem, const SIZE_T block, const char *what)
+{
+  ostringstream os;
+  os << "block " << block << ": " << what;
+  problem = os.str();
+  return ERROR_INSANE;
+}
+
+// Keys of node must be strictly increasing and within (lo, hi], and
+// its key prefix shared by lo and hi
+static ERROR_T SanityCheckKeys(const BTreeNode &node, const SIZE_T block, const KEY_T &lo, const KEY_T &hi, string &problem)
+{
+  KEY_T key;
+
+  if (node.info.keyprefix > GetSharedPrefix(lo, hi) ||
+      (node.info.keyprefix > 0 && !node.SharesKeyPrefix(lo)))
+  {
+    return Insane(problem, block, "key prefix not shared by the parent's separators");
+  }
+  if (node.info.numkeys == 0)
+  {
+    return ERROR_NOERROR;
+  }
+  if (lo.length > 0 && node.CompareKey(0, lo) <= 0)
+  {
+    return Insane(problem, block, "key not above the parent's separator");
+  }
+  if (hi.length > 0 && node.CompareKey(node.info.numkeys - 1, hi) > 0)
+  {
+    return Insane(problem, block, "key above the parent's separator");
+  }
+  for (SIZE_T i = 1; i < node.info.numkeys; i++)
+  {
+    node.GetKey(i - 1, key);
+    if (node.CompareKey(i, key) <= 0)
+    {
+      return Insane(problem, block, "keys out of order");
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::SanityCheckFreeList(BTreeSanityState &state, BTreeStats &stats) const
+{
+  BTreeNode node;
+  ERROR_T rc;
+  SIZE_T highwater = superblock.ResolveSuperblock()->highwater;
+
+  // Blocks past the high-water mark are free without being listed
+  if (highwater > state.seen.size())
+  {
+    return Insane(stats.problem, highwater, "high-water mark off the disk");
+  }
+  for (SIZE_T block = highwater == 0 ? state.seen.size() : highwater; block < state.seen.size(); block++)
+  {
+    state.seen[block] = 1;
+    stats.numfree++;
+  }
+
+  for (SIZE_T block = superblock.info.freelist; block != 0; block = node.info.freelist)
+  {
+    if (highwater != 0 && block >= highwater)
+    {
+      return Insane(stats.problem, block, "free list past the high-water mark");
+    }
+    if (block >= state.seen.size())
+    {
+      return Insane(stats.problem, block, "free list runs off the disk");
     }
-    else
+    if (state.seen[block])
     {
-      return ERROR_NONEXISTENT;
+      return Insane(stats.problem, block, "free list loops");
     }
-    break;
+    state.seen[block] = 1;
+    rc = ReadNode(block, node);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    if (node.info.nodetype != BTREE_UNALLOCATED_BLOCK)
+    {
+      return Insane(stats.problem, block, "in use but on the free list");
+    }
+    stats.numfree++;
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BTreeIndex::SanityCheckSubtrees(BTreeSanityState &state, BTreeSanityWorker &w) const
+{
+  ERROR_T rc;
+  vector<BTreeSanityItem> next;
+  vector<SIZE_T> order;
+  vector<SIZE_T> ahead;
+  vector<BTreeNode> nodes(SANITY_CHUNK);
+
+  w.firstleaf = w.firstprev = w.lastleaf = w.lastnext = 0;
+
+  for (SIZE_T depth = 1; !w.level.empty(); depth++)
+  {
+    vector<BTreeSanityItem> &level = w.level;
+    int kind = BTREE_UNALLOCATED_BLOCK;
 
-      case BTREE_LEAF_NODE:
+    w.stats.levels.push_back(level.size());
 
-    if (b.info.numkeys == 0)
+    for (SIZE_T start = 0; start < level.size(); start += SANITY_CHUNK)
     {
-      b.info.numkeys++;
-      rc = b.SetKey(0, key);
-      if (rc != ERROR_NOERROR)
+      SIZE_T end = min((SIZE_T)level.size(), start + SANITY_CHUNK);
+
+      order.clear();
+      for (SIZE_T i = start; i < end; i++)
       {
-        return rc;
+        order.push_back(i);
       }
-      rc = b.SetVal(0, value);
-      if (rc != ERROR_NOERROR)
+      sort(order.begin(), order.end(),
+           [&level](const SIZE_T a, const SIZE_T b) { return level[a].block < level[b].block; });
+      // The next chunk comes in while this one is checked
+      ahead.clear();
+      for (SIZE_T i = end; i < min((SIZE_T)level.size(), end + SANITY_CHUNK); i++)
       {
-        return rc;
+        ahead.push_back(level[i].block);
       }
-      return b.Serialize(buffercache, start_ptr);
-    }
-
-    b.GetKey((b.info.numkeys - 1), last_leaf_key);
-
-    if (!(last_leaf_key < key))
-    {
-      for (offset = 0; offset < b.info.numkeys; offset++)
+      Prefetch(ahead);
       {
-        rc = b.GetKey(offset, test_key);
-        if (rc)
-        {
-          return rc;
-        }
-        if (key < test_key || key == test_key)
+        lock_guard<mutex> guard(state.lock);
+        for (SIZE_T i = 0; i < order.size(); i++)
         {
-          if (key == test_key)
+          SIZE_T block = level[order[i]].block;
+          if (block == 0 || block >= state.seen.size())
           {
-            return ERROR_UNIQUE_KEY;
+            return Insane(w.problem, block, "pointer off the disk");
           }
-
-          SIZE_T old_num_keys = b.info.numkeys;
-          b.info.numkeys++;
-
-          for (SIZE_T i = old_num_keys - 1; i >= offset; i--)
+          if (state.seen[block])
           {
-            KeyValuePair kvp;
-            rc = b.GetKeyVal(i, kvp);
-            if (rc != ERROR_NOERROR)
-            {
-              return rc;
-            }
-            rc = b.SetKeyVal(i + 1, kvp);
-            if (rc != ERROR_NOERROR)
-            {
-              return rc;
-            }
-            if (i == 0)
-            {
-              break;
-            }
+            return Insane(w.problem, block, "reachable twice");
           }
-
-          rc = b.SetKeyVal(offset, KeyValuePair(key, value));
+          state.seen[block] = 1;
+          rc = ReadNode(block, nodes[order[i] - start]);
           if (rc != ERROR_NOERROR)
           {
             return rc;
           }
-
-          break;
         }
       }
-    }
-    else
-    {
-      b.info.numkeys++;
-      rc = b.SetKey(b.info.numkeys - 1, key);
-      if (rc != ERROR_NOERROR)
-      {
-        return rc;
-      }
-      rc = b.SetVal(b.info.numkeys - 1, value);
-      if (rc != ERROR_NOERROR)
-      {
-        return rc;
-      }
-    }
-
-    if ((b.info.numkeys - b.info.GetNumSlotsAsLeaf()) > 1)
-    {
-      return b.Serialize(buffercache, start_ptr);
-    }
-    else
-    {
-      BTreeNode newNode(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
 
-      rc = AllocateNode(adjusted_block);
-      if (rc != ERROR_NOERROR)
+      for (SIZE_T i = start; i < end; i++)
       {
-        return rc;
-      }
-
-      KeyValuePair kvp;
-      SIZE_T j = 0;
+        BTreeSanityItem &item = level[i];
+        BTreeNode &node = nodes[i - start];
+        SIZE_T ptr;
 
-      SIZE_T old_num_keys2 = b.info.numkeys;
-      for (SIZE_T i = b.info.numkeys / 2; i < old_num_keys2; i++)
-      {
-        rc = b.GetKeyVal(i, kvp);
-        if (rc != ERROR_NOERROR)
+        if (node.info.nodetype != BTREE_INTERIOR_NODE && node.info.nodetype != BTREE_LEAF_NODE)
         {
-          return rc;
+          return Insane(w.problem, item.block, "not a tree node");
         }
-        newNode.info.numkeys++;
-        rc = newNode.SetKeyVal(j, kvp);
-        if (rc != ERROR_NOERROR)
+        if (kind == BTREE_UNALLOCATED_BLOCK)
         {
-          return rc;
+          kind = node.info.nodetype;
         }
-        j++;
-      }
-      b.info.numkeys -= j;
-
-      rc = b.GetKey(b.info.numkeys - 1, adjusted_key);
-      if (rc != ERROR_NOERROR)
-      {
-        return rc;
-      }
-
-      rc = newNode.Serialize(buffercache, start_ptr);
-      if (rc != ERROR_NOERROR)
-      {
-        return rc;
-      }
-      rc = b.Serialize(buffercache, adjusted_block);
-      if (rc != ERROR_NOERROR)
-      {
-        return rc;
-      }
-
-      return ERROR_SPLIT_BLOCK;
-    }
-
-    break;
-
-  default:
-    return ERROR_INSANE;
-    break;
-  }
-  return ERROR_INSANE;
-}
-
-
-
-
-ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
-{
-  VALUE_T update_value = value;
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, update_value);
-}
-
-ERROR_T BTreeIndex::Delete(const KEY_T &key)
-{
-  return DeleteRecursion(superblock.info.rootnode, key);
-}
-
-ERROR_T BTreeIndex::DeleteRecursion(const SIZE_T &start_ptr, const KEY_T &key)    
-{    
-    BTreeNode b;
-    ERROR_T rc;
-    SIZE_T offset;
-    KEY_T test_key;
-    SIZE_T ptr;
-
-    rc= b.Unserialize(buffercache,start_ptr);
-
-    if (rc!=ERROR_NOERROR)
-    { 
-      return rc;
-    }
-
-  switch (b.info.nodetype)
-  { 
-    case BTREE_ROOT_NODE:
-        break;
-
-    case BTREE_INTERIOR_NODE:
-        for (offset=0; offset<b.info.numkeys; offset++)
-        { 
-            rc=b.GetKey(offset, test_key);
-            if (rc) 
-            {
-              return rc;
-            }
-            if (key < test_key)
-            {
-            rc=b.GetPtr(offset, ptr);
-              if (rc)
-              {
-                return rc;
-              }
-            return DeleteRecursion(ptr, key);
-            }
+        if (node.info.nodetype != kind)
+        {
+          return Insane(w.problem, item.block, "leaves at different depths");
         }
-        return ERROR_NONEXISTENT;
-        break;
-    
-    case BTREE_LEAF_NODE:
-      for (offset = 0; offset < b.info.numkeys; offset++)
-      { 
-        rc=b.GetKey(offset, test_key);
-        if (rc)
+        if (node.info.keysize != superblock.info.keysize ||
+            node.info.valuesize != superblock.info.valuesize ||
+            node.info.blocksize != superblock.info.blocksize)
+        {
+          return Insane(w.problem, item.block, "sizes differ from the superblock");
+        }
+        if (!node.CheckSlots())
+        {
+          return Insane(w.problem, item.block, "slots out of bounds");
+        }
+        rc = SanityCheckKeys(node, item.block, item.lo, item.hi, w.problem);
+        if (rc != ERROR_NOERROR)
         {
           return rc;
         }
-        if (key == test_key)
-        { 
-          if(b.info.numkeys > 1)
+
+        if (node.info.nodetype == BTREE_LEAF_NODE)
+        {
+          // Occupancy is soft, so any leaf but the only one may be empty
+          if (state.onlyleaf && node.info.numkeys == 0)
           {
-            b.info.numkeys--;
-            if(offset == b.info.numkeys - 1)
-            {
-              superblock.info.freelist = start_ptr;
-            }
-            else
-            {
-              for(SIZE_T i = offset; i < (b.info.numkeys - 1); i++){
-                  KEY_T shift_key;
-                  b.GetKey(i, shift_key);
-                  b.SetKey(i + 1, shift_key);
-
-                  VALUE_T shift_value;
-                  b.GetVal(i, shift_value);
-                  b.SetVal(i + 1, shift_value);
-              }
-            }
-            return b.Serialize(buffercache, start_ptr);
+            return Insane(w.problem, item.block, "only leaf is empty");
+          }
+          node.GetPtr(0, ptr);
+          if (w.lastleaf == 0)
+          {
+            w.firstleaf = item.block;
+            w.firstprev = node.info.freelist;
+          }
+          else if (w.lastnext != item.block || node.info.freelist != w.lastleaf)
+          {
+            return Insane(w.problem, item.block, "leaf links broken");
+          }
+          w.lastleaf = item.block;
+          w.lastnext = ptr;
+          w.stats.numleaves++;
+          w.stats.numkeys += node.info.numkeys;
+          if (node.info.compressed)
+          {
+            w.stats.numcompressed++;
+            w.stats.leaffill[FillBucket(node.info.packed, node.info.blocksize)]++;
           }
           else
           {
-            rc = DeallocateNode(start_ptr);
-            if (rc)
-            {
-              return rc;
-            } 
-            else
-            {
-              return b.Serialize(buffercache, start_ptr);   
-            }          
-          } 
+            w.stats.leaffill[FillBucket(node.GetUsedBytes(), node.info.GetCapacity())]++;
+          }
         }
-      } 
-      return ERROR_NONEXISTENT;
-      break;
+        else
+        {
+          if (state.onlyleaf)
+          {
+            return Insane(w.problem, item.block, "keyless root over an interior node");
+          }
+          for (SIZE_T j = 0; j <= node.info.numkeys; j++)
+          {
+            next.push_back(BTreeSanityItem());
+            BTreeSanityItem &child = next.back();
+            node.GetPtr(j, child.block);
+            ChildFences(node, j, item.lo, item.hi, child.lo, child.hi);
+          }
+          w.stats.numinterior++;
+          w.stats.interiorfill[FillBucket(node.GetUsedBytes(), node.info.GetCapacity())]++;
+        }
+      }
+    }
 
-    default:
-      return ERROR_INSANE;
+    w.stats.depth = depth;
+    level.swap(next);
+    next.clear();
   }
   return ERROR_NOERROR;
 }
 
-ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
-                                    ostream &o,
-                                    BTreeDisplayType display_type) const
+ERROR_T BTreeIndex::SanityCheck() const
+{
+  BTreeStats stats;
+  return SanityCheck(stats);
+}
+
+ERROR_T BTreeIndex::SanityCheck(BTreeStats &stats, const unsigned numthreads) const
 {
-  KEY_T testkey;
-  SIZE_T ptr;
-  BTreeNode b;
   ERROR_T rc;
-  SIZE_T offset;
+  BTreeSanityState state;
+  BTreeNode root;
+  SIZE_T rootblock = superblock.info.rootnode;
+  SIZE_T numchildren;
+  SIZE_T numworkers;
+  SIZE_T ptr;
+  BTreeOpScope scope(this, BTREE_OP_OTHER, BTREE_OP_READS);
 
-  rc = b.Unserialize(buffercache, node);
+  stats = BTreeStats();
+  stats.numblocks = buffercache->GetNumBlocks();
+  state.seen.assign(stats.numblocks, 0);
+  state.seen[superblock_index] = 1;
 
+  rc = SanityCheckFreeList(state, stats);
   if (rc != ERROR_NOERROR)
   {
     return rc;
   }
 
-  rc = PrintNode(o, node, b, display_type);
-
-  if (rc)
+  if (rootblock == 0 || rootblock >= stats.numblocks || state.seen[rootblock])
+  {
+    return Insane(stats.problem, rootblock, "bad root");
+  }
+  state.seen[rootblock] = 1;
+  rc = ReadNode(rootblock, root);
+  if (rc != ERROR_NOERROR)
   {
     return rc;
   }
-
-  if (display_type == BTREE_DEPTH_DOT)
+  if (root.info.nodetype != BTREE_ROOT_NODE)
   {
-    o << ";";
+    return Insane(stats.problem, rootblock, "root is not a root node");
   }
-
-  if (display_type != BTREE_SORTED_KEYVAL)
+  if (!root.CheckSlots())
   {
-    o << endl;
+    return Insane(stats.problem, rootblock, "slots out of bounds");
   }
-
-  switch (b.info.nodetype)
+  rc = SanityCheckKeys(root, rootblock, KEY_T(), KEY_T(), stats.problem);
+  if (rc != ERROR_NOERROR)
   {
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    if (b.info.numkeys > 0)
+    return rc;
+  }
+  stats.depth = 1;
+  stats.levels.push_back(1);
+  stats.numinterior = 1;
+  stats.interiorfill[FillBucket(root.GetUsedBytes(), root.info.GetCapacity())]++;
+
+  root.GetPtr(0, ptr);
+  state.onlyleaf = (root.info.numkeys == 0);
+  numchildren = (ptr == 0) ? 0 : root.info.numkeys + 1;
+  numworkers = min((SIZE_T)(numthreads > 0 ? numthreads : 1), numchildren);
+
+  // Hand each worker a run of the root's children
+  vector<BTreeSanityWorker> workers(numworkers);
+  vector<ERROR_T> results(numworkers, ERROR_NOERROR);
+  vector<thread> threads;
+  for (SIZE_T t = 0; t < numworkers; t++)
+  {
+    for (SIZE_T j = t * numchildren / numworkers; j < (t + 1) * numchildren / numworkers; j++)
     {
-      for (offset = 0; offset <= b.info.numkeys; offset++)
+      workers[t].level.push_back(BTreeSanityItem());
+      BTreeSanityItem &child = workers[t].level.back();
+      root.GetPtr(j, child.block);
+      if (j > 0)
       {
-        rc = b.GetPtr(offset, ptr);
-        if (rc)
-        {
-          return rc;
-        }
-        if (display_type == BTREE_DEPTH_DOT)
-        {
-          o << node << " -> " << ptr << ";\n";
-        }
-        rc = DisplayInternal(ptr, o, display_type);
-        if (rc)
-        {
-          return rc;
-        }
+        root.GetKey(j - 1, child.lo);
+      }
+      if (j < root.info.numkeys)
+      {
+        root.GetKey(j, child.hi);
       }
     }
-    return ERROR_NOERROR;
-    break;
-  case BTREE_LEAF_NODE:
-    return ERROR_NOERROR;
-    break;
-  default:
-    if (display_type == BTREE_DEPTH_DOT)
+  }
+  for (SIZE_T t = 1; t < numworkers; t++)
+  {
+    threads.push_back(thread([this, &state, &workers, &results, t, &scope]() { BTreeOpScope::Join(&scope); results[t] = SanityCheckSubtrees(state, workers[t]); }));
+  }
+  if (numworkers > 0)
+  {
+    results[0] = SanityCheckSubtrees(state, workers[0]);
+  }
+  for (SIZE_T t = 0; t < threads.size(); t++)
+  {
+    threads[t].join();
+  }
+
+  // Stitch the workers' results together, in key order
+  SIZE_T lastleaf = 0;
+  for (SIZE_T t = 0; t < numworkers; t++)
+  {
+    BTreeSanityWorker &w = workers[t];
+    if (results[t] != ERROR_NOERROR)
     {
+      stats.problem = w.problem;
+      return results[t];
     }
-    else
+    if (w.stats.depth != workers[0].stats.depth)
     {
-      o << "Unsupported Node Type " << b.info.nodetype;
+      return Insane(stats.problem, w.firstleaf, "leaves at different depths");
+    }
+    if (w.firstprev != lastleaf || (t > 0 && workers[t - 1].lastnext != w.firstleaf))
+    {
+      return Insane(stats.problem, w.firstleaf, "leaf links broken");
+    }
+    lastleaf = w.lastleaf;
+    for (SIZE_T i = 0; i < w.stats.levels.size(); i++)
+    {
+      if (stats.levels.size() <= i + 1)
+      {
+        stats.levels.push_back(0);
+      }
+      stats.levels[i + 1] += w.stats.levels[i];
+    }
+    stats.numinterior += w.stats.numinterior;
+    stats.numleaves += w.stats.numleaves;
+    stats.numcompressed += w.stats.numcompressed;
+    stats.numkeys += w.stats.numkeys;
+    for (SIZE_T i = 0; i < BTREE_FILL_BUCKETS; i++)
+    {
+      stats.interiorfill[i] += w.stats.interiorfill[i];
+      stats.leaffill[i] += w.stats.leaffill[i];
     }
-    return ERROR_INSANE;
   }
-
-  return ERROR_NOERROR;
-}
-
-ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
-{
-  ERROR_T rc;
-  if (display_type == BTREE_DEPTH_DOT)
+  stats.depth = stats.levels.size();
+  if (numworkers > 0 && workers[numworkers - 1].lastnext != 0)
   {
-    o << "digraph tree { \n";
+    return Insane(stats.problem, lastleaf, "leaf links broken");
   }
-  rc = DisplayInternal(superblock.info.rootnode, o, display_type);
-  if (display_type == BTREE_DEPTH_DOT)
+
+  for (SIZE_T i = 0; i < state.seen.size(); i++)
   {
-    o << "}\n";
+    if (!state.seen[i])
+    {
+      return Insane(stats.problem, i, "neither in the tree nor on the free list");
+    }
   }
   return ERROR_NOERROR;
 }
 
-ERROR_T BTreeIndex::SanityCheck() const
-{
-  return ERROR_UNIMPL;
-}
-
 ostream &BTreeIndex::Print(ostream &os) const
 {
   return os;
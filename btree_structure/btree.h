@@ -3,6 +3,15 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <memory>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <condition_variable>
 
 #include "global.h"
 #include "block.h"
@@ -33,8 +42,10 @@ struct KeyValuePair
   KeyValuePair();
   KeyValuePair(const KEY_T &key, const VALUE_T &value);
   KeyValuePair(const KeyValuePair &rhs);
+  KeyValuePair(KeyValuePair &&rhs);
   virtual ~KeyValuePair();
   KeyValuePair &operator=(const KeyValuePair &rhs);
+  KeyValuePair &operator=(KeyValuePair &&rhs);
 };
 
 enum BTreeOp
@@ -42,7 +53,11 @@ enum BTreeOp
   BTREE_OP_INSERT,
   BTREE_OP_DELETE,
   BTREE_OP_UPDATE,
-  BTREE_OP_LOOKUP
+  BTREE_OP_LOOKUP,
+  BTREE_OP_SCAN,      // Scan and cursor moves
+  BTREE_OP_BULKLOAD,
+  BTREE_OP_OTHER,     // Attach, Detach, SanityCheck, Display
+  BTREE_NUM_OPS
 };
 
 enum BTreeDisplayType
@@ -52,17 +67,282 @@ enum BTreeDisplayType
   BTREE_SORTED_KEYVAL
 };
 
+// How new nodes are placed on the disk
+//
+// BTREE_ALLOC_FIRST takes the head of the free list, or else the next
+// block past the high-water mark.
+// BTREE_ALLOC_NEAR takes the free block closest to a hint: the node a
+// new node splits from, or the leaf before it in key order.  A free
+// block on the hint's own track wins, then one on the nearest track.
+enum BTreeAllocPolicy
+{
+  BTREE_ALLOC_FIRST,
+  BTREE_ALLOC_NEAR
+};
+
+// Which leaves are stored compressed, decided by a leaf's first key as
+// it is bulk loaded or split off.  A compressed leaf packs several
+// blocks' worth of pairs into one, so cold ranges take fewer blocks,
+// but every change to it is checked against its packed size.
+//
+// BTREE_COMPRESS_NONE compresses none.
+// BTREE_COMPRESS_ALL compresses every leaf.
+// BTREE_COMPRESS_BELOW compresses leaves whose first key is at most a
+// given key, for trees whose low keys are cold.
+enum BTreeCompressPolicy
+{
+  BTREE_COMPRESS_NONE,
+  BTREE_COMPRESS_ALL,
+  BTREE_COMPRESS_BELOW
+};
+
+// Called by Scan for each pair in range; return false to stop early
+typedef bool (*BTreeScanCallback)(const KEY_T &key, const VALUE_T &value, void *state);
+
+// Called by BulkLoad for the next pair in key order
+// return ERROR_NONEXISTENT when there are no more pairs
+typedef ERROR_T (*BTreeBulkLoadSource)(KeyValuePair &pair, void *state);
+
+class BTreeIndex;
+class BTreeOpScope;
+struct BTreeBatch;
+struct BTreeSanityState;
+struct BTreeSanityWorker;
+
+// What a snapshot sees: its root, and the images of the blocks written
+// since it was taken, as they were then.  Snapshots taken between the
+// same two writes of a block share its image.
+struct BTreeSnapshotState
+{
+  SIZE_T rootnode;
+  SIZE_T highwater;  // as in SuperblockData; blocks past it aren't in the snapshot
+  map<SIZE_T, shared_ptr<const BTreeNode> > before;
+};
+
+#define BTREE_FILL_BUCKETS 10
+#define BTREE_LEAF_LATCHES 64
+
+// What SanityCheck found.  Levels count from the root, at level 0.
+// A node's fill is the bytes its slots take over the most it can
+// hold, bucketed in tenths; a full node is in the last bucket.  A
+// compressed leaf's is its packed bytes over the block.
+struct BTreeStats
+{
+  SIZE_T depth;
+  vector<SIZE_T> levels;  // nodes on each level
+  SIZE_T numinterior;     // root included
+  SIZE_T numleaves;
+  SIZE_T numcompressed;   // leaves stored compressed
+  SIZE_T numkeys;
+  SIZE_T numfree;         // blocks on the free list
+  SIZE_T numblocks;       // blocks on the disk
+  SIZE_T interiorfill[BTREE_FILL_BUCKETS];
+  SIZE_T leaffill[BTREE_FILL_BUCKETS];
+  string problem;         // first problem found, if any
+
+  BTreeStats();
+  ostream &Print(ostream &os) const;
+};
+
+inline ostream &operator<<(ostream &os, const BTreeStats &s) { return s.Print(os); }
+
+#define BTREE_SPLIT_LEVELS 16
+#define BTREE_LATENCY_BUCKETS 32
+
+// Counters for one kind of operation.  A batch counts as one operation
+// of its kind.  Splits are by level, leaves at 0.  Times are in
+// seconds; simulated time is the buffer cache's clock.  Latency bucket
+// i counts operations that took [2^i, 2^(i+1)) microseconds, with
+// anything shorter in bucket 0 and longer in the last one.
+struct BTreeOpStats
+{
+  SIZE_T count;
+  SIZE_T nodereads;         // from the buffer cache
+  SIZE_T nodecachehits;     // reads the node cache saved
+  SIZE_T prefetches;        // blocks queued for the prefetch thread
+  SIZE_T nodewrites;
+  SIZE_T superblockwrites;  // also counted in nodewrites
+  SIZE_T logrecords;        // appended to the redo log
+  SIZE_T logsyncs;          // log syncs done, each for every record waiting
+  SIZE_T comparisons;
+  SIZE_T allocs;
+  SIZE_T deallocs;
+  SIZE_T splits[BTREE_SPLIT_LEVELS];
+  SIZE_T borrows;
+  SIZE_T merges;
+  double simtime;
+  double walltime;
+  SIZE_T simlatency[BTREE_LATENCY_BUCKETS];
+  SIZE_T walllatency[BTREE_LATENCY_BUCKETS];
+
+  BTreeOpStats();
+  BTreeOpStats &operator+=(const BTreeOpStats &rhs);
+  ostream &PrintJSON(ostream &os) const;
+};
+
+//
+// A cursor walks the leaves in key order using their sibling links,
+// reading each leaf once.  Position it with one of the Seek calls.
+// Next and Prev return ERROR_NONEXISTENT when they run off an end;
+// after running off the last key, Prev brings the cursor back.
+//
+class BTreeCursor
+{
+private:
+  const BTreeIndex *index;
+  SIZE_T leafblock;   // 0 if not positioned
+  SIZE_T offset;      // leaf.info.numkeys if past the last key
+  BTreeNode leaf;
+  SIZE_T ahead;       // leaves past this one already queued for prefetch
+
+  ERROR_T SkipForward();
+  ERROR_T SkipBackward();
+  void PrefetchAhead(const bool backward);
+
+public:
+  BTreeCursor(const BTreeIndex *index);
+
+  // Seek positions the cursor on the first key >= key
+  // return ERROR_NONEXISTENT if there is no such key
+  ERROR_T Seek(const KEY_T &key);
+  ERROR_T SeekFirst();
+  ERROR_T SeekLast();
+
+  ERROR_T Next();
+  ERROR_T Prev();
+
+  bool IsValid() const;
+  ERROR_T GetKey(KEY_T &key) const;
+  ERROR_T GetVal(VALUE_T &value) const;
+  int CompareKey(const KEY_T &key) const;
+};
+
+//
+// A snapshot is a read-only view of the index as it was when the
+// snapshot was made, for as long as it lives.  Its reads take no part
+// in the index's latch, so they neither wait for writers nor hold them
+// up, however long they take.  Writers go on changing nodes in place,
+// but until the snapshot is destroyed, each block is copied for it, in
+// memory, before its first overwrite, and it reads that copy.  The
+// copies go once no snapshot needs them, so a snapshot costs memory in
+// proportion to the blocks written while it lives.  Nothing caps that
+// short of the index itself: a block is copied at most once, and only
+// if the snapshot has it, so a snapshot held across steady writes
+// grows toward a copy of every block the index had when it was made.
+// A write whose block can't be copied fails.  Destroy it before the
+// index.
+//
+class BTreeSnapshot
+{
+private:
+  BTreeIndex *index;
+  list<BTreeSnapshotState>::iterator state;
+
+  // Not copyable
+  BTreeSnapshot(const BTreeSnapshot &rhs);
+  BTreeSnapshot &operator=(const BTreeSnapshot &rhs);
+
+public:
+  // Waits only for a split or merge in progress to finish
+  BTreeSnapshot(BTreeIndex *index);
+  ~BTreeSnapshot();
+
+  // As the index's own, but of the tree as it was
+  ERROR_T Lookup(const KEY_T &key, VALUE_T &value) const;
+  ERROR_T Scan(const KEY_T &lo, const KEY_T &hi, BTreeScanCallback callback, void *state) const;
+  ERROR_T Display(ostream &o, BTreeDisplayType display_type = BTREE_DEPTH) const;
+};
+
 class BTreeIndex
 {
+  friend class BTreeCursor;
+  friend class BTreeOpScope;
+  friend class BTreeSnapshot;
+
 private:
   BufferCache *buffercache;
   SIZE_T superblock_index;
   BTreeNode superblock;
 
+  // Readers share latch and writers hold it alone; see BTreeOpScope.
+  // cachelock lets one thread at a time into the buffer cache.
+  mutable shared_mutex latch;
+  mutable mutex cachelock;
+  mutable mutex statslock;
+  // Writers that change one leaf in place hold its latch
+  mutable mutex leaflatches[BTREE_LEAF_LATCHES];
+
+  mutable BTreeOpStats opstats[BTREE_NUM_OPS];
+  SIZE_T opsplits;            // splits so far in this insert
+
+  // What the running operation wrote, by block, freed and took
+  mutable map<SIZE_T, BTreeNode> writeset;
+  mutable vector<SIZE_T> freed;
+  mutable vector<SIZE_T> allocated;
+
+  // Nodes as last read or written through.  Scans, bulk loads and
+  // other whole-tree passes mark their accesses sequential.
+  mutable BTreeNodeCache nodecache;
+
+  // Open snapshots, oldest first, under cachelock
+  mutable list<BTreeSnapshotState> snapshots;
+
+  // Redo log of every node written, if open; see OpenLog
+  mutable BTreeLog log;
+
+  // Blocks a reader is about to need, which the prefetch thread reads
+  // into the node cache while the reader works on what it has
+  mutable mutex prefetchlock;
+  mutable condition_variable prefetchready;
+  mutable deque<SIZE_T> prefetchqueue;
+  mutable thread prefetcher;
+  mutable bool prefetchstop;
+
+  BTreeAllocPolicy allocpolicy;
+  SIZE_T blockspertrack;
+  // For BTREE_ALLOC_NEAR, each block on the free list and the one
+  // before it there (0 for the superblock)
+  map<SIZE_T, SIZE_T> freeprev;
+
+  BTreeCompressPolicy compresspolicy;
+  KEY_T compresscold;  // for BTREE_COMPRESS_BELOW
+
 protected:
-  ERROR_T AllocateNode(SIZE_T &node);
+  // Every node read and write goes through these
+  ERROR_T ReadNode(const SIZE_T block, BTreeNode &node) const;
+  ERROR_T WriteNode(const SIZE_T block, const BTreeNode &node);
+  // logged if the node is already in the redo log
+  ERROR_T WriteThrough(const SIZE_T block, const BTreeNode &node, const bool logged = false) const;
+  ERROR_T CommitWrites() const;
+  // Drops the write set of scope, an operation that failed partway with
+  // rc, instead of committing it, so the index is as it was before it.
+  // Returns rc.
+  ERROR_T AbandonWrites(BTreeOpScope &scope, const ERROR_T rc);
+  BTreeLSN AppendLog(const vector<BTreeLogImage> &images) const;
+  ERROR_T FlushLog(const BTreeLSN lsn) const;
+  static ERROR_T ReplayImage(const SIZE_T block, const BYTE_T *image, const SIZE_T length, void *state);
+  BTreeOpStats &CurrentOpStats() const;
+  SIZE_T RootNode() const;  // the running snapshot's root, if any
+  ERROR_T SaveForSnapshots(const SIZE_T block) const;  // under cachelock
+  void CountSplit();  // the next level up from the last split in this insert
+  bool CompressesLeaf(const KEY_T &first) const;  // by the compress policy
+  // Compresses or expands leaf as the policy has it, unless it won't fit
+  ERROR_T ApplyCompressPolicy(BTreeNode &leaf) const;
+
+  // hint is the block the new node should be near, or 0
+  ERROR_T AllocateNode(SIZE_T &node, const SIZE_T hint = 0);
+  // Like AllocateNode, but leaves writing the superblock to the caller
+  ERROR_T PopFreeBlock(SIZE_T &node, const SIZE_T hint = 0);
+  // Tells the buffer cache n is in use, noting it in allocated if the
+  // running operation's writes are buffered
+  void NotifyAllocate(const SIZE_T n);
+  ERROR_T LoadFreeMap();
+  SIZE_T NearestFreeBlock(const SIZE_T hint) const;  // 0 if the disk is full
 
   ERROR_T DeallocateNode(const SIZE_T &node);
+  // Writes node, made free, to block n and puts it at the head of the
+  // free list
+  ERROR_T PushFreeBlock(const SIZE_T n, BTreeNode &node);
 
   ERROR_T LookupOrUpdateInternal(const SIZE_T &Node,
                                  const BTreeOp op,
@@ -72,7 +352,52 @@ protected:
   ERROR_T DisplayInternal(const SIZE_T &node,
                           ostream &o,
                           const BTreeDisplayType display_type = BTREE_DEPTH) const;
-  ERROR_T InsertAfterAdjust(const SIZE_T &start_ptr, const KEY_T &key, const VALUE_T &value, SIZE_T &adjusted_block, KEY_T &adjusted_key);
+  // lo and hi are the separators around start_ptr in its parent (empty
+  // where open), which give the key prefix of each half of a split
+  ERROR_T InsertAfterAdjust(const SIZE_T &start_ptr, const KEY_T &lo, const KEY_T &hi,
+                            const KEY_T &key, const VALUE_T &value, SIZE_T &adjusted_block, KEY_T &adjusted_key);
+  // Inserts, updates or deletes key in its leaf alone.  Returns
+  // ERROR_SPLIT_BLOCK or ERROR_UNDERFLOW_BLOCK, having changed nothing,
+  // if the change takes more than that leaf.
+  ERROR_T ChangeLeaf(const BTreeOp op, const KEY_T &key, const VALUE_T &value);
+  ERROR_T DeleteRecursion(const SIZE_T &start_ptr, const KEY_T &lo, const KEY_T &hi, const KEY_T &key);
+  ERROR_T RebalanceChild(BTreeNode &b, const SIZE_T node, const SIZE_T offset, const KEY_T &lo, const KEY_T &hi);
+
+  // Descends to the leaf that would hold key, or to the first or last
+  // leaf.  Returns ERROR_NONEXISTENT if the tree is empty.  If ahead is
+  // given, the leaf's siblings after it (before it, if backward) are
+  // queued for prefetch, and ahead says how many.
+  enum LeafTarget { LEAF_FOR_KEY, LEAF_FIRST, LEAF_LAST };
+  ERROR_T FindLeaf(const LeafTarget target, const KEY_T *key, SIZE_T &leafblock, BTreeNode &leaf,
+                   SIZE_T *ahead = 0, const bool backward = false) const;
+
+  // Queues the children of an interior node after offset (before it,
+  // if backward) to be read into the node cache.  Returns how many were
+  // queued, which is none if the node cache is off.
+  SIZE_T Prefetch(const BTreeNode &node, const SIZE_T offset, const bool backward = false) const;
+  // Queues blocks, as many of them from the front as are worth it
+  SIZE_T Prefetch(const vector<SIZE_T> &blocks) const;
+  void PrefetchLoop() const;
+  // Waits for the prefetch thread to finish and drops what is still
+  // queued; the next Prefetch starts it again
+  void StopPrefetch();
+
+  ERROR_T BatchInternal(const SIZE_T &node, BTreeBatch &batch, const SIZE_T first, const SIZE_T last);
+  ERROR_T BatchLeaf(BTreeNode &b, const SIZE_T &node, BTreeBatch &batch, const SIZE_T first, const SIZE_T last);
+
+  ERROR_T BulkLoadLeaf(BTreeNode &leaf, const SIZE_T leafblock, const SIZE_T nextblock,
+                       vector<SIZE_T> &blocks, vector<KEY_T> &maxkeys);
+  // These add each block they take to taken
+  ERROR_T BulkLoadPrev(BTreeNode &prev, SIZE_T &prevblock, SIZE_T &curblock,
+                       vector<SIZE_T> &blocks, vector<KEY_T> &maxkeys, vector<SIZE_T> &taken);
+  ERROR_T BulkLoadLevel(vector<SIZE_T> &blocks, vector<KEY_T> &maxkeys, const double fillfactor,
+                        vector<SIZE_T> &taken);
+  ERROR_T BulkLoadTree(BTreeBulkLoadSource source, void *state, const double fillfactor,
+                       vector<SIZE_T> &taken);
+  ERROR_T BulkLoadRelease(const vector<SIZE_T> &taken, const SIZE_T highwater);
+
+  ERROR_T SanityCheckFreeList(BTreeSanityState &state, BTreeStats &stats) const;
+  ERROR_T SanityCheckSubtrees(BTreeSanityState &state, BTreeSanityWorker &worker) const;
 
 public:
   //
@@ -84,7 +409,8 @@ public:
   // and actually write the data in the superblock.
   // otherwise, the expectation is that keysize and valuesize
   // will be zero and will be read when Attach(initialblock,false) is
-  // invoked
+  // invoked.  They are the longest key and value the index takes;
+  // shorter ones take only the bytes they need.
   BTreeIndex(SIZE_T keysize,
              SIZE_T valuesize,
              BufferCache *cache,
@@ -103,37 +429,112 @@ public:
   // you need to find the elements of the tree.
   // return zero on success or ERROR_NOTANINDEX if we are
   // giving you an incorrect block to start with
+  // return ERROR_BADCONFIG if create=true and a node can't hold four
+  // of the longest pairs, or the block is over 64KB
   ERROR_T Attach(const SIZE_T initblock, const bool create = false);
 
   // This is called after all inserts, updates, or deletes are done.
   // We expect you to tell us the number of your superblock, which
-  // we will return to you on the next attach
+  // we will return to you on the next attach.  The prefetch thread is
+  // stopped first, as it reads through the buffer cache.
   ERROR_T Detach(SIZE_T &initblock);
 
+  // Logs every node written to the file at path, and replays what is
+  // already there at the next Attach, so a change is durable as soon as
+  // the call that made it returns, whatever the buffer cache has yet to
+  // write.  Concurrent changes share their log syncs.  Open the log
+  // before Attach, and use it with every Attach of the index after.
+  // Attach with create empties it.
+  // return zero on success
+  // return ERROR_NOFILE if the log can't be opened
+  ERROR_T OpenLog(const char *path);
+  // Stops logging.  If truncate, the log is emptied first, which is
+  // only safe once the buffer cache has written out every block, as
+  // BufferCache::Detach does.
+  ERROR_T CloseLog(const bool truncate = false);
+
+  // Chooses how new nodes are placed; blockspertrack is the disk's,
+  // as given to makedisk.  The policy holds across Attach and Detach.
+  // return zero on success
+  // return ERROR_BADCONFIG if blockspertrack is zero
+  ERROR_T SetAllocPolicy(const BTreeAllocPolicy policy, const SIZE_T blockspertrack = 1);
+
+  // Chooses which leaves are compressed; cold is the highest first key
+  // of a compressed leaf under BTREE_COMPRESS_BELOW.  Leaves already
+  // written keep their form until they split.  The policy holds across
+  // Attach and Detach.
+  // return zero on success
+  ERROR_T SetCompressPolicy(const BTreeCompressPolicy policy, const KEY_T &cold = KEY_T());
+
   // return zero on success
   // return ERROR_NOSPACE if you run out of disk space
-  // return ERROR_SIZE if the key or value are the wrong size for this index
+  // return ERROR_SIZE if the key is empty or the key or value are too
+  // long for this index
   // return ERROR_CONFLICT if the key already exists and it's a unique index
   ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
 
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
-  // return ERROR_SIZE if the key or value are the wrong size for this index
+  // return ERROR_SIZE if the key is empty or the key or value are too
+  // long for this index
   ERROR_T Update(const KEY_T &key, const VALUE_T &value);
 
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
-  // return ERROR_SIZE if the key or value are the wrong size for this index
+  // return ERROR_SIZE if the key is empty or too long for this index
   ERROR_T Delete(const KEY_T &key);
-  ERROR_T DeleteRecursion(const SIZE_T &start_ptr, const KEY_T &key);  
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
+  // Any number of threads may call any of these at once.  Lookup,
+  // LookupBatch, Scan, cursors, Display and SanityCheck only read.
+  // Insert, Update and Delete run alongside them and each other unless
+  // they split or merge nodes, which waits for the index to itself;
+  // so do the batches, BulkLoad, Attach and Detach.
   ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
 
+  // Builds the tree bottom up from pairs given in increasing key order.
+  // Leaves, and then each interior level, are packed to fillfactor
+  // (between 0.5 and 1) of their bytes and written once, in block order.
+  // return zero on success
+  // return ERROR_CONFLICT if the index is not empty or the keys are
+  // not strictly increasing
+  // return ERROR_SIZE if a key is empty or a key or value too long
+  // return ERROR_BADCONFIG if fillfactor is out of range
+  // return ERROR_NOSPACE if you run out of disk space
+  // On an error partway through, the blocks taken so far are handed
+  // back and the index is left empty.
+  ERROR_T BulkLoad(BTreeBulkLoadSource source, void *state, const double fillfactor = 1.0);
+
+  // Batched Insert, Lookup and Delete.  The keys are sorted and the
+  // tree is walked once, reading each node at most once and writing
+  // each changed leaf once.  Inserts that would split a leaf wait: the
+  // first for each such leaf goes through the single-key path, which
+  // splits it, and the tree is walked again for the rest.  A delete
+  // that would leave a leaf underfull goes through the single-key path
+  // afterwards.
+  // results[i] (and values[i]) get what the single operation would
+  // have returned for the ith request.
+  // return zero unless the walk itself fails
+  ERROR_T InsertBatch(const vector<KeyValuePair> &pairs, vector<ERROR_T> &results);
+  ERROR_T LookupBatch(const vector<KEY_T> &keys, vector<VALUE_T> &values, vector<ERROR_T> &results);
+  ERROR_T DeleteBatch(const vector<KEY_T> &keys, vector<ERROR_T> &results);
+
+  // Calls callback on each pair with lo <= key <= hi, in key order.
+  // Only the leaves in the range are read, each of them once.
+  // return zero on success
+  ERROR_T Scan(const KEY_T &lo, const KEY_T &hi, BTreeScanCallback callback, void *state) const;
+
   // Here you should figure out if your index makes sense
   // Is it a tree?  Is it in order?  Is it balanced?  Does each node have
   // a valid use ratio?
+  // Also checks the leaf links and the free list, and that every block
+  // is in exactly one of the tree and the free list.  The root's
+  // subtrees are split among numthreads workers, and each level is
+  // read in block order.  stats is filled in as far as the check got.
+  // return zero on success
+  // return ERROR_INSANE if the index is broken; stats.problem says how
   ERROR_T SanityCheck() const;
+  ERROR_T SanityCheck(BTreeStats &stats, const unsigned numthreads = 1) const;
 
   // Display tree
   // BTREE_DEPTH means to do a depth first traversal of
@@ -147,6 +548,23 @@ public:
   // sorted in order of keys.
   ERROR_T Display(ostream &o, BTreeDisplayType display_type = BTREE_DEPTH) const;
 
+  // The most bytes a key and a value may take, from the superblock
+  // once attached
+  SIZE_T GetKeySize() const;
+  SIZE_T GetValueSize() const;
+
+  // Keeps up to nodes decoded nodes in front of the buffer cache, with
+  // scan-resistant replacement; 0, the default, keeps none
+  void SetNodeCacheSize(const SIZE_T nodes);
+
+  // Per-operation counters, kept since the index was made or last reset.
+  // An operation adds to them as it ends.
+  BTreeOpStats GetOpStats(const BTreeOp op) const;  // a copy, taken under the lock
+  void ResetOpStats();
+  // Writes the counters for each operation, and the buffer cache's
+  // totals, as one JSON object
+  ostream &PrintOpStatsJSON(ostream &os) const;
+
   ostream &Print(ostream &os) const;
 };
 
@@ -0,0 +1,127 @@
+#include <stdlib.h>
+#include <fstream>
+#include <string>
+#include "btree.h"
+
+void usage() 
+{
+  cerr << "usage: btree_bulkload filestem cachesize fillfactor < keyvaluepairs\n";
+  cerr << "       pairs are read as \"key value\" lines, in increasing key order\n";
+}
+
+
+// Reads the next "key value" line from the stream
+static ERROR_T ReadPair(KeyValuePair &pair, void *state)
+{
+  istream *in = (istream *) state;
+  string key, value;
+
+  if (!(*in >> key >> value)) { 
+    return ERROR_NONEXISTENT;
+  }
+  pair.key = KEY_T(key.c_str());
+  pair.value = VALUE_T(value.c_str());
+  return ERROR_NOERROR;
+}
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize;
+  SIZE_T superblocknum;
+  double fillfactor;
+
+  if (argc!=4) { 
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  fillfactor=atof(argv[3]);
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(0,0,&cache);
+  
+  ERROR_T rc;
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) { 
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if (getenv("BTREE_ALLOC_NEAR") && 
+      (rc=btree.SetAllocPolicy(BTREE_ALLOC_NEAR,atoi(getenv("BTREE_ALLOC_NEAR"))))!=ERROR_NOERROR) { 
+    cerr << "Can't set allocation policy due to error "<<rc<<endl;
+    return -1;
+  }
+
+  if (getenv("BTREE_COMPRESS")) { 
+    string cold=getenv("BTREE_COMPRESS");
+    if (cold=="all") { 
+      rc=btree.SetCompressPolicy(BTREE_COMPRESS_ALL);
+    } else {
+      rc=btree.SetCompressPolicy(BTREE_COMPRESS_BELOW,KEY_T(cold.c_str()));
+    }
+    if (rc!=ERROR_NOERROR) { 
+      cerr << "Can't set compression policy due to error "<<rc<<endl;
+      return -1;
+    }
+  }
+
+  if (getenv("BTREE_NODE_CACHE")) { 
+    btree.SetNodeCacheSize(atoi(getenv("BTREE_NODE_CACHE")));
+  }
+
+  if (getenv("BTREE_LOG") && (rc=btree.OpenLog(getenv("BTREE_LOG")))!=ERROR_NOERROR) { 
+    cerr << "Can't open log due to error "<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Attach(0))!=ERROR_NOERROR) { 
+    cerr << "Can't attach to index  due to error "<<rc<<endl;
+    return -1;
+  } else {
+    cerr << "Index attached!"<<endl;
+    if ((rc=btree.BulkLoad(ReadPair,&cin,fillfactor))!=ERROR_NOERROR) { 
+      cerr <<"Can't bulk load index due to error "<<rc<<endl;
+    } else {
+      cerr <<"Bulk load succeeded\n";
+    }
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+    if ((rc=cache.Detach())!=ERROR_NOERROR) { 
+      cerr <<"Can't detach from cache due to error "<<rc<<endl;
+      return -1;
+    }
+    if ((rc=btree.CloseLog(true))!=ERROR_NOERROR) { 
+      cerr <<"Can't empty log due to error "<<rc<<endl;
+      return -1;
+    }
+    cerr << "Performance statistics:\n";
+    
+    cerr << "numallocs       = "<<cache.GetNumAllocs()<<endl;
+    cerr << "numdeallocs     = "<<cache.GetNumDeallocs()<<endl;
+    cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+    cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+    cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+    cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+    cerr << endl;
+    
+    cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+    if (getenv("BTREE_STATS_JSON")) { 
+      ofstream statsfile(getenv("BTREE_STATS_JSON"));
+      btree.PrintOpStatsJSON(statsfile);
+    }
+
+    return 0;
+  }
+}
+  
+
+  
@@ -1,7 +1,12 @@
 #include <new>
+#include <algorithm>
 #include <iostream>
+#include <map>
 #include <assert.h>
 #include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "btree_ds.h"
 #include "buffercache.h"
@@ -13,18 +18,88 @@ using namespace std;
 SIZE_T NodeMetadata::GetNumDataBytes() const
 {
   SIZE_T n=blocksize-sizeof(*this);
+  if (compressed) {
+    // Unpacked, it holds several blocks' worth
+    n=min((SIZE_T)(BTREE_COMPRESSED_SPAN*blocksize-sizeof(*this)),(SIZE_T)BTREE_MAX_DATA_BYTES);
+  }
   return n;
 }
 
 
-SIZE_T NodeMetadata::GetNumSlotsAsInterior() const
+//
+// Slots and records
+//
+// A slot is BTreeSlot.  A leaf record is the value's length, the rest
+// of the key past the slot's head, and the value; an interior record is
+// the pointer and the rest of the key.  The directory starts on an even
+// byte so its fields can be read in place; records lie wherever the
+// heap puts them and are read with memcpy.
+//
+
+static inline bool HasData(const NodeMetadata &info)
+{
+  return info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK;
+}
+
+static inline bool IsLeaf(const NodeMetadata &info)
+{
+  return info.nodetype==BTREE_LEAF_NODE;
+}
+
+static inline SIZE_T DirStart(const NodeMetadata &info)
+{
+  return (sizeof(SIZE_T)+info.keyprefix+1)&~(SIZE_T)1;
+}
+
+static inline SIZE_T DirEnd(const NodeMetadata &info)
+{
+  return DirStart(info)+info.numkeys*sizeof(BTreeSlot);
+}
+
+// Key bytes kept in the record rather than the slot
+static inline SIZE_T KeyTail(const SIZE_T length)
+{
+  return length>BTREE_SLOT_HEAD ? length-BTREE_SLOT_HEAD : 0;
+}
+
+// Bytes ahead of the key in a record
+static inline SIZE_T RecordHeader(const NodeMetadata &info)
+{
+  return IsLeaf(info) ? sizeof(unsigned short) : sizeof(SIZE_T);
+}
+
+// length is the key's, past the prefix
+static inline SIZE_T RecordSize(const NodeMetadata &info, const SIZE_T length, const SIZE_T valuelength)
+{
+  return BTreeSlotBytes(IsLeaf(info),length,valuelength)-sizeof(BTreeSlot);
+}
+
+
+SIZE_T NodeMetadata::GetCapacity() const
+{
+  return GetNumDataBytes()-DirStart(*this);
+}
+
+SIZE_T NodeMetadata::GetSlotBytes(const SIZE_T keylength, const SIZE_T valuelength) const
+{
+  return BTreeSlotBytes(IsLeaf(*this),keylength-keyprefix,valuelength);
+}
+
+SIZE_T NodeMetadata::GetMaxSlotBytes() const
+{
+  return GetSlotBytes(keysize,valuesize);
+}
+
+SIZE_T NodeMetadata::GetMinBytes() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+sizeof(SIZE_T));  // floor intended
+  SIZE_T half=GetCapacity()/2;
+  SIZE_T most=GetMaxSlotBytes();
+  return half>most ? half-most : 0;  // the rest of half, should one big slot land on the other side
 }
 
-SIZE_T NodeMetadata::GetNumSlotsAsLeaf() const
+SIZE_T NodeMetadata::GetPackedHeaderBytes() const
 {
-  return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+valuesize);  // floor intended
+  return sizeof(*this)+sizeof(SIZE_T)+keyprefix;
 }
 
 
@@ -36,21 +111,438 @@ ostream & NodeMetadata::Print(ostream &os) const
 				   nodetype==BTREE_INTERIOR_NODE ? "INTERIOR_NODE" :
 				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" : "UNKNOWN_TYPE")
      << ", keysize="<<keysize<<", valuesize="<<valuesize<<", blocksize="<<blocksize
-     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys<<")";
+     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys<<", keyprefix="<<keyprefix
+     << ", heap="<<heap<<", holes="<<holes<<", compressed="<<compressed<<", packed="<<packed<<")";
   return os;
 }
 
+static inline char *Prefix(const BTreeNode &node)
+{
+  return node.data+sizeof(SIZE_T);
+}
+
+static inline BTreeSlot *Slots(const BTreeNode &node)
+{
+  return (BTreeSlot*)(node.data+DirStart(node.info));
+}
+
+static inline SIZE_T ValueLength(const BTreeNode &node, const BTreeSlot &s)
+{
+  unsigned short n;
+
+  memcpy(&n,node.data+s.offset,sizeof(n));
+  return n;
+}
+
+static inline SIZE_T SlotRecordSize(const BTreeNode &node, const BTreeSlot &s)
+{
+  return RecordSize(node.info,s.length,IsLeaf(node.info) ? ValueLength(node,s) : 0);
+}
+
+static inline const char *SlotTail(const BTreeNode &node, const BTreeSlot &s)
+{
+  return node.data+s.offset+RecordHeader(node.info);
+}
+
+static inline const char *SlotValue(const BTreeNode &node, const BTreeSlot &s)
+{
+  return SlotTail(node,s)+KeyTail(s.length);
+}
+
+
+//
+// Packed leaves
+//
+// Lengths are varints, seven bits to a byte, low bits first.  A pair
+// packs to the bytes of its key past the prefix that it shares with
+// the key before, the count that follows and those bytes, and then the
+// same for its value.  So a pair's bytes depend only on it and the one
+// before, and info.packed is kept up to date slot by slot.
+//
+
+static inline SIZE_T VarintBytes(SIZE_T x)
+{
+  SIZE_T n=1;
+
+  while (x>=0x80) {
+    x>>=7;
+    n++;
+  }
+  return n;
+}
+
+static BYTE_T *PutVarint(BYTE_T *p, SIZE_T x)
+{
+  while (x>=0x80) {
+    *p++=(BYTE_T)(x|0x80);
+    x>>=7;
+  }
+  *p++=(BYTE_T)x;
+  return p;
+}
+
+// return 0 if it runs past end
+static const BYTE_T *GetVarint(const BYTE_T *p, const BYTE_T *end, SIZE_T &x)
+{
+  SIZE_T shift=0;
+
+  x=0;
+  while (p<end && shift<8*sizeof(x)) {
+    BYTE_T b=*p++;
+    x|=(SIZE_T)(b&0x7f)<<shift;
+    if (!(b&0x80)) {
+      return p;
+    }
+    shift+=7;
+  }
+  return 0;
+}
+
+static inline SIZE_T SharedBytes(const char *a, const SIZE_T alength, const char *b, const SIZE_T blength)
+{
+  SIZE_T n=min(alength,blength);
+  SIZE_T i=0;
+
+  while (i<n && a[i]==b[i]) {
+    i++;
+  }
+  return i;
+}
+
+static inline SIZE_T PairBytes(const SIZE_T keyshared, const SIZE_T keylength,
+			       const SIZE_T valueshared, const SIZE_T valuelength)
+{
+  return VarintBytes(keyshared)+VarintBytes(keylength-keyshared)+keylength-keyshared+
+    VarintBytes(valueshared)+VarintBytes(valuelength-valueshared)+valuelength-valueshared;
+}
+
+// Bytes of the keys past the prefix in a and b that are the same
+static SIZE_T SharedRest(const BTreeNode &node, const BTreeSlot &a, const BTreeSlot &b)
+{
+  SIZE_T n=min(a.length,b.length);
+  SIZE_T i=0;
+
+  while (i<n && i<BTREE_SLOT_HEAD && a.head[i]==b.head[i]) {
+    i++;
+  }
+  if (i==BTREE_SLOT_HEAD) {
+    i+=SharedBytes(SlotTail(node,a),n-BTREE_SLOT_HEAD,SlotTail(node,b),n-BTREE_SLOT_HEAD);
+  }
+  return i;
+}
+
+// Packed bytes of the pair in s, after the one in prev (none if 0)
+static SIZE_T SlotPairBytes(const BTreeNode &node, const BTreeSlot *prev, const BTreeSlot &s)
+{
+  SIZE_T valuelength=ValueLength(node,s);
+
+  if (!prev) {
+    return PairBytes(0,s.length,0,valuelength);
+  }
+  return PairBytes(SharedRest(node,*prev,s),s.length,
+		   SharedBytes(SlotValue(node,*prev),ValueLength(node,*prev),SlotValue(node,s),valuelength),
+		   valuelength);
+}
+
+// Packed bytes slot offset adds to its leaf, counting what it does to
+// the pair after it
+static long PackedSlotBytes(const BTreeNode &node, const SIZE_T offset)
+{
+  const BTreeSlot *slots=Slots(node);
+  const BTreeSlot *prev = offset>0 ? &slots[offset-1] : 0;
+  long n=SlotPairBytes(node,prev,slots[offset]);
+
+  if (offset+1<node.info.numkeys) {
+    n+=SlotPairBytes(node,&slots[offset],slots[offset+1]);
+    n-=SlotPairBytes(node,prev,slots[offset+1]);
+  }
+  return n;
+}
+
+// Packed bytes of the whole leaf, header included
+static SIZE_T PackedBytes(const BTreeNode &node)
+{
+  const BTreeSlot *slots=Slots(node);
+  SIZE_T packed=node.info.GetPackedHeaderBytes();
+
+  for (SIZE_T i=0;i<node.info.numkeys;i++) {
+    packed+=SlotPairBytes(node,i>0 ? &slots[i-1] : 0,slots[i]);
+  }
+  return packed;
+}
+
+// Writes the bytes of s's key past the prefix from from on
+static BYTE_T *PutRest(const BTreeNode &node, const BTreeSlot &s, SIZE_T from, BYTE_T *p)
+{
+  for (;from<s.length && from<BTREE_SLOT_HEAD;from++) {
+    *p++=s.head[from];
+  }
+  if (from<s.length) {
+    memcpy(p,SlotTail(node,s)+from-BTREE_SLOT_HEAD,s.length-from);
+    p+=s.length-from;
+  }
+  return p;
+}
+
+// Writes node's packed image, info.packed bytes
+static void Pack(const BTreeNode &node, BYTE_T *image)
+{
+  const BTreeSlot *slots=Slots(node);
+  BYTE_T *p=image;
+
+  memcpy(p,&node.info,sizeof(node.info));
+  p+=sizeof(node.info);
+  memcpy(p,node.data,sizeof(SIZE_T)+node.info.keyprefix);
+  p+=sizeof(SIZE_T)+node.info.keyprefix;
+  for (SIZE_T i=0;i<node.info.numkeys;i++) {
+    const BTreeSlot &s=slots[i];
+    SIZE_T valuelength=ValueLength(node,s);
+    SIZE_T keyshared=0;
+    SIZE_T valueshared=0;
+    if (i>0) {
+      keyshared=SharedRest(node,slots[i-1],s);
+      valueshared=SharedBytes(SlotValue(node,slots[i-1]),ValueLength(node,slots[i-1]),SlotValue(node,s),valuelength);
+    }
+    p=PutVarint(p,keyshared);
+    p=PutVarint(p,s.length-keyshared);
+    p=PutRest(node,s,keyshared,p);
+    p=PutVarint(p,valueshared);
+    p=PutVarint(p,valuelength-valueshared);
+    memcpy(p,SlotValue(node,s)+valueshared,valuelength-valueshared);
+    p+=valuelength-valueshared;
+  }
+  assert((SIZE_T)(p-image)==node.info.packed);
+}
+
+SIZE_T NodeMetadata::GetPackedPairBytes(const KEY_T &prevkey, const VALUE_T &prevvalue,
+					const KEY_T &key, const VALUE_T &value) const
+{
+  SIZE_T keylength=key.length-keyprefix;
+  SIZE_T keyshared=0;
+  SIZE_T valueshared=0;
+
+  if (prevkey.length>0) {
+    keyshared=SharedBytes((const char*)prevkey.data+keyprefix,prevkey.length-keyprefix,
+			  (const char*)key.data+keyprefix,keylength);
+    valueshared=SharedBytes((const char*)prevvalue.data,prevvalue.length,(const char*)value.data,value.length);
+  }
+  return PairBytes(keyshared,keylength,valueshared,value.length);
+}
+
+// Packs the records against the end of the block, in slot order, so
+// all the free space lies between the directory and the heap
+static void Compact(BTreeNode &node)
+{
+  SIZE_T end=node.info.GetNumDataBytes();
+  BTreeSlot *slots=Slots(node);
+  string heap(end-node.info.heap,'\0');
+  SIZE_T at=end;
+
+  for (SIZE_T i=0;i<node.info.numkeys;i++) {
+    SIZE_T n=SlotRecordSize(node,slots[i]);
+    at-=n;
+    memcpy(&heap[at-node.info.heap],node.data+slots[i].offset,n);
+    slots[i].offset=at;
+  }
+  memcpy(node.data+at,&heap[at-node.info.heap],end-at);
+  node.info.heap=at;
+  node.info.holes=0;
+}
+
+static void FreeRecord(BTreeNode &node, const BTreeSlot &s)
+{
+  SIZE_T n=SlotRecordSize(node,s);
+
+  if (s.offset==node.info.heap) {
+    node.info.heap+=n;
+  } else {
+    node.info.holes+=n;
+  }
+}
+
+// Opens slot offset over a record of n bytes, taken from the bottom of
+// the heap, which is compacted first if only its holes have the room
+static ERROR_T OpenSlot(BTreeNode &node, const SIZE_T offset, const SIZE_T n)
+{
+  BTreeSlot *slots=Slots(node);
+
+  if (node.GetFreeBytes()<sizeof(BTreeSlot)+n) {
+    return ERROR_NOSPACE;
+  }
+  if (node.info.heap<DirEnd(node.info)+sizeof(BTreeSlot)+n) {
+    Compact(node);
+  }
+  node.info.heap-=n;
+  memmove(slots+offset+1,slots+offset,(node.info.numkeys-offset)*sizeof(BTreeSlot));
+  slots[offset].offset=node.info.heap;
+  node.info.numkeys++;
+  return ERROR_NOERROR;
+}
+
+// Fills slot offset, whose record has just the room these take; rest
+// is the key past the prefix
+static void WriteSlot(BTreeNode &node, const SIZE_T offset, const char *rest, const SIZE_T length,
+		      const char *value, const SIZE_T valuelength, const SIZE_T ptr)
+{
+  BTreeSlot &s=Slots(node)[offset];
+  char *r=node.data+s.offset;
+
+  s.length=length;
+  memset(s.head,0,BTREE_SLOT_HEAD);
+  memcpy(s.head,rest,min(length,(SIZE_T)BTREE_SLOT_HEAD));
+  if (IsLeaf(node.info)) {
+    unsigned short n=valuelength;
+    memcpy(r,&n,sizeof(n));
+  } else {
+    memcpy(r,&ptr,sizeof(ptr));
+  }
+  r+=RecordHeader(node.info);
+  if (length>BTREE_SLOT_HEAD) {
+    memmove(r,rest+BTREE_SLOT_HEAD,length-BTREE_SLOT_HEAD);
+    r+=length-BTREE_SLOT_HEAD;
+  }
+  if (IsLeaf(node.info)) {
+    memmove(r,value,valuelength);
+  }
+}
+
+// Closes slot offset, leaving info.packed to the caller
+static void CloseSlot(BTreeNode &node, const SIZE_T offset)
+{
+  BTreeSlot *slots=Slots(node);
+
+  FreeRecord(node,slots[offset]);
+  memmove(slots+offset,slots+offset+1,(node.info.numkeys-offset-1)*sizeof(BTreeSlot));
+  node.info.numkeys--;
+  if (node.info.numkeys==0) {
+    node.info.heap=node.info.GetNumDataBytes();
+    node.info.holes=0;
+  }
+}
+
+// Writes the record of slot offset anew, moving it if its size changes
+static ERROR_T RewriteRecord(BTreeNode &node, const SIZE_T offset, const char *rest, const SIZE_T length,
+			     const char *value, const SIZE_T valuelength, const SIZE_T ptr)
+{
+  SIZE_T n=RecordSize(node.info,length,valuelength);
+  SIZE_T old=SlotRecordSize(node,Slots(node)[offset]);
+
+  if (n!=old) {
+    if (node.GetFreeBytes()+old<n) {
+      return ERROR_NOSPACE;
+    }
+    CloseSlot(node,offset);
+    OpenSlot(node,offset,n);
+  }
+  WriteSlot(node,offset,rest,length,value,valuelength,ptr);
+  return ERROR_NOERROR;
+}
+
+// Writes slot offset anew.  Nothing passed may lie in the node.
+static ERROR_T RewriteSlot(BTreeNode &node, const SIZE_T offset, const char *rest, const SIZE_T length,
+			   const char *value, const SIZE_T valuelength, const SIZE_T ptr)
+{
+  if (!node.info.compressed) {
+    return RewriteRecord(node,offset,rest,length,value,valuelength,ptr);
+  }
+
+  // Try it, and put it back if it won't pack
+  BTreeNode before(node);
+  long bytes=PackedSlotBytes(node,offset);
+  ERROR_T rc=RewriteRecord(node,offset,rest,length,value,valuelength,ptr);
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+  node.info.packed+=PackedSlotBytes(node,offset)-bytes;
+  if (node.info.packed>node.info.blocksize) {
+    node=before;
+    return ERROR_NOSPACE;
+  }
+  return ERROR_NOERROR;
+}
+
+
+// Bytes slots [first,last) of from take in to, whose prefix each key
+// must start with.  return ERROR_IMPLBUG if one doesn't.
+static ERROR_T RangeBytes(const BTreeNode &from, const SIZE_T first, const SIZE_T last,
+			  const BTreeNode &to, SIZE_T &bytes)
+{
+  const BTreeSlot *slots=Slots(from);
+  bool same=from.info.keyprefix==to.info.keyprefix &&
+    memcmp(Prefix(from),Prefix(to),to.info.keyprefix)==0;
+  KEY_T key;
+
+  bytes=0;
+  for (SIZE_T i=first;i<last;i++) {
+    SIZE_T length=slots[i].length;
+    if (!same) {
+      from.GetKey(i,key);
+      if (!to.SharesKeyPrefix(key)) {
+	return ERROR_IMPLBUG;
+      }
+      length=key.length-to.info.keyprefix;
+    }
+    bytes+=sizeof(BTreeSlot)+RecordSize(to.info,length,IsLeaf(from.info) ? ValueLength(from,slots[i]) : 0);
+  }
+  return ERROR_NOERROR;
+}
+
+// Copies slots [first,last) of from into to at at, which RangeBytes
+// says has the room.  The directory opens once and the heap is
+// compacted at most once.  Records copy as they are when the two
+// prefixes match, and are laid out again for to's prefix otherwise.
+// info.packed is left to the caller.
+static void CopySlots(const BTreeNode &from, const SIZE_T first, const SIZE_T last,
+		      BTreeNode &to, const SIZE_T at, const SIZE_T bytes)
+{
+  const BTreeSlot *src=Slots(from);
+  BTreeSlot *dst=Slots(to);
+  SIZE_T count=last-first;
+  bool same=from.info.keyprefix==to.info.keyprefix &&
+    memcmp(Prefix(from),Prefix(to),to.info.keyprefix)==0;
+  KEY_T key;
+  SIZE_T ptr=0;
+
+  if (to.info.heap<DirEnd(to.info)+bytes) {
+    Compact(to);
+  }
+  memmove(dst+at+count,dst+at,(to.info.numkeys-at)*sizeof(BTreeSlot));
+  to.info.numkeys+=count;
+  for (SIZE_T i=0;i<count;i++) {
+    const BTreeSlot &s=src[first+i];
+    SIZE_T valuelength=IsLeaf(from.info) ? ValueLength(from,s) : 0;
+    if (same) {
+      SIZE_T n=SlotRecordSize(from,s);
+      to.info.heap-=n;
+      dst[at+i]=s;
+      dst[at+i].offset=to.info.heap;
+      memcpy(to.data+to.info.heap,from.data+s.offset,n);
+    } else {
+      from.GetKey(first+i,key);
+      if (!IsLeaf(from.info)) {
+	memcpy(&ptr,from.data+s.offset,sizeof(ptr));
+      }
+      SIZE_T length=key.length-to.info.keyprefix;
+      to.info.heap-=RecordSize(to.info,length,valuelength);
+      dst[at+i].offset=to.info.heap;
+      WriteSlot(to,at+i,(const char*)key.data+to.info.keyprefix,length,SlotValue(from,s),valuelength,ptr);
+    }
+  }
+}
+
+
 BTreeNode::BTreeNode() 
 {
   info.nodetype=BTREE_UNALLOCATED_BLOCK;
+  info.keyprefix=0;
+  info.compressed=0;
+  info.packed=0;
   data=0;
 }
 
 BTreeNode::~BTreeNode()
 {
-  if (data) { 
-    delete [] data;
-  }
+  // page owns the storage data points into
   data=0;
   info.nodetype=BTREE_UNALLOCATED_BLOCK;
 }
@@ -65,33 +557,103 @@ BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T b
   info.rootnode=0;
   info.freelist=0;
   info.numkeys=0;				       
+  info.keyprefix=0;
+  info.compressed=0;
+  info.packed=0;
+  info.heap=info.GetNumDataBytes();
+  info.holes=0;
   data=0;
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
-    data = new char [info.GetNumDataBytes()];
-    memset(data,0,info.GetNumDataBytes());
+  page.Resize(info.blocksize,false);
+  memset(page.data,0,info.blocksize);
+  if (HasData(info)) {
+    data = (char*)page.data+sizeof(info);
   }
 }
 
-BTreeNode::BTreeNode(const BTreeNode &rhs) 
+
+// Empties node into a fresh page laid out for info
+static void Reset(BTreeNode &node, const NodeMetadata &info)
+{
+  SIZE_T size=sizeof(info)+info.GetNumDataBytes();
+
+  node.info=info;
+  node.info.numkeys=0;
+  node.info.heap=info.GetNumDataBytes();
+  node.info.holes=0;
+  node.info.packed = info.compressed ? info.GetPackedHeaderBytes() : 0;
+  node.page.Resize(size,false);
+  memset(node.page.data,0,size);
+  node.data=(char*)node.page.data+sizeof(info);
+}
+
+// Rebuilds node from its packed image
+static ERROR_T Unpack(BTreeNode &node, const BYTE_T *image, const SIZE_T length)
+{
+  NodeMetadata info;
+  KEY_T key;
+  VALUE_T value;
+  SIZE_T prefix, keyshared, keylength, valueshared, valuelength;
+
+  memcpy(&info,image,sizeof(info));
+  prefix=info.keyprefix;
+  if (!IsLeaf(info) || prefix>info.keysize || info.packed>length ||
+      info.packed<sizeof(info)+sizeof(SIZE_T)+prefix) {
+    return ERROR_WRONGSIZEBLOCK;
+  }
+  Reset(node,info);
+  memcpy(node.data,image+sizeof(info),sizeof(SIZE_T)+prefix);
+
+  const BYTE_T *p=image+sizeof(info)+sizeof(SIZE_T)+prefix;
+  const BYTE_T *end=image+info.packed;
+  key.Resize(info.keysize,false);
+  value.Resize(info.valuesize,false);
+  memcpy(key.data,image+sizeof(info)+sizeof(SIZE_T),prefix);
+  key.Resize(prefix);
+  value.Resize(0);
+  for (SIZE_T i=0;i<info.numkeys;i++) {
+    if (!(p=GetVarint(p,end,keyshared)) || keyshared>key.length-prefix ||
+	!(p=GetVarint(p,end,keylength)) || keylength>(SIZE_T)(end-p) ||
+	prefix+keyshared+keylength>info.keysize) {
+      return ERROR_WRONGSIZEBLOCK;
+    }
+    key.Resize(prefix+keyshared+keylength);
+    memcpy(key.data+prefix+keyshared,p,keylength);
+    p+=keylength;
+    if (!(p=GetVarint(p,end,valueshared)) || valueshared>value.length ||
+	!(p=GetVarint(p,end,valuelength)) || valuelength>(SIZE_T)(end-p) ||
+	valueshared+valuelength>info.valuesize) {
+      return ERROR_WRONGSIZEBLOCK;
+    }
+    value.Resize(valueshared+valuelength);
+    memcpy(value.data+valueshared,p,valuelength);
+    p+=valuelength;
+    if (node.InsertKeyVal(i,key,value)!=ERROR_NOERROR) {
+      return ERROR_WRONGSIZEBLOCK;
+    }
+  }
+  if (p!=end || node.info.packed!=info.packed) {
+    return ERROR_WRONGSIZEBLOCK;
+  }
+  return ERROR_NOERROR;
+}
+
+
+BTreeNode::BTreeNode(const BTreeNode &rhs) : info(rhs.info), data(0), page(rhs.page)
 {
-  info.nodetype=rhs.info.nodetype;
-  info.keysize=rhs.info.keysize;
-  info.valuesize=rhs.info.valuesize;
-  info.blocksize=rhs.info.blocksize;
-  info.rootnode=rhs.info.rootnode;
-  info.freelist=rhs.info.freelist;
-  info.numkeys=rhs.info.numkeys;				       
-  data=0;
   if (rhs.data) { 
-   data=new char [info.GetNumDataBytes()];
-    memcpy(data,rhs.data,info.GetNumDataBytes());
+    data = (char*)page.data+sizeof(info);
   }
 }
 
 
 BTreeNode & BTreeNode::operator=(const BTreeNode &rhs) 
 {
-  return *(new (this) BTreeNode(rhs));
+  if (this!=&rhs) {
+    info=rhs.info;
+    page=rhs.page;
+    data = rhs.data ? (char*)page.data+sizeof(info) : 0;
+  }
+  return *this;
 }
 
 
@@ -99,64 +661,55 @@ ERROR_T BTreeNode::Serialize(BufferCache *b, const SIZE_T blocknum) const
 {
   assert((unsigned)info.blocksize==b->GetBlockSize());
 
-  Block block(sizeof(info)+info.GetNumDataBytes());
+  if (info.compressed) {
+    Block image(info.blocksize);
+    memset(image.data,0,info.blocksize);
+    Pack(*this,image.data);
+    return b->WriteBlock(blocknum,image);
+  }
 
-  memcpy(block.data,&info,sizeof(info));
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) { 
-    memcpy(block.data+sizeof(info),data,info.GetNumDataBytes());
+  if (page.length!=info.blocksize) {
+    // Never read or built with a size, so there is no image yet
+    page.Resize(info.blocksize,false);
+    memset(page.data,0,info.blocksize);
   }
 
-  return b->WriteBlock(blocknum,block);
+  memcpy(page.data,&info,sizeof(info));
+
+  return b->WriteBlock(blocknum,page);
 }
 
 
 ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
 {
-  Block block;
-
   ERROR_T rc;
 
-  rc=b->ReadBlock(blocknum,block);
+  data=0;
+
+  rc=b->ReadBlock(blocknum,page);
 
   if (rc!=ERROR_NOERROR) {
     return rc;
   }
 
-  memcpy(&info,block.data,sizeof(info));
-  
-  if (data) { 
-    delete [] data;
-    data=0;
-  }
+  memcpy(&info,page.data,sizeof(info));
 
   assert(b->GetBlockSize()==(unsigned)info.blocksize);
 
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
-    data = new char [info.GetNumDataBytes()];
-    memcpy(data,block.data+sizeof(info),info.GetNumDataBytes());
+  if (info.compressed) {
+    // Held unpacked in memory
+    Block image(std::move(page));
+    return Unpack(*this,image.data,image.length);
+  }
+
+  if (HasData(info)) {
+    data = (char*)page.data+sizeof(info);
   }
   
   return ERROR_NOERROR;
 }
 
 
-char * BTreeNode::ResolveKey(const SIZE_T offset) const
-{
-  switch (info.nodetype) { 
-  case BTREE_INTERIOR_NODE:
-  case BTREE_ROOT_NODE:
-    assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(sizeof(SIZE_T)+info.keysize);
-    break;
-  case BTREE_LEAF_NODE:
-    assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize);
-    break;
-  default:
-    return 0;
-  }
-}
-
 
 char * BTreeNode::ResolvePtr(const SIZE_T offset) const
 {
@@ -164,7 +717,7 @@ char * BTreeNode::ResolvePtr(const SIZE_T offset) const
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
     assert(offset<=info.numkeys);
-    return data+offset*(sizeof(SIZE_T)+info.keysize);
+    return offset<info.numkeys ? data+Slots(*this)[offset].offset : data;
     break;
   case BTREE_LEAF_NODE:
     assert(offset==0);
@@ -180,9 +733,11 @@ char * BTreeNode::ResolvePtr(const SIZE_T offset) const
 char * BTreeNode::ResolveVal(const SIZE_T offset) const
 {
   switch (info.nodetype) { 
-  case BTREE_LEAF_NODE:
+  case BTREE_LEAF_NODE: {
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize)+info.keysize;
+    const BTreeSlot &s=Slots(*this)[offset];
+    return data+s.offset+RecordHeader(info)+KeyTail(s.length);
+  }
     break;
   default:
     return 0;
@@ -191,21 +746,24 @@ char * BTreeNode::ResolveVal(const SIZE_T offset) const
 
 
 
-char * BTreeNode::ResolveKeyVal(const SIZE_T offset) const
+SuperblockData * BTreeNode::ResolveSuperblock() const
 {
-  return ResolveKey(offset);
+  assert(info.nodetype==BTREE_SUPERBLOCK);
+  assert(page.length>=sizeof(info)+sizeof(SuperblockData));
+  return (SuperblockData*)((char*)page.data+sizeof(info));
 }
 
 ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
 {
-  char *p=ResolveKey(offset);
-
-  if (p==0) { 
+  if (!HasData(info) || offset>=info.numkeys) { 
     return ERROR_NOMEM;
   }
-  
-  k.Resize(info.keysize,false);
-  memcpy(k.data,p,info.keysize);
+
+  const BTreeSlot &s=Slots(*this)[offset];
+  k.Resize(info.keyprefix+s.length,false);
+  memcpy(k.data,Prefix(*this),info.keyprefix);
+  memcpy(k.data+info.keyprefix,s.head,min((SIZE_T)s.length,(SIZE_T)BTREE_SLOT_HEAD));
+  memcpy(k.data+info.keyprefix+BTREE_SLOT_HEAD,data+s.offset+RecordHeader(info),KeyTail(s.length));
   return ERROR_NOERROR;
 }
 
@@ -229,8 +787,9 @@ ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v) const
     return ERROR_NOMEM;
   }
   
-  v.Resize(info.valuesize,false);
-  memcpy(v.data,p,info.valuesize);
+  SIZE_T length=ValueLength(*this,Slots(*this)[offset]);
+  v.Resize(length,false);
+  memcpy(v.data,p,length);
   return ERROR_NOERROR;
 }
 
@@ -249,15 +808,25 @@ ERROR_T BTreeNode::GetKeyVal(const SIZE_T offset, KeyValuePair &p) const
 
 ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
 {
-  char *p=ResolveKey(offset);
+  VALUE_T v;
+  SIZE_T ptr=0;
 
-  if (p==0) { 
+  if (!HasData(info) || offset>=info.numkeys) { 
     return ERROR_NOMEM;
   }
 
-  memcpy(p,k.data,info.keysize);
+  if (!SharesKeyPrefix(k)) {
+    // Not a key this node can hold
+    return ERROR_IMPLBUG;
+  }
 
-  return ERROR_NOERROR;
+  if (IsLeaf(info)) {
+    GetVal(offset,v);
+  } else {
+    GetPtr(offset,ptr);
+  }
+  return RewriteSlot(*this,offset,(const char*)k.data+info.keyprefix,k.length-info.keyprefix,
+		     (const char*)v.data,v.length,ptr);
 }
 
 
@@ -279,47 +848,587 @@ ERROR_T BTreeNode::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
 ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v)
 {
   char *p=ResolveVal(offset);
+  KEY_T k;
   
   if (p==0) { 
     return ERROR_NOMEM;
   }
-  
-  memcpy(p,v.data,info.valuesize);
-  
-  return ERROR_NOERROR;
+
+  if (v.length==ValueLength(*this,Slots(*this)[offset]) && !info.compressed) {
+    memcpy(p,v.data,v.length);
+    return ERROR_NOERROR;
+  }
+
+  GetKey(offset,k);
+  return RewriteSlot(*this,offset,(const char*)k.data+info.keyprefix,k.length-info.keyprefix,
+		     (const char*)v.data,v.length,0);
 }
 
 
 ERROR_T BTreeNode::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
 {
-  ERROR_T rc=SetKey(offset,p.key);
+  if (!HasData(info) || offset>=info.numkeys) { 
+    return ERROR_NOMEM;
+  }
 
-  if (rc!=ERROR_NOERROR) { 
-    return rc;
-  } else {
-    return SetVal(offset,p.value);
+  if (!SharesKeyPrefix(p.key)) {
+    return ERROR_IMPLBUG;
   }
+
+  return RewriteSlot(*this,offset,(const char*)p.key.data+info.keyprefix,p.key.length-info.keyprefix,
+		     (const char*)p.value.data,p.value.length,0);
 }
 
 
 
+//
+// Key search
+//
+// Keys compare with memcmp, and then by length, so a slot's head, the
+// first bytes of the key past the prefix padded with zeros, orders like
+// the big-endian integer made from them whenever the heads differ.  We
+// binary search on those words and finish the last few slots with a
+// branch-free count.  Only slots whose head equals the key's, usually
+// none or one, need the rest of the key compared.  A key that is at
+// most a word past the prefix, as a typed index's fixed-width ones
+// are, is compared whole as a big-endian word the same way, and then
+// by length.  Either way, O(log numkeys) compares.
+//
 
-ostream & BTreeNode::Print(ostream &os) const 
+#define SEARCH_LINEAR_SLOTS 8
+
+static thread_local SIZE_T keycompares=0;
+
+SIZE_T GetKeyCompares()
 {
-  os << "BTreeNode(info="<<info;
-  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) { 
-    os <<", ";
-    if (info.nodetype==BTREE_INTERIOR_NODE || info.nodetype==BTREE_ROOT_NODE) {
-      SIZE_T ptr;
-      KEY_T key;
-      os << "pointers_and_values=(";
-      if (info.numkeys>0) { // ==0 implies an empty root node
-	for (SIZE_T i=0;i<info.numkeys;i++) {
-	  GetPtr(i,ptr);
-	  os<<ptr<<", ";
-	  GetKey(i,key);
-	  os<<key<<", ";
-	}
+  return keycompares;
+}
+
+static inline unsigned long long LoadKeyWord(const char *p, const SIZE_T len)
+{
+  unsigned long long w=0;
+  SIZE_T i;
+
+  for (i=0;i<len;i++) {
+    w = (w<<8) | (unsigned char)p[i];
+  }
+  return w<<(8*(sizeof(w)-len));
+}
+
+
+static SIZE_T SearchShortKey(const char *base, const SIZE_T stride, const SIZE_T keysize,
+			     const SIZE_T numkeys, const unsigned long long probe)
+{
+  SIZE_T lo=0;
+  SIZE_T n=numkeys;
+
+  // Narrow [lo,lo+n) down to a handful of candidates
+  while (n>SEARCH_LINEAR_SLOTS) {
+    SIZE_T half=n/2;
+    keycompares++;
+    if (LoadKeyWord(base+(lo+half-1)*stride,keysize)<probe) {
+      lo+=half;
+      n-=half;
+    } else {
+      n=half;
+    }
+  }
+
+  // The lower bound is lo plus the number of candidates below probe
+  keycompares+=n;
+  SIZE_T below=0;
+  for (SIZE_T i=0;i<n;i++) {
+    below+=(LoadKeyWord(base+(lo+i)*stride,keysize)<probe);
+  }
+  return lo+below;
+}
+
+
+// The key in s against rest, a key past the prefix of length bytes
+static int CompareRest(const BTreeNode &node, const BTreeSlot &s, const char *rest, const SIZE_T length)
+{
+  SIZE_T n=min((SIZE_T)s.length,length);
+  int c=memcmp(s.head,rest,min(n,(SIZE_T)BTREE_SLOT_HEAD));
+
+  if (c==0 && n>BTREE_SLOT_HEAD) {
+    c=memcmp(node.data+s.offset+RecordHeader(node.info),rest+BTREE_SLOT_HEAD,n-BTREE_SLOT_HEAD);
+  }
+  if (c==0) {
+    c = s.length<length ? -1 : s.length>length ? 1 : 0;
+  }
+  return c;
+}
+
+
+// The first word of the key in s past the prefix, zero padded
+static inline unsigned long long SlotWord(const BTreeNode &node, const BTreeSlot &s)
+{
+  char word[sizeof(unsigned long long)];
+  SIZE_T n=min((SIZE_T)s.length,(SIZE_T)sizeof(word));
+
+  memset(word,0,sizeof(word));
+  memcpy(word,s.head,min(n,(SIZE_T)BTREE_SLOT_HEAD));
+  if (n>BTREE_SLOT_HEAD) {
+    memcpy(word+BTREE_SLOT_HEAD,node.data+s.offset+RecordHeader(node.info),n-BTREE_SLOT_HEAD);
+  }
+  return LoadKeyWord(word,sizeof(word));
+}
+
+
+// As CompareRest, for a key past the prefix of length bytes, at most a
+// word, loaded as word
+static inline int CompareWord(const BTreeNode &node, const BTreeSlot &s, const unsigned long long word, const SIZE_T length)
+{
+  unsigned long long w=SlotWord(node,s);
+
+  if (w!=word) {
+    return w<word ? -1 : 1;
+  }
+  return s.length<length ? -1 : s.length>length ? 1 : 0;
+}
+
+
+bool BTreeNode::SharesKeyPrefix(const KEY_T &k) const
+{
+  return k.length>=info.keyprefix && memcmp(Prefix(*this),k.data,info.keyprefix)==0;
+}
+
+
+int BTreeNode::CompareKey(const SIZE_T offset, const KEY_T &k) const
+{
+  int c=memcmp(Prefix(*this),k.data,min(info.keyprefix,k.length));
+
+  keycompares++;
+  if (c!=0) {
+    return c;
+  }
+  if (k.length<info.keyprefix) {
+    return 1;
+  }
+  return CompareRest(*this,Slots(*this)[offset],(const char*)k.data+info.keyprefix,k.length-info.keyprefix);
+}
+
+
+SIZE_T BTreeNode::SearchKey(const KEY_T &k, bool &found) const
+{
+  const BTreeSlot *slots=Slots(*this);
+  const char *rest=(const char*)k.data+info.keyprefix;
+  SIZE_T length;
+  char head[BTREE_SLOT_HEAD];
+  SIZE_T offset, end;
+
+  found=false;
+
+  if (info.numkeys==0) {
+    return 0;
+  }
+
+  // Past the prefix, only the rest of each key needs comparing, and a
+  // key that doesn't share the prefix is below or above all of them
+  if (info.keyprefix>0) {
+    int c=memcmp(Prefix(*this),k.data,min(info.keyprefix,k.length));
+    keycompares++;
+    if (c!=0) {
+      return c>0 ? 0 : info.numkeys;
+    }
+    if (k.length<info.keyprefix) {
+      return 0;
+    }
+  }
+  length=k.length-info.keyprefix;
+
+  memset(head,0,BTREE_SLOT_HEAD);
+  memcpy(head,rest,min(length,(SIZE_T)BTREE_SLOT_HEAD));
+  unsigned long long probe=LoadKeyWord(head,BTREE_SLOT_HEAD);
+  offset=SearchShortKey(slots[0].head,sizeof(BTreeSlot),BTREE_SLOT_HEAD,info.numkeys,probe);
+  if (offset==info.numkeys || LoadKeyWord(slots[offset].head,BTREE_SLOT_HEAD)!=probe) {
+    return offset;
+  }
+
+  // Every key from offset on up to end has the same head as k
+  unsigned long long next=probe+(1ULL<<(8*(sizeof(probe)-BTREE_SLOT_HEAD)));
+  end = next==0 ? info.numkeys : SearchShortKey(slots[0].head,sizeof(BTreeSlot),BTREE_SLOT_HEAD,info.numkeys,next);
+  if (length<=sizeof(probe)) {
+    char whole[sizeof(probe)];
+
+    memset(whole,0,sizeof(whole));
+    memcpy(whole,rest,length);
+    unsigned long long word=LoadKeyWord(whole,sizeof(whole));
+    while (offset<end) {
+      SIZE_T mid=offset+(end-offset)/2;
+      keycompares++;
+      if (CompareWord(*this,slots[mid],word,length)<0) {
+	offset=mid+1;
+      } else {
+	end=mid;
+      }
+    }
+    keycompares+=(offset<info.numkeys);
+    found = offset<info.numkeys && CompareWord(*this,slots[offset],word,length)==0;
+    return offset;
+  }
+  while (offset<end) {
+    SIZE_T mid=offset+(end-offset)/2;
+    keycompares++;
+    if (CompareRest(*this,slots[mid],rest,length)<0) {
+      offset=mid+1;
+    } else {
+      end=mid;
+    }
+  }
+
+  keycompares+=(offset<info.numkeys);
+  found = offset<info.numkeys && CompareRest(*this,slots[offset],rest,length)==0;
+
+  return offset;
+}
+
+
+
+ERROR_T BTreeNode::InsertKeyVal(const SIZE_T offset, const KEY_T &k, const VALUE_T &v)
+{
+  ERROR_T rc;
+
+  if (!IsLeaf(info) || offset>info.numkeys || !SharesKeyPrefix(k)) {
+    return ERROR_IMPLBUG;
+  }
+
+  SIZE_T length=k.length-info.keyprefix;
+  rc=OpenSlot(*this,offset,RecordSize(info,length,v.length));
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+  WriteSlot(*this,offset,(const char*)k.data+info.keyprefix,length,(const char*)v.data,v.length,0);
+
+  if (info.compressed) {
+    info.packed+=PackedSlotBytes(*this,offset);
+    if (info.packed>info.blocksize) {
+      RemoveSlot(offset);
+      return ERROR_NOSPACE;
+    }
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::InsertKeyPtr(const SIZE_T offset, const KEY_T &k, const SIZE_T &p)
+{
+  ERROR_T rc;
+
+  if (!HasData(info) || IsLeaf(info) || offset>info.numkeys || !SharesKeyPrefix(k)) {
+    return ERROR_IMPLBUG;
+  }
+
+  SIZE_T length=k.length-info.keyprefix;
+  rc=OpenSlot(*this,offset,RecordSize(info,length,0));
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+  WriteSlot(*this,offset,(const char*)k.data+info.keyprefix,length,0,0,p);
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::RemoveSlot(const SIZE_T offset)
+{
+  if (!HasData(info) || offset>=info.numkeys) {
+    return ERROR_IMPLBUG;
+  }
+
+  if (info.compressed) {
+    info.packed-=PackedSlotBytes(*this,offset);
+  }
+  CloseSlot(*this,offset);
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::MoveSlots(const SIZE_T offset, const SIZE_T count, BTreeNode &dest, const SIZE_T destoffset)
+{
+  SIZE_T bytes;
+  ERROR_T rc;
+
+  if (!HasData(info) || !HasData(dest.info) || &dest==this || IsLeaf(info)!=IsLeaf(dest.info) ||
+      offset+count>info.numkeys || destoffset>dest.info.numkeys) {
+    return ERROR_IMPLBUG;
+  }
+  rc=RangeBytes(*this,offset,offset+count,dest,bytes);
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+  if (bytes>dest.GetFreeBytes()) {
+    return ERROR_NOSPACE;
+  }
+
+  if (dest.info.compressed) {
+    // Try it, and put it back if it won't pack
+    BTreeNode before(dest);
+    CopySlots(*this,offset,offset+count,dest,destoffset,bytes);
+    dest.info.packed=PackedBytes(dest);
+    if (dest.info.packed>dest.info.blocksize) {
+      dest=before;
+      return ERROR_NOSPACE;
+    }
+  } else {
+    CopySlots(*this,offset,offset+count,dest,destoffset,bytes);
+  }
+
+  BTreeSlot *slots=Slots(*this);
+  for (SIZE_T i=offset;i<offset+count;i++) {
+    FreeRecord(*this,slots[i]);
+  }
+  memmove(slots+offset,slots+offset+count,(info.numkeys-offset-count)*sizeof(BTreeSlot));
+  info.numkeys-=count;
+  if (info.numkeys==0) {
+    info.heap=info.GetNumDataBytes();
+    info.holes=0;
+  }
+  if (info.compressed) {
+    info.packed=PackedBytes(*this);
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::SplitAt(const SIZE_T offset, BTreeNode &right, const KEY_T &k, const SIZE_T length)
+{
+  NodeMetadata target=info;
+
+  if (!HasData(info) || offset>info.numkeys || length>info.keysize || k.length<length) {
+    return ERROR_IMPLBUG;
+  }
+
+  target.keyprefix=length;
+  Reset(right,target);
+  memcpy(right.data,data,sizeof(SIZE_T));
+  if (length>0) {
+    memcpy(Prefix(right),k.data,length);
+  }
+  return MoveSlots(offset,info.numkeys-offset,right,0);
+}
+
+
+// Rebuilds node laid out for info, with the prefix given, keeping its
+// pointer.  return ERROR_NOSPACE, leaving node as it was, if the slots
+// don't fit.
+static ERROR_T Relayout(BTreeNode &node, const NodeMetadata &info, const char *prefix)
+{
+  BTreeNode fresh;
+  SIZE_T bytes;
+  ERROR_T rc;
+
+  Reset(fresh,info);
+  memcpy(fresh.data,node.data,sizeof(SIZE_T));
+  if (info.keyprefix>0) {
+    memcpy(Prefix(fresh),prefix,info.keyprefix);
+  }
+  rc=RangeBytes(node,0,node.info.numkeys,fresh,bytes);
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+  if (bytes>fresh.info.GetCapacity()) {
+    return ERROR_NOSPACE;
+  }
+  CopySlots(node,0,node.info.numkeys,fresh,0,bytes);
+  if (fresh.info.compressed) {
+    fresh.info.packed=PackedBytes(fresh);
+    if (fresh.info.packed>fresh.info.blocksize) {
+      return ERROR_NOSPACE;
+    }
+  }
+  node=fresh;
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::SetKeyPrefix(const KEY_T &k, const SIZE_T length)
+{
+  if (!HasData(info) || length>info.keysize || k.length<length) {
+    return ERROR_IMPLBUG;
+  }
+  if (length==info.keyprefix && (length==0 || memcmp(Prefix(*this),k.data,length)==0)) {
+    return ERROR_NOERROR;
+  }
+
+  NodeMetadata target=info;
+  target.keyprefix=length;
+  return Relayout(*this,target,(const char*)k.data);
+}
+
+
+ERROR_T BTreeNode::SetCompressed(const bool compressed)
+{
+  if (!IsLeaf(info)) {
+    return ERROR_IMPLBUG;
+  }
+  if ((info.compressed!=0)==compressed) {
+    return ERROR_NOERROR;
+  }
+
+  NodeMetadata target=info;
+  target.compressed=compressed;
+  return Relayout(*this,target,Prefix(*this));
+}
+
+
+SIZE_T GetSharedPrefix(const KEY_T &lo, const KEY_T &hi)
+{
+  SIZE_T n=0;
+
+  if (lo.length==0 || hi.length==0) {
+    return 0;
+  }
+  while (n<lo.length && n<hi.length && lo.data[n]==hi.data[n]) {
+    n++;
+  }
+  return n;
+}
+
+
+SIZE_T BTreeNode::GetUsedBytes() const
+{
+  return info.numkeys*sizeof(BTreeSlot)+(info.GetNumDataBytes()-info.heap-info.holes);
+}
+
+SIZE_T BTreeNode::GetFreeBytes() const
+{
+  return info.GetCapacity()-GetUsedBytes();
+}
+
+SIZE_T BTreeNode::GetSlotBytes(const SIZE_T offset) const
+{
+  return sizeof(BTreeSlot)+SlotRecordSize(*this,Slots(*this)[offset]);
+}
+
+SIZE_T BTreeNode::GetSlotBytes(const KEY_T &k, const SIZE_T valuelength) const
+{
+  return info.GetSlotBytes(k.length,valuelength);
+}
+
+bool BTreeNode::CheckSlots() const
+{
+  SIZE_T end=info.GetNumDataBytes();
+  SIZE_T live=0;
+
+  if (!HasData(info) || info.keyprefix>info.keysize || end>BTREE_MAX_DATA_BYTES ||
+      info.heap>end || DirEnd(info)>info.heap || info.holes>end-info.heap) {
+    return false;
+  }
+  for (SIZE_T i=0;i<info.numkeys;i++) {
+    const BTreeSlot &s=Slots(*this)[i];
+    if (s.offset<info.heap || end-s.offset<RecordHeader(info) ||
+	info.keyprefix+s.length>info.keysize ||
+	(IsLeaf(info) && ValueLength(*this,s)>info.valuesize) ||
+	SlotRecordSize(*this,s)>end-s.offset) {
+      return false;
+    }
+    live+=SlotRecordSize(*this,s);
+  }
+  if (live+info.holes!=end-info.heap) {
+    return false;
+  }
+  if (info.compressed) {
+    if (!IsLeaf(info)) {
+      return false;
+    }
+    SIZE_T packed=PackedBytes(*this);
+    return packed==info.packed && packed<=info.blocksize;
+  }
+  return true;
+}
+
+
+SIZE_T BTreeNode::GetImageSize() const
+{
+  if (info.nodetype==BTREE_SUPERBLOCK) {
+    return sizeof(info)+sizeof(SuperblockData);
+  }
+  if (!HasData(info)) {
+    return sizeof(info);
+  }
+  if (info.compressed) {
+    return info.packed;
+  }
+  return sizeof(info)+DirEnd(info)+(info.GetNumDataBytes()-info.heap);
+}
+
+void BTreeNode::GetImage(BYTE_T *image) const
+{
+  SIZE_T size=GetImageSize();
+
+  if (info.compressed) {
+    Pack(*this,image);
+    return;
+  }
+
+  // The header in page is only brought up to date by Serialize
+  memcpy(image,&info,sizeof(info));
+  if (!HasData(info)) {
+    memcpy(image+sizeof(info),page.data+sizeof(info),size-sizeof(info));
+  } else {
+    memcpy(image+sizeof(info),data,DirEnd(info));
+    memcpy(image+sizeof(info)+DirEnd(info),data+info.heap,info.GetNumDataBytes()-info.heap);
+  }
+}
+
+ERROR_T BTreeNode::SetImage(const BYTE_T *image, const SIZE_T length, const SIZE_T blocksize)
+{
+  if (length<sizeof(info) || length>blocksize) {
+    return ERROR_WRONGSIZEBLOCK;
+  }
+
+  page.Resize(blocksize,false);
+  memset(page.data,0,blocksize);
+  memcpy(&info,image,sizeof(info));
+  if (info.blocksize!=blocksize) {
+    return ERROR_WRONGSIZEBLOCK;
+  }
+  if (info.compressed) {
+    return Unpack(*this,image,length);
+  }
+  if (!HasData(info)) {
+    memcpy(page.data,image,length);
+    data=0;
+    return ERROR_NOERROR;
+  }
+
+  // The front, then the heap against the end of the block
+  SIZE_T front=sizeof(info)+DirEnd(info);
+  if (front>length || info.heap>info.GetNumDataBytes() ||
+      length-front!=info.GetNumDataBytes()-info.heap) {
+    return ERROR_WRONGSIZEBLOCK;
+  }
+  memcpy(page.data,image,front);
+  memcpy(page.data+sizeof(info)+info.heap,image+front,length-front);
+  data=(char*)page.data+sizeof(info);
+
+  return ERROR_NOERROR;
+}
+
+
+
+
+ostream & BTreeNode::Print(ostream &os) const 
+{
+  os << "BTreeNode(info="<<info;
+  if (HasData(info)) { 
+    os <<", ";
+    if (info.nodetype==BTREE_INTERIOR_NODE || info.nodetype==BTREE_ROOT_NODE) {
+      SIZE_T ptr;
+      KEY_T key;
+      os << "pointers_and_values=(";
+      if (info.numkeys>0) { // ==0 implies an empty root node
+	for (SIZE_T i=0;i<info.numkeys;i++) {
+	  GetPtr(i,ptr);
+	  os<<ptr<<", ";
+	  GetKey(i,key);
+	  os<<key<<", ";
+	}
 	GetPtr(info.numkeys,ptr);
 	os <<ptr;
       } 
@@ -345,3 +1454,481 @@ ostream & BTreeNode::Print(ostream &os) const
   os <<")";
   return os;
 }
+
+
+BTreeNodeCache::BTreeNodeCache() : capacity(0), numshards(0)
+{}
+
+BTreeNodeCache::Shard::Shard() : capacity(0), hits(0), misses(0)
+{}
+
+BTreeNodeCache::Shard & BTreeNodeCache::ShardFor(const SIZE_T block) const
+{
+  return shards[block%numshards];
+}
+
+void BTreeNodeCache::SetCapacity(const SIZE_T nodes)
+{
+  capacity=nodes;
+  numshards=min((SIZE_T)BTREE_NODE_CACHE_SHARDS,max((SIZE_T)1,nodes/BTREE_NODE_CACHE_MIN_SHARD));
+  shards.reset(nodes>0 ? new Shard[numshards] : 0);
+  for (SIZE_T i=0;i<numshards && nodes>0;i++) {
+    shards[i].capacity=nodes/numshards+(i<nodes%numshards ? 1 : 0);
+  }
+}
+
+SIZE_T BTreeNodeCache::GetCapacity() const
+{
+  return capacity;
+}
+
+void BTreeNodeCache::Clear()
+{
+  SetCapacity(capacity);
+}
+
+bool BTreeNodeCache::Lookup(const SIZE_T block, BTreeNode &node, const bool sequential)
+{
+  if (capacity==0) {
+    return false;
+  }
+
+  Shard &s=ShardFor(block);
+  lock_guard<mutex> guard(s.lock);
+  unordered_map<SIZE_T, list<Entry>::iterator>::iterator e=s.entries.find(block);
+
+  if (e==s.entries.end()) {
+    s.misses++;
+    return false;
+  }
+  s.hits++;
+  if (!sequential) {
+    s.Touch(e->second);
+  }
+  node=e->second->node;
+  return true;
+}
+
+void BTreeNodeCache::Insert(const SIZE_T block, const BTreeNode &node, const bool sequential)
+{
+  if (capacity==0) {
+    return;
+  }
+
+  Shard &s=ShardFor(block);
+  lock_guard<mutex> guard(s.lock);
+  unordered_map<SIZE_T, list<Entry>::iterator>::iterator e=s.entries.find(block);
+
+  if (e!=s.entries.end()) {
+    e->second->node=node;
+    if (!sequential) {
+      s.Touch(e->second);
+    }
+    return;
+  }
+
+  unordered_map<SIZE_T, list<SIZE_T>::iterator>::iterator g=s.ghosts.find(block);
+  Entry entry;
+
+  entry.block=block;
+  entry.node=node;
+  entry.remember=!sequential;
+  if (g!=s.ghosts.end()) {
+    // Seen recently enough to be hot
+    s.out.erase(g->second);
+    s.ghosts.erase(g);
+    entry.queue=sequential ? IN : AM;
+  } else {
+    entry.queue=IN;
+  }
+
+  if (s.entries.size()>=s.capacity) {
+    s.Evict();
+  }
+
+  list<Entry> &q = entry.queue==IN ? s.in : s.am;
+  q.push_front(entry);
+  s.entries[block]=q.begin();
+}
+
+void BTreeNodeCache::Shard::Touch(list<Entry>::iterator e)
+{
+  if (e->queue==AM) {
+    am.splice(am.begin(),am,e);
+  } else {
+    e->remember=true;
+  }
+}
+
+void BTreeNodeCache::Shard::Evict()
+{
+  SIZE_T kin=capacity/4>0 ? capacity/4 : 1;
+  SIZE_T kout=capacity/2>0 ? capacity/2 : 1;
+
+  if (!in.empty() && (in.size()>=kin || am.empty())) {
+    SIZE_T block=in.back().block;
+    bool remember=in.back().remember;
+    entries.erase(block);
+    in.pop_back();
+    if (remember) {
+      out.push_front(block);
+      ghosts[block]=out.begin();
+      if (out.size()>kout) {
+        ghosts.erase(out.back());
+        out.pop_back();
+      }
+    }
+  } else {
+    entries.erase(am.back().block);
+    am.pop_back();
+  }
+}
+
+SIZE_T BTreeNodeCache::GetHits() const
+{
+  SIZE_T hits=0;
+
+  for (SIZE_T i=0;i<numshards && capacity>0;i++) {
+    lock_guard<mutex> guard(shards[i].lock);
+    hits+=shards[i].hits;
+  }
+  return hits;
+}
+
+SIZE_T BTreeNodeCache::GetMisses() const
+{
+  SIZE_T misses=0;
+
+  for (SIZE_T i=0;i<numshards && capacity>0;i++) {
+    lock_guard<mutex> guard(shards[i].lock);
+    misses+=shards[i].misses;
+  }
+  return misses;
+}
+
+
+//
+// Log records: a header, then for each image its block, its length,
+// and its bytes.  The checksum covers everything after the header.
+//
+#define BTREE_LOG_MAGIC 0x4c575442  // "BTWL"
+
+struct BTreeLogHeader {
+  SIZE_T magic;
+  SIZE_T length;
+  SIZE_T sum;
+};
+
+static SIZE_T LogChecksum(const char *p, const SIZE_T length)
+{
+  SIZE_T h=2166136261u;  // FNV-1a
+
+  for (SIZE_T i=0;i<length;i++) {
+    h=(h^(BYTE_T)p[i])*16777619u;
+  }
+  return h;
+}
+
+static string LogRecord(const string &body)
+{
+  BTreeLogHeader h;
+
+  h.magic=BTREE_LOG_MAGIC;
+  h.length=body.size();
+  h.sum=LogChecksum(body.data(),body.size());
+  return string((const char*)&h,sizeof(h))+body;
+}
+
+static void LogImage(string &body, const SIZE_T block, const char *image, const SIZE_T length)
+{
+  body.append((const char*)&block,sizeof(block));
+  body.append((const char*)&length,sizeof(length));
+  body.append(image,length);
+}
+
+// Applies each image of each whole record in the first size bytes of
+// fd, and sets good to the end of the last whole record
+static ERROR_T ReadLogRecords(const int fd, const unsigned long long size, unsigned long long &good,
+                              BTreeLogApply apply, void *state)
+{
+  string bytes(size,'\0');
+  unsigned long long done=0;
+  ERROR_T rc;
+
+  good=0;
+  while (done<size) {
+    ssize_t n=pread(fd,&bytes[done],size-done,done);
+    if (n<=0) {
+      return ERROR_GENERAL;
+    }
+    done+=n;
+  }
+
+  while (size-good>=sizeof(BTreeLogHeader)) {
+    BTreeLogHeader h;
+    memcpy(&h,&bytes[good],sizeof(h));
+    if (h.magic!=BTREE_LOG_MAGIC || h.length>size-good-sizeof(h) ||
+        LogChecksum(&bytes[good+sizeof(h)],h.length)!=h.sum) {
+      break;  // torn by a crash while it was written
+    }
+    const char *p=&bytes[good+sizeof(h)];
+    const char *end=p+h.length;
+    while (p<end) {
+      SIZE_T block, length;
+      memcpy(&block,p,sizeof(block));
+      memcpy(&length,p+sizeof(block),sizeof(length));
+      p+=sizeof(block)+sizeof(length);
+      if (length>(SIZE_T)(end-p)) {
+        return ERROR_INSANE;
+      }
+      if ((rc=apply(block,(const BYTE_T*)p,length,state))!=ERROR_NOERROR) {
+        return rc;
+      }
+      p+=length;
+    }
+    good+=sizeof(h)+h.length;
+  }
+  return ERROR_NOERROR;
+}
+
+static ERROR_T KeepLatestImage(const SIZE_T block, const BYTE_T *image, const SIZE_T length, void *state)
+{
+  (*(map<SIZE_T,string>*)state)[block].assign((const char*)image,length);
+  return ERROR_NOERROR;
+}
+
+static void SyncDirectory(const string &path)
+{
+  size_t slash=path.rfind('/');
+  int dir=open(slash==string::npos ? "." : path.substr(0,slash+1).c_str(),O_RDONLY);
+
+  if (dir>=0) {
+    fsync(dir);
+    close(dir);
+  }
+}
+
+
+BTreeLog::BTreeLog() : fd(-1), appended(0), durable(0), flushing(false), checkpointing(false),
+                       failed(false), filesize(0), basesize(0)
+{}
+
+BTreeLog::~BTreeLog()
+{
+  Close();
+}
+
+ERROR_T BTreeLog::Open(const char *p)
+{
+  Close();
+
+  fd=open(p,O_RDWR|O_CREAT|O_APPEND,0644);
+  if (fd<0) {
+    return ERROR_NOFILE;
+  }
+  path=p;
+  pending.clear();
+  appended=durable=0;
+  failed=false;
+  filesize=basesize=lseek(fd,0,SEEK_END);
+  return ERROR_NOERROR;
+}
+
+void BTreeLog::Close()
+{
+  if (fd>=0) {
+    close(fd);
+    fd=-1;
+  }
+}
+
+bool BTreeLog::IsOpen() const
+{
+  lock_guard<mutex> guard(lock);  // a checkpoint swaps fd
+
+  return fd>=0;
+}
+
+ERROR_T BTreeLog::WriteOut(const int to, const string &bytes)
+{
+  SIZE_T done=0;
+
+  while (done<bytes.size()) {
+    ssize_t n=write(to,bytes.data()+done,bytes.size()-done);
+    if (n<0) {
+      return ERROR_GENERAL;
+    }
+    done+=n;
+  }
+  return fsync(to)==0 ? ERROR_NOERROR : ERROR_GENERAL;
+}
+
+ERROR_T BTreeLog::Replay(BTreeLogApply apply, void *state)
+{
+  unsigned long long good;
+  ERROR_T rc;
+
+  if (fd<0) {
+    return ERROR_NOERROR;
+  }
+  if ((rc=ReadLogRecords(fd,filesize,good,apply,state))!=ERROR_NOERROR) {
+    return rc;
+  }
+  if (good<filesize) {
+    if (ftruncate(fd,good)!=0 || fsync(fd)!=0) {
+      return ERROR_GENERAL;
+    }
+    filesize=good;
+  }
+  basesize=filesize;
+  return ERROR_NOERROR;
+}
+
+BTreeLSN BTreeLog::Append(const vector<BTreeLogImage> &images)
+{
+  string body;
+
+  for (SIZE_T i=0;i<images.size();i++) {
+    const BTreeNode &node=*images[i].node;
+    SIZE_T length=node.GetImageSize();
+    body.append((const char*)&images[i].block,sizeof(SIZE_T));
+    body.append((const char*)&length,sizeof(length));
+    body.resize(body.size()+length);
+    node.GetImage((BYTE_T*)&body[body.size()-length]);
+  }
+
+  string record=LogRecord(body);
+  lock_guard<mutex> guard(lock);
+  pending+=record;
+  appended+=record.size();
+  return appended;
+}
+
+ERROR_T BTreeLog::Flush(const BTreeLSN lsn, bool &synced)
+{
+  unique_lock<mutex> guard(lock);
+
+  synced=false;
+  while (durable<lsn && !failed) {
+    if (flushing) {
+      flushed.wait(guard);
+      continue;
+    }
+    // Lead: write out everything appended so far, for everyone waiting
+    string batch;
+    batch.swap(pending);
+    BTreeLSN upto=appended;
+    int to=fd;
+    flushing=true;
+    guard.unlock();
+    ERROR_T rc=WriteOut(to,batch);
+    guard.lock();
+    flushing=false;
+    if (rc==ERROR_NOERROR) {
+      durable=upto;
+      filesize+=batch.size();
+      synced=true;
+    } else {
+      failed=true;
+    }
+    flushed.notify_all();
+  }
+  return durable>=lsn ? ERROR_NOERROR : ERROR_GENERAL;
+}
+
+bool BTreeLog::NeedsCheckpoint()
+{
+  lock_guard<mutex> guard(lock);
+
+  return fd>=0 && !checkpointing && !failed && filesize>=BTREE_LOG_MIN_CHECKPOINT && filesize>=2*basesize;
+}
+
+ERROR_T BTreeLog::Checkpoint()
+{
+  unique_lock<mutex> guard(lock);
+  unsigned long long upto=filesize;
+  unsigned long long good, tailsize;
+  map<SIZE_T,string> latest;
+  string body, tail;
+  string tmppath=path+".checkpoint";
+  int from=fd;
+  int to;
+  ERROR_T rc;
+
+  if (fd<0 || checkpointing || failed) {
+    return ERROR_NOERROR;
+  }
+  checkpointing=true;
+  guard.unlock();
+
+  // The file is only ever appended to, so what was in it stays put
+  // while flushers go on adding to the end
+  rc=ReadLogRecords(from,upto,good,KeepLatestImage,&latest);
+  to=open(tmppath.c_str(),O_RDWR|O_CREAT|O_TRUNC|O_APPEND,0644);
+  if (rc==ERROR_NOERROR && to<0) {
+    rc=ERROR_NOFILE;
+  }
+  if (rc==ERROR_NOERROR) {
+    for (map<SIZE_T,string>::const_iterator i=latest.begin();i!=latest.end();++i) {
+      LogImage(body,i->first,i->second.data(),i->second.size());
+    }
+    rc=WriteOut(to,latest.empty() ? string() : LogRecord(body));
+  }
+
+  // Hold off the flushers to carry over what they added meanwhile
+  guard.lock();
+  while (flushing) {
+    flushed.wait(guard);
+  }
+  flushing=true;
+  tailsize=filesize-upto;
+  guard.unlock();
+
+  if (rc==ERROR_NOERROR) {
+    tail.resize(tailsize);
+    if (tailsize>0 && pread(from,&tail[0],tailsize,upto)!=(ssize_t)tailsize) {
+      rc=ERROR_GENERAL;
+    }
+  }
+  if (rc==ERROR_NOERROR) {
+    rc=WriteOut(to,tail);
+  }
+  if (rc==ERROR_NOERROR && rename(tmppath.c_str(),path.c_str())!=0) {
+    rc=ERROR_GENERAL;
+  }
+
+  guard.lock();
+  if (rc==ERROR_NOERROR) {
+    SyncDirectory(path);
+    close(from);
+    fd=to;
+    filesize=lseek(to,0,SEEK_END);
+    basesize=filesize-tailsize;
+  } else if (to>=0) {
+    close(to);
+    unlink(tmppath.c_str());
+  }
+  flushing=false;
+  checkpointing=false;
+  flushed.notify_all();
+  return rc;
+}
+
+ERROR_T BTreeLog::Truncate()
+{
+  unique_lock<mutex> guard(lock);
+  ERROR_T rc=ERROR_NOERROR;
+
+  while (flushing) {
+    flushed.wait(guard);
+  }
+  if (fd>=0) {
+    if (ftruncate(fd,0)!=0 || fsync(fd)!=0) {
+      rc=ERROR_GENERAL;
+    }
+    pending.clear();
+    durable=appended;
+    filesize=basesize=0;
+  }
+  return rc;
+}
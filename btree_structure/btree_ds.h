@@ -2,6 +2,13 @@
 #define _btree_ds
 
 #include <iostream>
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
 #include "global.h"
 #include "block.h"
 
@@ -26,16 +33,38 @@ struct KeyValuePair;
 
 struct NodeMetadata {
   int nodetype;
-  SIZE_T keysize; 
-  SIZE_T valuesize;
+  SIZE_T keysize;   // the longest key the index takes
+  SIZE_T valuesize; // the longest value the index takes
   SIZE_T blocksize;
   SIZE_T rootnode; //meaningful only for superblock
-  SIZE_T freelist; //meaningful only for superblock or a free block
+  SIZE_T freelist; //meaningful only for superblock or a free block, and as the previous leaf for a leaf
   SIZE_T numkeys;
+  SIZE_T keyprefix; // leading bytes every key of a tree node shares, kept once ahead of the slots
+  SIZE_T heap;      // where in data the records start; they run to the end of the block
+  SIZE_T holes;     // bytes of removed records within the heap, reclaimed when it is compacted
+  SIZE_T compressed; // nonzero for a leaf stored packed, which holds more than its block
+  SIZE_T packed;     // bytes of a compressed leaf's packed image, header included
 
   SIZE_T GetNumDataBytes() const;
-  SIZE_T GetNumSlotsAsInterior() const;
-  SIZE_T GetNumSlotsAsLeaf() const;
+  // Bytes left for the slot directory and the records after the
+  // pointer and the key prefix; the longer the prefix, the fewer
+  SIZE_T GetCapacity() const;
+  // Bytes a slot and record take for a key of keylength bytes, prefix
+  // included, and (in a leaf) a value of valuelength bytes
+  SIZE_T GetSlotBytes(const SIZE_T keylength, const SIZE_T valuelength) const;
+  // The same for the longest key and value
+  SIZE_T GetMaxSlotBytes() const;
+  // Bytes a compressed leaf's packed image takes ahead of its pairs,
+  // and for a pair after prevkey and prevvalue (empty for the first)
+  SIZE_T GetPackedHeaderBytes() const;
+  SIZE_T GetPackedPairBytes(const KEY_T &prevkey, const VALUE_T &prevvalue,
+                            const KEY_T &key, const VALUE_T &value) const;
+
+  // A node splits when a slot no longer fits, into halves about even
+  // in bytes, so either half holds at least this much.  Any node but
+  // the root holding less is underfull, and is merged or evened out
+  // with a sibling if the result fits.
+  SIZE_T GetMinBytes() const;
 
   ostream &Print(ostream &rhs) const;
 			  
@@ -45,26 +74,100 @@ struct NodeMetadata {
 inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return node.Print(os); }
 
 
+// The superblock has no slots, so the rest of its block holds these.
+// A superblock written before a field existed has it zeroed.
+struct SuperblockData {
+  SIZE_T highwater; // blocks from here to the end of the disk have never been used, so are free
+                    // (0: no mark, every free block is on the free list)
+};
+
 
+
+//
+// Nodes are slotted pages.  A tree node's data is
 //
-// Interior node:
+// PTR PREFIX SLOT SLOT SLOT ... free ... RECORD RECORD RECORD
 //
-// PTR KEY PTR KEY PTR KEY PTR
+// The slot directory grows up from the front and is kept in key order;
+// the records it points to grow down from the end of the block, in any
+// order.  A slot is the record's offset, the key's length, and its
+// first few bytes, so most compares never leave the directory.  Keys
+// and values take only the bytes they have.  A removed record leaves a
+// hole, which the heap is compacted to reclaim once new records need it.
 //
-// Leaf:
+// Interior node: a record is a key and the pointer to its left, and
+// PTR is the last pointer.  The root may have no keys and just that
+// pointer, to the only leaf, or to nothing when the tree is empty.
 //
-// PTR* KEY VALUE KEY VALUE KEY VALUE
+// Leaf: a record is a key and its value, and PTR is the next leaf in
+// key order (0 for the last one).  Leaves are doubly linked; the
+// previous leaf is kept in info.freelist, which a leaf has no other
+// use for.
 //
-// *Here this pointer is not used
+// Either way, PREFIX is the info.keyprefix bytes every key in the node
+// starts with, and each slot holds only the rest of its key.  A node's
+// prefix comes from the separators around it in its parent: any key
+// between them shares their common prefix, so every key the node can
+// ever be given already starts with it.  The root, and the nodes down
+// the first and last paths, have an open side and no prefix.
+//
+// Keys order by their bytes, and a key that is a prefix of another
+// comes first.  A key is never empty; an empty KEY_T stands for an open
+// side.  Record offsets are kept in 16 bits, which bounds the block.
+//
+// A compressed leaf is laid out the same way in memory, but over
+// BTREE_COMPRESSED_SPAN blocks' worth of data, and is packed into its
+// one block on the way out: the header, PTR and PREFIX, then each pair
+// as the bytes its key shares with the key before, the bytes that
+// follow, and its value likewise against the value before.  Sorted
+// keys and repeated values pack down to a few bytes a pair.  It is
+// unpacked when read from the buffer cache, so the node cache holds it
+// ready to use.  A change that leaves it too big to pack into its block
+// fails with ERROR_NOSPACE like one that doesn't fit a plain node.
+//
+#define BTREE_MAX_DATA_BYTES 65536
+#define BTREE_COMPRESSED_SPAN 4
+#define BTREE_SLOT_HEAD 4
+
+struct BTreeSlot {
+  unsigned short offset;      // of the record in data
+  unsigned short length;      // of the key, past the prefix
+  char head[BTREE_SLOT_HEAD]; // its first bytes, zero padded
+};
+
+// Bytes a slot and its record take, for a key of length bytes past the
+// prefix and, in a leaf, a value of valuelength bytes
+constexpr SIZE_T BTreeSlotBytes(const bool leaf, const SIZE_T length, const SIZE_T valuelength)
+{
+  return sizeof(BTreeSlot)+(leaf ? sizeof(unsigned short) : sizeof(SIZE_T))+
+    (length>BTREE_SLOT_HEAD ? length-BTREE_SLOT_HEAD : 0)+(leaf ? valuelength : 0);
+}
+
+// How many slots of that size a plain node of blocksize holds with no
+// prefix, as GetCapacity works it out
+constexpr SIZE_T BTreeNumSlots(const bool leaf, const SIZE_T blocksize, const SIZE_T keylength, const SIZE_T valuelength)
+{
+  return (blocksize-sizeof(NodeMetadata)-((sizeof(SIZE_T)+1)&~(SIZE_T)1))/BTreeSlotBytes(leaf,keylength,valuelength);
+}
 
 
 struct BTreeNode {
   NodeMetadata  info;
   char         *data;
   //
-  // unallocated or superblock => blank
+  // unallocated => blank
+  // superblock => SuperblockData
   // interior => array of keys
   // leaf => array of key/value pairs
+  //
+  // data is not a separate copy.  It points into page, which holds
+  // the whole block image exactly as read from the buffer cache:
+  // the header followed by the slots and records.  Slots are read and written
+  // in place, and Serialize only refreshes the header in page before
+  // handing it back, so a node costs no extra block copy either way.
+  // A compressed leaf's page is its unpacked form, and it is packed
+  // into a block of its own on the way out.
+  mutable Block page;
 
 
   BTreeNode();
@@ -81,28 +184,232 @@ struct BTreeNode {
   ERROR_T Serialize(BufferCache *b, const SIZE_T block) const;
   ERROR_T Unserialize(BufferCache *b, const SIZE_T block);
 
-  char *ResolveKey(const SIZE_T offset) const; // Gives a pointer to the ith key  (interior or leaf)
-  char *ResolvePtr(const SIZE_T offset) const; // Gives a pointer to the ith pointer (interior)
+  char *ResolvePtr(const SIZE_T offset) const; // Gives a pointer to the ith pointer (interior), or the next leaf (leaf)
   char *ResolveVal(const SIZE_T offset) const; // Gives a pointer to the ith value (leaf)
-  char *ResolveKeyVal(const SIZE_T offset) const ; // Gives a pointer to the ith keyvalue pair (leaf)
+  SuperblockData *ResolveSuperblock() const; // Gives a pointer to the superblock's own fields (superblock)
 
   ERROR_T GetKey(const SIZE_T offset, KEY_T &k) const ; // Gives the ith key  (interior or leaf)
   ERROR_T GetPtr(const SIZE_T offset, SIZE_T &p) const ;   // Gives the ith pointer (interior)
   ERROR_T GetVal(const SIZE_T offset, VALUE_T &v) const ; // Gives  the ith value (leaf)
   ERROR_T GetKeyVal(const SIZE_T offset, KeyValuePair &p) const; // Gives  the ith key value pair (leaf)
 
-
+  // A key or value of a new length moves its record.  These return
+  // ERROR_NOSPACE, and leave the node as it was, if it doesn't fit.
   ERROR_T SetKey(const SIZE_T offset, const KEY_T &k); // Writesthe ith key  (interior or leaf)
   ERROR_T SetPtr(const SIZE_T offset, const SIZE_T &p);   // Writes the ith pointer (interior)
   ERROR_T SetVal(const SIZE_T offset, const VALUE_T &v); // Writes the ith value (leaf)
   ERROR_T SetKeyVal(const SIZE_T offset, const KeyValuePair &p); // Writes the ith key value pair (leaf)
 
+  // Searching works directly on data and never builds a KEY_T.
+  // SearchKey returns the first offset whose key is >= key (numkeys if
+  // there is none), so on an interior node it is also the offset of the
+  // pointer to follow.  found is set if that key is equal to key.
+  int CompareKey(const SIZE_T offset, const KEY_T &k) const; // the ith key against k, <0, 0 or >0 (interior or leaf)
+                                                             // (the prefix first, then the rest)
+  SIZE_T SearchKey(const KEY_T &k, bool &found) const;
+  bool SharesKeyPrefix(const KEY_T &k) const; // k starts with the node's prefix, so the node can hold it
+
+  // Slot editing.  A leaf slot is KEY VALUE.  An interior slot is a key
+  // and the pointer to its left; the last pointer stays where it is.
+  // return ERROR_NOSPACE, leaving the node as it was, if it doesn't fit
+  ERROR_T InsertKeyVal(const SIZE_T offset, const KEY_T &k, const VALUE_T &v); // Opens a slot at offset (leaf)
+  ERROR_T InsertKeyPtr(const SIZE_T offset, const KEY_T &k, const SIZE_T &p);  // Opens a slot at offset (interior)
+  ERROR_T RemoveSlot(const SIZE_T offset); // Closes the slot at offset (numkeys-1)
+
+  // Moving slots between nodes of a kind.  The slot directory range
+  // moves in one piece and each record is copied once, laid out again
+  // only if the prefixes differ; every key moved must start with the
+  // destination's.  The source keeps holes where the records were.
+  // SplitAt makes right an empty node like this one, with a prefix of
+  // the first length bytes of k, and copies PTR to it, so an interior
+  // node's last pointer goes along and this one needs a new one.
+  // return ERROR_NOSPACE, leaving this node as it was, if they don't fit
+  ERROR_T MoveSlots(const SIZE_T offset, const SIZE_T count, BTreeNode &dest, const SIZE_T destoffset); // Moves slots [offset,offset+count) into dest at destoffset
+  ERROR_T SplitAt(const SIZE_T offset, BTreeNode &right, const KEY_T &k, const SIZE_T length); // Moves slots [offset,numkeys) into right
+
+  // Lays the slots out again keeping the first length bytes of k once,
+  // which every key must start with.  return ERROR_NOSPACE if the keys
+  // don't fit the room that leaves.
+  ERROR_T SetKeyPrefix(const KEY_T &k, const SIZE_T length);
+  // Lays a leaf out again to be stored packed, or plain.  return
+  // ERROR_NOSPACE, leaving the leaf as it was, if it doesn't fit.
+  ERROR_T SetCompressed(const bool compressed);
+
+  // Bytes of slots and records in use, out of info.GetCapacity()
+  SIZE_T GetUsedBytes() const;
+  SIZE_T GetFreeBytes() const;
+  SIZE_T GetSlotBytes(const SIZE_T offset) const; // Bytes the ith slot takes
+  SIZE_T GetSlotBytes(const KEY_T &k, const SIZE_T valuelength) const; // Bytes a slot for k would take here
+
+  // Every slot's record lies in the heap, the heap's bytes add up, no
+  // key or value is longer than the index allows, and a compressed
+  // leaf packs into its block
+  bool CheckSlots() const;
+
+  // The bytes of the block the node uses: the header, then the front
+  // of the data up to the end of the slots (or the superblock's
+  // fields), then the heap.  The free space in between means nothing,
+  // so an image of just these bytes is the node.  A compressed leaf's
+  // image is its packed form.
+  SIZE_T GetImageSize() const;
+  void GetImage(BYTE_T *image) const; // Writes GetImageSize() bytes
+  ERROR_T SetImage(const BYTE_T *image, const SIZE_T length, const SIZE_T blocksize); // Rebuilds the node from such an image
+
   ostream &Print(ostream &rhs) const;
 };
 
 
 inline ostream & operator<<(ostream &os, const BTreeNode &node) { return node.Print(os); }
 
+// Key comparisons made so far by searches on this thread
+SIZE_T GetKeyCompares();
+
+// Bytes every key in (lo,hi] starts with; none if either is empty (open)
+SIZE_T GetSharedPrefix(const KEY_T &lo, const KEY_T &hi);
+
+
+//
+// A cache of nodes by block, replaced by 2Q.  A node read once sits in
+// a FIFO (in) that takes a quarter of the capacity.  When it falls out
+// of that, only its block is remembered (out).  A node read again
+// after that is hot and goes in an LRU (am) that holds the rest.
+// Nodes touched by a sequential pass (a scan, a bulk load, a sanity
+// check) only ever go through in and are not remembered, so a pass
+// over the whole tree can't push out the hot interior nodes.
+// Every operation is O(1).  A capacity of 0 disables the cache.
+//
+// Blocks are striped over shards, each with its own lock and its own
+// share of the capacity, so threads only meet when their blocks share
+// a shard, and an eviction only ever holds its own shard.  Lookup and
+// Insert are safe from many threads; SetCapacity and Clear are not.
+//
+#define BTREE_NODE_CACHE_SHARDS 16
+#define BTREE_NODE_CACHE_MIN_SHARD 64
+
+class BTreeNodeCache {
+ private:
+  enum Queue { IN, AM };
+  struct Entry {
+    SIZE_T block;
+    Queue queue;
+    bool remember;  // touched other than sequentially, so goes to out
+    BTreeNode node;
+  };
+  struct Shard {
+    mutex lock;
+    SIZE_T capacity;
+    list<Entry> in, am;  // most recent first
+    list<SIZE_T> out;
+    unordered_map<SIZE_T, list<Entry>::iterator> entries;
+    unordered_map<SIZE_T, list<SIZE_T>::iterator> ghosts;
+    SIZE_T hits, misses;
+
+    Shard();
+    void Touch(list<Entry>::iterator e);
+    void Evict();
+  };
+
+  SIZE_T capacity;
+  SIZE_T numshards;
+  unique_ptr<Shard[]> shards;
+
+  // Not copyable; the maps point into the lists
+  BTreeNodeCache(const BTreeNodeCache &rhs);
+  BTreeNodeCache & operator=(const BTreeNodeCache &rhs);
+
+  Shard &ShardFor(const SIZE_T block) const;
+
+ public:
+  BTreeNodeCache();
+
+  void SetCapacity(const SIZE_T nodes); // Empties the cache
+  SIZE_T GetCapacity() const;
+
+  bool Lookup(const SIZE_T block, BTreeNode &node, const bool sequential); // Gives a copy of the cached node, if any
+  void Insert(const SIZE_T block, const BTreeNode &node, const bool sequential); // After a read or a write of block
+  void Clear();
+
+  SIZE_T GetHits() const;
+  SIZE_T GetMisses() const;
+};
+
+
+//
+// A redo log of node images, kept in a file beside the disk.  A record
+// holds the images of the nodes one operation wrote, so replaying the
+// whole records in order, and ignoring a torn one at the end, brings
+// every block they name to its last committed state, however many of
+// the buffer cache's writes reached the disk.  Replaying twice is the
+// same as once.
+//
+// Append only buffers a record.  Flush returns once the record is on
+// disk.  Whichever flusher gets there first writes and syncs everything
+// appended so far, and the ones that arrive meanwhile wait for it and
+// share the next sync, so concurrent operations commit with one
+// sequential write and one sync between them.
+//
+// The log is never told when the buffer cache has written a block
+// out, so it can't just drop old records.  Checkpoint rewrites it
+// instead, with one record of the latest image of each block, while
+// operations go on appending; the file then grows to twice that size
+// before the next one.  Truncate empties it, which is only safe once
+// the cache has written out every block.
+//
+typedef unsigned long long BTreeLSN;  // bytes appended since the log was opened
+
+struct BTreeLogImage {
+  SIZE_T block;
+  const BTreeNode *node;
+};
+
+// Called by Replay on each image in the log, in order
+typedef ERROR_T (*BTreeLogApply)(const SIZE_T block, const BYTE_T *image, const SIZE_T length, void *state);
+
+#define BTREE_LOG_MIN_CHECKPOINT (1024*1024)
+
+class BTreeLog {
+ private:
+  string path;
+  int fd;  // -1 if closed
+  mutable mutex lock;
+  condition_variable flushed;
+  string pending;          // appended, not yet written
+  BTreeLSN appended;
+  BTreeLSN durable;
+  bool flushing;           // a flusher, or a checkpoint finishing, has the file
+  bool checkpointing;
+  bool failed;             // a write or sync failed; nothing more is durable
+  unsigned long long filesize;
+  unsigned long long basesize;  // just after the last checkpoint or replay
+
+  // Not copyable
+  BTreeLog(const BTreeLog &rhs);
+  BTreeLog & operator=(const BTreeLog &rhs);
+
+  ERROR_T WriteOut(const int to, const string &bytes);
+
+ public:
+  BTreeLog();
+  ~BTreeLog();
+
+  // return ERROR_NOFILE if path can't be opened or created
+  ERROR_T Open(const char *path);
+  void Close();
+  bool IsOpen() const;
+
+  // Applies every whole record, then cuts off whatever follows them
+  ERROR_T Replay(BTreeLogApply apply, void *state);
+
+  BTreeLSN Append(const vector<BTreeLogImage> &images); // Gives the end of the record
+  // Returns once everything up to lsn is on disk; sets synced if this
+  // call did the sync.  return ERROR_GENERAL if it can't be made durable
+  ERROR_T Flush(const BTreeLSN lsn, bool &synced);
+
+  bool NeedsCheckpoint();
+  ERROR_T Checkpoint();
+  ERROR_T Truncate();
+};
+
 
 
 
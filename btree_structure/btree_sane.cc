@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <fstream>
+#include <thread>
+#include "btree.h"
+
+void usage() 
+{
+  cerr << "usage: btree_sane filestem cachesize [numthreads]\n";
+}
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize;
+  SIZE_T superblocknum;
+  unsigned numthreads;
+
+  if (argc!=3 && argc!=4) { 
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  numthreads=(argc==4) ? atoi(argv[3]) : thread::hardware_concurrency();
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(0,0,&cache);
+  BTreeStats stats;
+  
+  ERROR_T rc;
+  bool sane;
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) { 
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if (getenv("BTREE_NODE_CACHE")) { 
+    btree.SetNodeCacheSize(atoi(getenv("BTREE_NODE_CACHE")));
+  }
+
+  if (getenv("BTREE_LOG") && (rc=btree.OpenLog(getenv("BTREE_LOG")))!=ERROR_NOERROR) { 
+    cerr << "Can't open log due to error "<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Attach(0))!=ERROR_NOERROR) { 
+    cerr << "Can't attach to index  due to error "<<rc<<endl;
+    return -1;
+  } else {
+    cerr << "Index attached!"<<endl;
+    sane=(rc=btree.SanityCheck(stats,numthreads))==ERROR_NOERROR;
+    if (!sane) { 
+      cerr <<"Index is not sane due to error "<<rc<<endl;
+    } else {
+      cerr <<"Index is sane\n";
+    }
+    cout << stats;
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+    if ((rc=cache.Detach())!=ERROR_NOERROR) { 
+      cerr <<"Can't detach from cache due to error "<<rc<<endl;
+      return -1;
+    }
+    if ((rc=btree.CloseLog(true))!=ERROR_NOERROR) { 
+      cerr <<"Can't empty log due to error "<<rc<<endl;
+      return -1;
+    }
+    cerr << "Performance statistics:\n";
+    
+    cerr << "numallocs       = "<<cache.GetNumAllocs()<<endl;
+    cerr << "numdeallocs     = "<<cache.GetNumDeallocs()<<endl;
+    cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+    cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+    cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+    cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+    cerr << endl;
+    
+    cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+    if (getenv("BTREE_STATS_JSON")) { 
+      ofstream statsfile(getenv("BTREE_STATS_JSON"));
+      btree.PrintOpStatsJSON(statsfile);
+    }
+
+    return sane ? 0 : -1;
+  }
+}
@@ -0,0 +1,348 @@
+#ifndef _btree_typed
+#define _btree_typed
+
+#include <type_traits>
+#include <utility>
+
+#include "btree.h"
+
+// A front end to BTreeIndex for keys and values of fixed-width C++
+// types.  A codec turns a type into the bytes the index stores and
+// back:
+//
+//   static constexpr SIZE_T size;               bytes, the same for every value
+//   static void Encode(const T &x, BYTE_T *p);  writes size bytes
+//   static void Decode(const BYTE_T *p, T &x);  reads them
+//
+// A key codec must also keep order: the index orders keys by their
+// bytes, so a < b must hold exactly when a's bytes come before b's.
+// The index underneath is an ordinary one, sized to the codecs, on the
+// same disk format and buffer cache, so the btree_* tools read it too.
+
+// Integers, most significant byte first, with the sign bit flipped for
+// signed types, so their bytes order as the numbers do.  Keys of up to
+// eight bytes past a node's prefix are compared whole, as big-endian
+// words, by the node search.
+template <typename T>
+struct BTreeIntCodec
+{
+  static_assert(std::is_integral<T>::value, "BTreeIntCodec is for integer types");
+  typedef typename std::make_unsigned<T>::type U;
+
+  static constexpr SIZE_T size = sizeof(T);
+
+  static void Encode(const T &x, BYTE_T *p)
+  {
+    U u = (U)x;
+    if (std::is_signed<T>::value)
+    {
+      u ^= (U)((U)1 << (8 * sizeof(T) - 1));
+    }
+    for (SIZE_T i = sizeof(T); i > 0; i--)
+    {
+      p[i - 1] = (BYTE_T)u;
+      u = (U)(u >> 8);
+    }
+  }
+
+  static void Decode(const BYTE_T *p, T &x)
+  {
+    U u = 0;
+    for (SIZE_T i = 0; i < sizeof(T); i++)
+    {
+      u = (U)((u << 8) | p[i]);
+    }
+    if (std::is_signed<T>::value)
+    {
+      u ^= (U)((U)1 << (8 * sizeof(T) - 1));
+    }
+    x = (T)u;
+  }
+};
+
+template <typename K, typename V, typename KeyCodec = BTreeIntCodec<K>, typename ValueCodec = BTreeIntCodec<V> >
+class BTreeIndexT
+{
+public:
+  // As BTreeScanCallback and BTreeBulkLoadSource, decoded
+  typedef bool (*ScanCallback)(const K &key, const V &value, void *state);
+  typedef ERROR_T (*BulkLoadSource)(K &key, V &value, void *state);
+
+  // Slots a node of blocksize holds with these sizes and no key prefix.
+  // A prefix only frees room, so this is the least a full node holds.
+  static constexpr SIZE_T GetNumSlotsAsLeaf(const SIZE_T blocksize)
+  {
+    return BTreeNumSlots(true, blocksize, KeyCodec::size, ValueCodec::size);
+  }
+  static constexpr SIZE_T GetNumSlotsAsInterior(const SIZE_T blocksize)
+  {
+    return BTreeNumSlots(false, blocksize, KeyCodec::size, 0);
+  }
+
+  BTreeIndexT(BufferCache *cache, bool unique = true)
+    : index(KeyCodec::size, ValueCodec::size, cache, unique)
+  {
+  }
+
+  // The index underneath, for everything that takes no keys: logging,
+  // policies, the node cache, stats, SanityCheck, Display, Detach
+  BTreeIndex &GetIndex() { return index; }
+  const BTreeIndex &GetIndex() const { return index; }
+
+  // As BTreeIndex::Attach
+  // return ERROR_BADCONFIG, detached again, if the index on the disk
+  // has other sizes than the codecs
+  ERROR_T Attach(const SIZE_T initblock, const bool create = false)
+  {
+    SIZE_T block = initblock;
+    ERROR_T rc = index.Attach(initblock, create);
+
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    if (index.GetKeySize() != KeyCodec::size || index.GetValueSize() != ValueCodec::size)
+    {
+      index.Detach(block);
+      return ERROR_BADCONFIG;
+    }
+    return ERROR_NOERROR;
+  }
+
+  // As the BTreeIndex operations of the same names.  A pair written
+  // through BTreeIndex with a shorter key or value than the codecs'
+  // can't be decoded: Lookup returns ERROR_SIZE for it, and Scan
+  // passes over it.
+  ERROR_T Insert(const K &key, const V &value)
+  {
+    Buffers &b = GetBuffers();
+
+    if (!EncodeKey(key, b.key) || !EncodeValue(value, b.value))
+    {
+      return ERROR_NOMEM;
+    }
+    return index.Insert(b.key, b.value);
+  }
+
+  ERROR_T Update(const K &key, const V &value)
+  {
+    Buffers &b = GetBuffers();
+
+    if (!EncodeKey(key, b.key) || !EncodeValue(value, b.value))
+    {
+      return ERROR_NOMEM;
+    }
+    return index.Update(b.key, b.value);
+  }
+
+  ERROR_T Delete(const K &key)
+  {
+    Buffers &b = GetBuffers();
+
+    if (!EncodeKey(key, b.key))
+    {
+      return ERROR_NOMEM;
+    }
+    return index.Delete(b.key);
+  }
+
+  ERROR_T Lookup(const K &key, V &value)
+  {
+    Buffers &b = GetBuffers();
+    ERROR_T rc;
+
+    if (!EncodeKey(key, b.key))
+    {
+      return ERROR_NOMEM;
+    }
+    rc = index.Lookup(b.key, b.value);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    return DecodeValue(b.value, value) ? ERROR_NOERROR : ERROR_SIZE;
+  }
+
+  ERROR_T BulkLoad(BulkLoadSource source, void *state, const double fillfactor = 1.0)
+  {
+    BulkLoadState s = { source, state };
+
+    return index.BulkLoad(BulkLoadPair, &s, fillfactor);
+  }
+
+  ERROR_T InsertBatch(const vector<pair<K, V> > &pairs, vector<ERROR_T> &results)
+  {
+    vector<KeyValuePair> encoded(pairs.size());
+
+    for (SIZE_T i = 0; i < pairs.size(); i++)
+    {
+      if (!EncodeKey(pairs[i].first, encoded[i].key) || !EncodeValue(pairs[i].second, encoded[i].value))
+      {
+        return ERROR_NOMEM;
+      }
+    }
+    return index.InsertBatch(encoded, results);
+  }
+
+  ERROR_T LookupBatch(const vector<K> &keys, vector<V> &values, vector<ERROR_T> &results)
+  {
+    vector<KEY_T> encoded;
+    vector<VALUE_T> found;
+    ERROR_T rc;
+
+    if (!EncodeKeys(keys, encoded))
+    {
+      return ERROR_NOMEM;
+    }
+    rc = index.LookupBatch(encoded, found, results);
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    values.assign(keys.size(), V());
+    for (SIZE_T i = 0; i < keys.size(); i++)
+    {
+      if (results[i] == ERROR_NOERROR && !DecodeValue(found[i], values[i]))
+      {
+        results[i] = ERROR_SIZE;
+      }
+    }
+    return ERROR_NOERROR;
+  }
+
+  ERROR_T DeleteBatch(const vector<K> &keys, vector<ERROR_T> &results)
+  {
+    vector<KEY_T> encoded;
+
+    if (!EncodeKeys(keys, encoded))
+    {
+      return ERROR_NOMEM;
+    }
+    return index.DeleteBatch(encoded, results);
+  }
+
+  // The bounds stay out of the thread's buffers, which callback may
+  // use through this index
+  ERROR_T Scan(const K &lo, const K &hi, ScanCallback callback, void *state) const
+  {
+    ScanState s = { callback, state };
+    KEY_T l;
+    KEY_T h;
+
+    if (!EncodeKey(lo, l) || !EncodeKey(hi, h))
+    {
+      return ERROR_NOMEM;
+    }
+    return index.Scan(l, h, ScanPair, &s);
+  }
+
+private:
+  struct BulkLoadState
+  {
+    BulkLoadSource source;
+    void *state;
+  };
+
+  struct ScanState
+  {
+    ScanCallback callback;
+    void *state;
+  };
+
+  // What a thread encodes a pair into and looks a value up into, kept
+  // from call to call, so once sized they are only written over
+  struct Buffers
+  {
+    KEY_T key;
+    VALUE_T value;
+  };
+
+  static Buffers &GetBuffers()
+  {
+    static thread_local Buffers buffers;
+    return buffers;
+  }
+
+  // Encode into k or v, which only allocate if they have never held
+  // as much
+  // return false if there is no memory for it
+  static bool EncodeKey(const K &key, KEY_T &k)
+  {
+    if (k.Resize(KeyCodec::size, false) != ERROR_NOERROR)
+    {
+      return false;
+    }
+    KeyCodec::Encode(key, k.data);
+    return true;
+  }
+
+  static bool EncodeValue(const V &value, VALUE_T &v)
+  {
+    if (v.Resize(ValueCodec::size, false) != ERROR_NOERROR)
+    {
+      return false;
+    }
+    ValueCodec::Encode(value, v.data);
+    return true;
+  }
+
+  static bool EncodeKeys(const vector<K> &keys, vector<KEY_T> &encoded)
+  {
+    encoded.resize(keys.size());
+    for (SIZE_T i = 0; i < keys.size(); i++)
+    {
+      if (!EncodeKey(keys[i], encoded[i]))
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static bool DecodeValue(const VALUE_T &v, V &value)
+  {
+    if (v.length != ValueCodec::size)
+    {
+      return false;
+    }
+    ValueCodec::Decode(v.data, value);
+    return true;
+  }
+
+  // Encodes into pair's buffers, which BulkLoad hands back each time
+  static ERROR_T BulkLoadPair(KeyValuePair &pair, void *state)
+  {
+    BulkLoadState *s = (BulkLoadState *) state;
+    K key;
+    V value;
+    ERROR_T rc = s->source(key, value, s->state);
+
+    if (rc != ERROR_NOERROR)
+    {
+      return rc;
+    }
+    if (!EncodeKey(key, pair.key) || !EncodeValue(value, pair.value))
+    {
+      return ERROR_NOMEM;
+    }
+    return ERROR_NOERROR;
+  }
+
+  static bool ScanPair(const KEY_T &k, const VALUE_T &v, void *state)
+  {
+    ScanState *s = (ScanState *) state;
+    K key;
+    V value;
+
+    if (k.length != KeyCodec::size || !DecodeValue(v, value))
+    {
+      return true;
+    }
+    KeyCodec::Decode(k.data, key);
+    return s->callback(key, value, s->state);
+  }
+
+  BTreeIndex index;
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <fstream>
 #include "btree.h"
 
 void usage() 
@@ -35,6 +36,21 @@ int main(int argc, char **argv)
     return -1;
   }
 
+  if (getenv("BTREE_ALLOC_NEAR") && 
+      (rc=btree.SetAllocPolicy(BTREE_ALLOC_NEAR,atoi(getenv("BTREE_ALLOC_NEAR"))))!=ERROR_NOERROR) { 
+    cerr << "Can't set allocation policy due to error "<<rc<<endl;
+    return -1;
+  }
+
+  if (getenv("BTREE_NODE_CACHE")) { 
+    btree.SetNodeCacheSize(atoi(getenv("BTREE_NODE_CACHE")));
+  }
+
+  if (getenv("BTREE_LOG") && (rc=btree.OpenLog(getenv("BTREE_LOG")))!=ERROR_NOERROR) { 
+    cerr << "Can't open log due to error "<<rc<<endl;
+    return -1;
+  }
+
   if ((rc=btree.Attach(0))!=ERROR_NOERROR) { 
     cerr << "Can't attach to index  due to error "<<rc<<endl;
     return -1;
@@ -53,6 +69,10 @@ int main(int argc, char **argv)
       cerr <<"Can't detach from cache due to error "<<rc<<endl;
       return -1;
     }
+    if ((rc=btree.CloseLog(true))!=ERROR_NOERROR) { 
+      cerr <<"Can't empty log due to error "<<rc<<endl;
+      return -1;
+    }
     cerr << "Performance statistics:\n";
     
     cerr << "numallocs       = "<<cache.GetNumAllocs()<<endl;
@@ -65,6 +85,11 @@ int main(int argc, char **argv)
     
     cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
 
+    if (getenv("BTREE_STATS_JSON")) { 
+      ofstream statsfile(getenv("BTREE_STATS_JSON"));
+      btree.PrintOpStatsJSON(statsfile);
+    }
+
     return 0;
   }
 }
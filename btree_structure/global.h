@@ -25,6 +25,11 @@ const ERROR_T ERROR_NOFILE=-13;
 const ERROR_T ERROR_UNIMPL=-14;
 const ERROR_T ERROR_INSANE=-15;
 
+// Used inside the btree only
+const ERROR_T ERROR_SPLIT_BLOCK=-16;
+const ERROR_T ERROR_UNDERFLOW_BLOCK=-17;
+const ERROR_T ERROR_UNIQUE_KEY=ERROR_CONFLICT;
+
 struct GenericException {};
 
 